@@ -0,0 +1,33 @@
+//预先翻译(AOT)的ROM的运行时
+//tools/ch8_aot.c把ROM中从0x200开始可达的代码按基本块翻译成C函数, 生成的文件和核心库一起编译
+//运行时按PC查表执行块, 查不到的地址(比如BNNN跳到的地方)和被改写过的代码交给解释器
+//块按翻译时的兼容性配置(quirks.h)生成, 用别的配置运行时全部交给解释器
+
+#ifndef AOT_H
+#define AOT_H
+
+#include "chip8.h"
+
+//块的C函数: 执行整个块, 返回块执行完之后的PC
+typedef u32 (*aot_block_fn)(chip8_t *chip8, const config_t *config);
+
+//一个翻译好的基本块
+typedef struct {
+    aot_block_fn fn;
+    u16 insts;  //块内的指令数
+    u16 len;    //块占的字节数
+    u64 pages;  //块覆盖的64字节内存页(按位)
+    const u8 *code; //翻译时块的原始字节, 所在页被写过时用来确认代码是否真的被改写
+    bool draws; //块以DXYN结尾, 执行完要结束这一帧
+} aot_block_t;
+
+//整个ROM的翻译结果, 由生成的C文件定义
+typedef struct {
+    const char *rom_name;   //翻译时的ROM路径
+    quirks_profile_t quirks;    //翻译时的兼容性配置
+    const aot_block_t *blocks[4096];    //按块的起始PC索引, NULL表示这里不是已知块的开头
+} aot_program_t;
+
+u32 run_aot(chip8_t *chip8, const config_t config, const aot_program_t *program, const u32 count);  //语义同run_instructions
+
+#endif //AOT_H
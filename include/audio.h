@@ -0,0 +1,62 @@
+//声音合成: 模拟线程按采样安排声音的变化, 音频回调用带限阶跃(BLEP)合成, 没有朴素方波的混叠
+//普通的蜂鸣器和XO-CHIP的128位样本都当作1位的样本循环播放: 蜂鸣器是0和1交替, 每秒2 * square_wave_freq位;
+//XO-CHIP是F002载入的样本, 每秒4000 * 2^((pitch - 64) / 48)位
+//每次0和1之间跳变, 就把预先算好的带限阶跃按跳变在采样之间的位置叠加进去, 再积分得到输出
+
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include <stdatomic.h>
+
+#include "chip8.h"
+
+#define AUDIO_EVENT_QUEUE 64    //2的幂
+#define AUDIO_RAMP 64       //开关声音时音量渐变的采样数(约1.5毫秒), 避免声音突然出现或消失时的爆音
+#define BLEP_TAPS 32        //一次跳变影响的采样数, 输出因此晚BLEP_TAPS / 2个采样
+#define BLEP_PHASES 64      //跳变在两个采样之间的位置分成多少档
+#define SYNTH_CHUNK 512     //一次合成的采样数, 大的缓冲区分几次合成
+
+//声音状态的一次变化: 模拟线程换算成音频采样的时刻放进队列, 音频回调在缓冲区里的那个采样切换
+typedef struct {
+    u64 sample; //从音频设备开始播放起的第几个采样
+    bool on;    //sound_timer > 0
+    bool xo_audio;  //按pattern和pitch播放, 否则是蜂鸣器
+    u8 pitch;
+    u8 pattern[16];
+} audio_event_t;
+
+//模拟线程, 音频回调和SDL线程共享的音频状态
+//事件队列是无锁单生产者单消费者队列: 模拟线程写tail, 音频回调写head
+typedef struct {
+    audio_event_t events[AUDIO_EVENT_QUEUE];
+    _Alignas(64) _Atomic u32 head;  //下一个要处理的事件
+    _Alignas(64) _Atomic u32 tail;  //下一个空位
+    _Atomic u64 position;   //音频回调已经生成的采样数, 模拟线程据此安排事件的时刻
+    _Atomic u16 volume;     //SDL线程调节音量
+    _Atomic u32 underruns;  //事件到得太晚, 它的采样已经生成过了, 只能在下一个缓冲区开头生效
+    _Atomic u32 overruns;   //队列满了, 事件被丢弃
+    u32 sample_rate;    //音频设备实际的采样率
+    u32 latency;        //事件安排在position之后多少个采样
+
+    //以下只由音频回调使用
+    audio_event_t voice;    //当前的声音
+    u64 beep_step;      //蜂鸣器每个采样前进的位数, 32.32定点
+    u64 pitch_step[256];    //XO-CHIP每种音高每个采样前进的位数, 32.32定点
+    u64 step;           //当前的播放速度
+    u64 phase;          //在128位样本中的位置, 32.32定点
+    bool level;         //当前这一位
+    u32 gain;           //0~AUDIO_RAMP, 声音开着就逐渐增大, 关了就逐渐减小
+    float integrator;   //跳变的累加, 就是带限后的波形
+    float deltas[SYNTH_CHUNK + BLEP_TAPS];  //叠加好的跳变, 超出这次合成的部分留给下一次
+    u64 synth_ticks;    //合成的累计耗时(SDL_GetPerformanceCounter刻度)
+    u64 buffers;        //合成了多少个缓冲区
+} audio_t;
+
+void init_audio(audio_t *audio, const config_t *config, const u32 sample_rate, const u32 buffer_samples);
+bool push_audio_event(audio_t *audio, const audio_event_t *event);    //模拟线程调用, 队列满了返回false
+//音频回调函数用于实时处理和生成音频数据。它是一个用户定义的函数，当音频设备需要新的音频数据时，音频系统会调用这个函数, 他向音频缓冲区填充数据
+//userdata 指向audio_t; stream 指向音频缓冲区的指针; len 缓冲区的长度, 以字节为单位
+void audio_callback(void *userdata, u8 *stream, int len);  /* **音频在计算机内的生成** */
+void benchmark_audio(const config_t config); //不打开音频设备, 测量44100Hz和48000Hz下合成一个缓冲区的耗时
+
+#endif //AUDIO_H
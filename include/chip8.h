@@ -5,13 +5,15 @@
 #ifndef CHIP8_H
 #define CHIP8_H
 
+#include <stddef.h>
 #include <stdint.h>
-#include "SDL.h"
+#include <stdbool.h>
 
 #define u8 uint8_t  //1B
 #define u16 uint16_t    //2B
 #define u32 uint32_t    //4B
 #define u64 uint64_t    //8B
+#define u128 unsigned __int128  //16B, GCC扩展, 高分辨率屏幕的一行
 
 
 //状态枚举
@@ -31,63 +33,254 @@ typedef struct {
     u8 Y;   //指令中低字节的高4位
 } instruction_t;
 
+//预解码后的指令, 预解码缓存引擎中每个内存地址对应一条
+typedef struct {
+    u8 op;  //处理程序编号, 0表示还没有解码
+    u8 X;
+    u8 Y;
+    u8 N;
+    u8 NN;
+    u16 NNN;
+} decoded_t;
+
+//解释器引擎
+typedef enum {
+    ENGINE_SWITCH,  //参考实现: 每条指令重新取指, 解码, 用switch分发
+    ENGINE_CACHED,  //预解码缓存: 每个地址只解码一次, 用computed goto分发
+    ENGINE_JIT,     //x86-64动态重编译, 不支持的指令交给解释器
+} engine_t;
+
+//兼容性配置: 各个CHIP-8变种在几条指令上的行为不同, 见quirks.h
+typedef enum {
+    QUIRKS_VIP,     //COSMAC VIP上最初的CHIP-8
+    QUIRKS_CHIP48,  //HP-48计算器上的CHIP-48
+    QUIRKS_SCHIP,   //SUPER-CHIP 1.1
+    QUIRKS_XOCHIP,  //XO-CHIP
+    QUIRKS_COUNT,
+} quirks_profile_t;
+
+//屏幕: SUPER-CHIP的高分辨率是128x64, 低分辨率是64x32; XO-CHIP有4个位平面, 每个像素的颜色是各个平面的位
+#define DISPLAY_WIDTH 128
+#define DISPLAY_HEIGHT 64
+#define DISPLAY_PLANES 4
+
+//上次取走以来屏幕上变过的区域, 坐标是当前分辨率的像素: rows的第y位是第y行, 列是[left, right); rows为0表示没有变
+//前端只把这些行的这几列重新上传到纹理; 一块矩形足够覆盖一个sprite, 多个sprite合并成包住它们的列
+typedef struct {
+    u64 rows;
+    u8 left, right;
+} dirty_t;
+
+//把rows行的[left, right)列并进dirty
+static inline void mark_dirty(dirty_t *dirty, const u64 rows, const u8 left, const u8 right) {
+    if (!rows) return;
+    if (!dirty->rows || left < dirty->left) dirty->left = left;
+    if (!dirty->rows || right > dirty->right) dirty->right = right;
+    dirty->rows |= rows;
+}
+
+//裁到width x height的屏幕上: 整屏的变化记的是所有行和列, 低分辨率时只有左上角在屏幕上
+static inline dirty_t clip_dirty(dirty_t dirty, const u32 width, const u32 height) {
+    if (height < 64) dirty.rows &= ((u64)1 << height) - 1;
+    if (dirty.right > width) dirty.right = width;
+    if (dirty.left >= dirty.right) dirty.rows = 0;
+    return dirty;
+}
+
+//高分辨率和XO-CHIP位平面用的整块屏幕(4 KiB), ROM第一次打开它们(00FF, FN01选了第一个以外的平面)时才分配
+//只用低分辨率的第一个位平面的虚拟机一直用chip8_t里256字节的display, 大批虚拟机同时存在时每个都保持很小
+typedef struct {
+    u128 rows[DISPLAY_PLANES][DISPLAY_HEIGHT];  //每个位平面每行的像素压缩成一个u128, 最高位是x = 0; 低分辨率只用前32行的高64位
+} screen_t;
+
+#define PAGE_SIZE 256   //写时复制的内存页大小
+#define PAGE_COUNT (4096 / PAGE_SIZE)
+
+//同一个ROM的所有虚拟机共享的只读内存镜像: 载入了字体和ROM的内存, 以及预先解码好的每个地址的指令
+typedef struct {
+    u8 ram[4096];
+    decoded_t decoded[4096];
+    u64 hash;   //ram的hash_bytes, 存档用它确认是同一个ROM
+} rom_image_t;
+
+struct chip8_pool;
+struct trace;
+struct metrics;
+struct profile;
+struct heatmap;
+
 //chip8类型
+//内存按页存放: 没被写过的页直接指向共享的rom_image_t, 第一次写入时才复制一份(写时复制)
+//只保存虚拟机状态, 渲染用的数据放在前端, 整个结构体可以直接复制
 typedef struct {
     u8 V[16]; //V0~VF
     u16 stk[16];    //栈, 栈中存的是指令的地址, 即PC
-    u16 *SP;  //指向栈顶, 相关文档中写的是8位的寄存器, 不过在模拟中为了方便把stk的地址赋给它就定义为16位的
+    u8 SP;  //栈顶下标, stk[SP]是下一个空位
     u16 I;  //索引寄存器, 只用了12位
     u16 PC; //程序计数器, 只用了12位, 存的是指令的地址
     u8 delay_timer;    //延迟计时器
     u8 sound_timer;    //声音计时器
-    u8 ram[4096];   //内存0x000~0xFFF
-    bool display[64 * 32];   //屏幕, 共2048b, 表示每个像素是否会被渲染
-    u32 pixel_color[64 * 32];   //存储每个像素的颜色信息
+    u8 wait_key;    //FX0A: 已经按下、等待松开的键, 0xFF表示还没有键按下
+    bool key_wait;  //停在FX0A上等键盘变化, PC指向这条FX0A; 调度器在key_wait_ready之前不执行指令
+    bool draw;  //是否渲染窗口
+    bool owns_image;    //image是init_chip8自己载入的, free_chip8时一起释放
+    bool vblank_wait;   //DXYN之后在等下一次60Hz刷新(config.display_wait), 由调度器清除
+    u16 private_ram;    //ram中哪些页是自己的拷贝(按位)
+    u16 private_decoded;    //decoded中哪些页是自己的(按位)
+    emulator_state_t state; //虚拟机当前状态
+    u32 rng;    //CXNN用的随机数发生器状态, 每个虚拟机独立, 由config.seed初始化
     bool keypad[16];   //键盘, 0~F
+    u8 audio_pattern[16];   //XO-CHIP F002: 128位的声音样本, 声音开着时循环播放
+    u8 pitch;   //XO-CHIP FX3A: 样本的播放速度是每秒4000 * 2^((pitch - 64) / 48)位
+    bool xo_audio;  //执行过F002, 之后按audio_pattern发声, 否则是普通的方波蜂鸣器
+    u64 display[DISPLAY_HEIGHT / 2];    //低分辨率第一个位平面的屏幕, 每行64个像素压缩成一个u64, 最高位是x = 0; 有screen之后不再使用
+    screen_t *screen;   //NULL表示整个屏幕就是display; 打开高分辨率或别的位平面时从分配池分配, 重置之前一直使用
+    bool hires;     //SUPER-CHIP 00FF打开的128x64高分辨率
+    u8 planes;      //XO-CHIP FN01选中的位平面(按位), 绘制, 清屏和滚屏只作用于这些平面
+    dirty_t dirty;  //屏幕上还没有被前端取走的变化, 不算虚拟机状态, 存档和比较状态时不管它
+    u64 written_pages;  //被指令写过的64字节内存页(按位), 用来检测自修改代码
+    u8 *ram[PAGE_COUNT];    //内存0x000~0xFFF, 每页指向共享镜像或者自己的拷贝, 用ram_read/ram_write访问
+    decoded_t *decoded[PAGE_COUNT]; //预解码缓存, 每页指向共享镜像, 全部未解码的页或者自己的页; 写内存时对应的项会作废
+    const rom_image_t *image;   //共享的内存镜像
     const char *rom_name;   //当前运行的游戏
     instruction_t inst; //当前正在执行的指令
-    bool draw;  //是否渲染窗口
-    emulator_state_t state; //虚拟机当前状态
+    struct jit *jit;    //JIT翻译缓存, 第一次用JIT引擎执行时才分配
+    struct chip8_pool *pool;    //私有页从这里分配, NULL表示用malloc
+    struct trace *trace;    //非NULL时每条指令记进这个跟踪缓冲区(trace.h), 重置时保留
+    struct metrics *metrics;    //非NULL时统计执行次数(metrics.h), 重置时保留
+    struct profile *profile;    //非NULL时由调度器定期采样调用栈(profile.h), 重置时保留
+    struct heatmap *heatmap;    //非NULL时记下每个字节被访问的次数(heatmap.h), 重置时保留
 } chip8_t;
 
-//sdl的一些设置
-typedef struct {
-    SDL_Window *window; //窗口
-    SDL_Renderer *renderer; //渲染器
-    
-    /*
-    在调用 SDL_OpenAudioDevice 之后，have 结构将包含实际的音频设备配置。
-    如果音频设备不完全支持 want 中的配置，SDL 会尽量匹配，并在 have 中返回实际使用的配置。
-    */
-    SDL_AudioSpec want, have;   //音频规范
-
-    SDL_AudioDeviceID dev;  //音频设备ID
-} sdl_t;
+//渲染方式
+typedef enum {
+    RENDER_RECTS,   //逐像素调用SDL_RenderFillRect绘制(旧方式)
+    RENDER_TEXTURE, //把display写进一张流式纹理, 一次SDL_RenderCopy缩放到窗口
+} render_mode_t;
 
 //配置
 typedef struct {
-    u32 window_width;  //窗口宽度
-    u32 window_height; //窗口高度
+    u32 window_width;  //窗口宽度, 以低分辨率的像素计, 高分辨率时每个像素缩小一半
+    u32 window_height; //窗口高度, 同上
     u32 fg_color;  //前景色
     u32 bg_color;  //背景色
     u32 scale_factor;  //缩放比例
     bool pixel_outlines;    //是否绘制像素边框
+    render_mode_t render_mode;  //渲染方式
+    engine_t engine;    //解释器引擎
+    u32 benchmark_insts;    //非0时不打开窗口, 每种引擎各执行这么多条指令并报告速度
+    u32 verify_insts;   //非0时不打开窗口, 每种引擎和参考实现各执行这么多条指令并比较最终状态
+    u32 lockstep_insts; //非0时不打开窗口, 锁步引擎和逐个虚拟机的emulate_instruction各执行这么多条指令并比较速度
+    u32 seed;   //随机数种子, 同样的种子和输入得到同样的运行结果
+    const char *state_file; //非NULL时载入ROM后先从这个存档恢复
+    u32 rewind_bytes;   //倒带缓冲区的字节数, 0表示不能倒带
+    const char *record_file;    //非NULL时把种子和按键录进这个文件
+    const char *replay_file;    //非NULL时不打开窗口, 不限速回放这个录像
+    const char *trace_file;     //非NULL时一开始就跟踪指令, 停止跟踪或退出时写进这个文件
+    u32 trace_records;  //跟踪缓冲区保留最近多少条指令
+    const char *metrics_dest;   //非NULL时统计执行次数, 定期写进这个文件或者"unix:<路径>"的socket
+    u32 metrics_interval;   //每隔多少秒写一次统计
+    const char *profile_file;   //非NULL时采样调用栈, 结束时把折叠栈写进这个文件
+    u32 profile_period;     //每隔多少个周期采样一次
+    const char *labels_file;    //采样结果用的符号表, NULL表示用函数入口地址命名
+    bool heatmap;   //一开始就显示内存热度图
     u32 insts_per_second;  //chip8 CPU的时钟频率, 即每秒执行的指令数
+    u32 speed;  //1是实时, N是N倍速, 0表示不限速
+    bool display_wait;  //COSMAC VIP的行为: DXYN之后等到下一次60Hz刷新才继续执行
+    bool skip_idle;     //调度器跳过空转循环(scheduler.h), 结果和逐条执行一样
+    bool fuse;          //预解码缓存引擎把常见的相邻指令(如ANNN + DXYN)合成一次分发执行
+    quirks_profile_t quirks;    //兼容性配置(quirks.h)
     u32 square_wave_freq;  //方波声音频率，例如 440Hz 表示中音 A
     u32 audio_sample_rate; //音频采样率, 每秒钟对连续信号进行采样的次数, 以赫兹Hz为单位
     u16 volume; //音量大小
 } config_t;
 
-bool init_sdl(sdl_t *sdl, config_t *config);                          // 初始化SDL库
-bool set_config_from_args(config_t *config, const int argc, char **argv);   //设置配置
-void final_cleanup();   //最后退出
-void clear_screen(const sdl_t sdl, const config_t config);   //清除屏幕 / 屏幕变为背景色
-void update_screen(const sdl_t sdl, const config_t config, chip8_t *chip8); //更新屏幕
-void handle_input(chip8_t *chip8, config_t *config);    //处理输入
-bool init_chip8(chip8_t *chip8, const config_t config, const char rom_name[]);
-void emulate_instruction(chip8_t *chip8, const config_t config);    //模拟单条指令执行
-//音频回调函数用于实时处理和生成音频数据。它是一个用户定义的函数，当音频设备需要新的音频数据时，音频系统会调用这个函数, 他向音频缓冲区填充数据
-//userdata 指向用户数据的指针; stream 指向音频缓冲区的指针; len 缓冲区的长度, 以字节为单位
-void audio_callback(void *userdata, uint8_t *stream, int len);  /* **音频在计算机内的生成** */
+//CXNN的随机数(xorshift32), 不用全局的rand(), 多个虚拟机可以在不同线程里独立运行
+static inline u8 chip8_rand(chip8_t *chip8) {
+    u32 x = chip8->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    chip8->rng = x;
+    return x >> 24;
+}
+
+void copy_ram_page(chip8_t *chip8, const u8 page);  //第一次写共享的页之前复制一份
+
+//统计(metrics.h)或内存热度(heatmap.h)打开时, 每条指令都要经过解释器才数得到
+static inline bool instrumented(const chip8_t *chip8) {
+    return chip8->metrics || chip8->heatmap;
+}
+
+//读内存addr处的字节
+static inline u8 ram_read(const chip8_t *chip8, const u16 addr) {
+    return chip8->ram[(addr >> 8) & 0xF][addr & 0xFF];
+}
+
+//XO-CHIP F002: 从I开始的16字节作为声音样本, I不变
+static inline void load_audio_pattern(chip8_t *chip8) {
+    for (u8 i = 0; i < sizeof chip8->audio_pattern; i++) chip8->audio_pattern[i] = ram_read(chip8, chip8->I + i);
+    chip8->xo_audio = true;
+}
+
+//写内存addr处的字节, 共享的页先复制; 写代码所在的地方还要调用invalidate_code
+static inline void ram_write(chip8_t *chip8, const u16 addr, const u8 value) {
+    const u8 page = (addr >> 8) & 0xF;
+    if (!(chip8->private_ram & (1 << page))) copy_ram_page(chip8, page);
+    chip8->ram[page][addr & 0xFF] = value;
+}
+
+//当前分辨率下屏幕的宽和高
+static inline u32 display_width(const chip8_t *chip8) {
+    return chip8->hires ? DISPLAY_WIDTH : DISPLAY_WIDTH / 2;
+}
+
+static inline u32 display_height(const chip8_t *chip8) {
+    return chip8->hires ? DISPLAY_HEIGHT : DISPLAY_HEIGHT / 2;
+}
+
+//键盘的变化能否让等待中的FX0A继续: 还没有键按下时按下了任一个键, 或者按下的键松开了
+static inline bool key_wait_ready(const chip8_t *chip8) {
+    if (chip8->wait_key != 0xFF) return !chip8->keypad[chip8->wait_key];
+    for (u8 i = 0; i < sizeof chip8->keypad; i++)
+        if (chip8->keypad[i]) return true;
+    return false;
+}
+
+//位平面p第y行的像素, 布局和screen_t一样; 没有screen时只有第一个位平面的前32行
+static inline u128 display_row(const chip8_t *chip8, const u8 p, const u32 y) {
+    if (chip8->screen) return chip8->screen->rows[p][y];
+    return (p == 0 && y < DISPLAY_HEIGHT / 2) ? (u128)chip8->display[y] << 64 : 0;
+}
+
+//屏幕上(x, y)处像素的颜色: 第p位是位平面p的像素, 0表示没有点亮
+static inline u8 display_pixel(const chip8_t *chip8, const u32 x, const u32 y) {
+    u8 color = 0;
+    for (u8 p = 0; p < DISPLAY_PLANES; p++) color |= ((display_row(chip8, p, y) >> (DISPLAY_WIDTH - 1 - x)) & 1) << p;
+    return color;
+}
+
+void init_config(config_t *config);    //默认配置
+rom_image_t *load_rom_image(const char rom_name[]);   //载入字体和ROM并预先解码, 失败返回NULL
+void free_rom_image(rom_image_t *image);
+bool init_chip8(chip8_t *chip8, const config_t config, const char rom_name[]);  //载入ROM, 镜像归这个虚拟机所有
+void init_chip8_shared(chip8_t *chip8, const config_t config, const rom_image_t *image, const char rom_name[]);   //和别的虚拟机共享镜像
+void free_chip8(chip8_t *chip8);    //释放私有页, 自己的镜像和JIT缓存; 之后可以再次init
+void emulate_instruction(chip8_t *chip8, const config_t config);    //按config.quirks模拟单条指令执行
+u32 run_instructions(chip8_t *chip8, const config_t config, const u32 count);  //用选定的引擎执行最多count条指令
+const char *engine_name(const engine_t engine); //引擎的名字
+void draw_sprite(chip8_t *chip8, const config_t config, const u8 vx, const u8 vy, const u8 n);  //DXYN, 按config.quirks裁掉或回绕
+void clear_display(chip8_t *chip8);     //00E0: 清除选中的位平面
+void scroll_display(chip8_t *chip8, const int dx, const int dy);   //00CN, 00DN, 00FB, 00FC: 选中的位平面整体右移dx, 下移dy个像素
+void set_hires(chip8_t *chip8, const bool hires);   //00FE/00FF: 切换分辨率并清屏
+void select_planes(chip8_t *chip8, const u8 planes);    //FN01: 选中位平面(按位)
+void copy_display(const chip8_t *chip8, u128 rows[DISPLAY_PLANES][DISPLAY_HEIGHT]);    //整个屏幕展开成screen_t的布局
+void load_display(chip8_t *chip8, const u128 rows[DISPLAY_PLANES][DISPLAY_HEIGHT]);    //恢复copy_display的结果, 要先设置好hires和planes
+u64 hash_display(const chip8_t *chip8);    //copy_display之后整个屏幕的hash_bytes
+void wait_for_key(chip8_t *chip8, const u8 x);  //FX0A, PC已经指向下一条指令; 还要等时退回这条FX0A, 设置key_wait
+void invalidate_code(chip8_t *chip8, const u16 addr, const u16 len);    //写内存后作废覆盖这些字节的预解码指令和JIT块
+bool same_state(const chip8_t *a, const chip8_t *b);    //两个虚拟机的状态是否完全一致
+u64 hash_bytes(const void *data, const size_t len);    //FNV-1a 64位哈希, 用来比较不同运行的结果
+u64 hash_ram(const chip8_t *chip8);    //整个内存的hash_bytes
 
 #endif //CHIP8_H
\ No newline at end of file
@@ -0,0 +1,135 @@
+//SDL前端: 窗口, 渲染, 输入和音频
+//核心(include/chip8.h, src/core)不依赖SDL, 可以在没有显示器的机器上单独使用
+
+#ifndef FRONTEND_H
+#define FRONTEND_H
+
+#include <stdatomic.h>
+
+#include "SDL.h"
+#include "chip8.h"
+#include "audio.h"
+
+//sdl的一些设置
+typedef struct {
+    SDL_Window *window; //窗口
+    SDL_Renderer *renderer; //渲染器
+    SDL_Texture *screen_texture;    //128x64的流式纹理, 每帧只更新变了的行; 低分辨率只用左上角的64x32
+    SDL_Texture *outline_texture;   //预先烘焙好的像素边框, 窗口大小, 透明背景
+    SDL_Texture *outline_hires_texture; //高分辨率的像素边框, 格子小一半; 格子太小时是NULL, 不画边框
+    SDL_Texture *heat_texture;      //64x64的内存热度图, 每个像素是一个字节, 打开时每帧更新一次
+    u64 render_ticks;   //累计的渲染耗时(SDL_GetPerformanceCounter刻度)
+    u32 render_frames;  //累计渲染的帧数
+    u64 upload_pixels;  //累计上传到screen_texture的像素
+    u64 screen_pixels;  //每帧都上传整屏时累计的像素, 和upload_pixels比较就是省下的带宽
+    
+    /*
+    在调用 SDL_OpenAudioDevice 之后，have 结构将包含实际的音频设备配置。
+    如果音频设备不完全支持 want 中的配置，SDL 会尽量匹配，并在 have 中返回实际使用的配置。
+    */
+    SDL_AudioSpec want, have;   //音频规范
+
+    SDL_AudioDeviceID dev;  //音频设备ID
+} sdl_t;
+
+#define JITTER_BUCKETS 8
+
+//帧节奏: 每帧按高精度计数器上的绝对时刻开始, 不会因为每帧的舍入误差越跑越慢
+//离下一帧还远时用SDL_Delay睡眠, 最后PACE_SPIN_MS毫秒忙等, 避开睡眠醒来时间不准的问题
+typedef struct {
+    u64 period;     //一帧的计数器刻度数(1/60秒)
+    u64 deadline;   //下一帧应该开始的时刻
+    u64 jitter[JITTER_BUCKETS]; //帧实际开始的时刻比计划晚了多少, 按chip8.c中的jitter_bounds分桶
+    u64 frames;
+    u64 resyncs;    //落后太多, 放弃追赶, 从当前时刻重新计时的次数
+} pacer_t;
+
+//模拟线程这边的蜂鸣器: 记下一帧里声音变化的周期, 帧结束时换算成音频采样放进audio_t的队列
+#define BEEPER_STEPS 16     //每个60Hz周期最多分成几段运行, 每段结束时检查声音
+#define BEEPER_EVENTS 32    //一帧最多记下的变化
+typedef struct {
+    audio_event_t voice;    //虚拟机现在的声音
+    audio_event_t sent;     //最后一个放进队列的事件
+    u32 count;
+    audio_event_t events[BEEPER_EVENTS];    //这一帧里声音的变化, 换算之前sample存的是周期
+    u64 frame_sample;   //这一帧开始对应的采样
+    u32 frame_rem;      //采样率 / 60的余数累加, 每帧的采样数不取整也不会越走越偏
+    u32 resyncs;    //和音频回调的位置差得太远, 重新对齐的次数
+} beeper_t;
+
+//内存热度图: 每帧衰减一次再加上这一帧的访问次数, 按对数映射成颜色; 写是红色, 取指是绿色, 读是蓝色
+#define HEAT_DECAY 0.9f     //每帧剩下的比例, 大约半秒后淡去
+#define HEAT_ALPHA 0xC0     //热度图的不透明度, 下面的游戏画面还看得见
+
+//模拟线程交给SDL线程显示的一帧
+typedef struct {
+    u128 display[DISPLAY_PLANES][DISPLAY_HEIGHT];
+    bool hires;
+    dirty_t dirty;  //和SDL线程取走的上一帧相比变过的区域, 包括中间被覆盖、没有显示的帧
+    u64 cycle;  //这一帧结束时调度器的周期
+    bool heat_on;   //显示内存热度图
+    u32 heat[4096];     //热度图的像素, 第i个是内存地址i, 每行64字节
+} frame_t;
+
+//无锁三缓冲: 模拟线程写back, SDL线程读front, 两者通过交换middle传递, 谁都不用等谁
+//SDL线程只拿最新的一帧, 来不及显示的帧直接被覆盖
+#define FRAME_FRESH 4   //middle中的帧还没有被SDL线程取走
+typedef struct {
+    frame_t frames[3];
+    _Atomic u8 middle;  //共享的那一格的下标, 或上FRAME_FRESH
+    u8 back;    //只由模拟线程使用
+    dirty_t dropped;    //被覆盖的帧的变化, 并进下一帧, 只由模拟线程使用
+    u8 front;   //只由SDL线程使用
+} frame_buffer_t;
+
+//SDL线程发给模拟线程的输入
+typedef enum {
+    INPUT_KEY_DOWN,     //arg是chip8的键0~F
+    INPUT_KEY_UP,
+    INPUT_PAUSE,        //暂停/继续
+    INPUT_RESET,
+    INPUT_SAVE,         //arg是存档栏位
+    INPUT_LOAD,
+    INPUT_REWIND,       //arg是1表示开始倒带(按下退格键), 0表示停止
+    INPUT_HEATMAP,      //显示/隐藏内存热度图, 隐藏时不计数
+    INPUT_TRACE,        //开始/停止跟踪指令, 停止时写进文件
+} input_type_t;
+
+typedef struct {
+    u8 type;    //input_type_t
+    u8 arg;
+} input_event_t;
+
+//无锁单生产者单消费者队列: SDL线程写tail, 模拟线程写head, 各自占一条缓存行
+#define INPUT_QUEUE_SIZE 256    //2的幂
+typedef struct {
+    input_event_t events[INPUT_QUEUE_SIZE];
+    _Alignas(64) _Atomic u32 head;  //下一个要取的事件
+    _Alignas(64) _Atomic u32 tail;  //下一个空位
+} input_queue_t;
+
+//模拟线程的全部状态; chip8和config只由模拟线程访问, 线程之间只通过原子变量, frames, input和audio交流
+//没有事做时两个线程都睡眠: 模拟线程(暂停, 停在FX0A上)等wake, SDL线程等SDL的事件队列, 模拟线程交出新的一帧时发frame_event叫醒它
+typedef struct {
+    chip8_t chip8;
+    config_t config;    //模拟线程自己的配置副本, SDL线程调节音量不影响它
+    frame_buffer_t frames;
+    input_queue_t input;
+    SDL_sem *wake;      //SDL线程每放进一个输入事件(或者请求退出)加一
+    u32 frame_event;    //SDL_RegisterEvents得到的事件类型
+    _Atomic bool quit;  //任一线程都可以设置(request_quit), 两个线程看到后都退出
+    audio_t audio;
+    u64 emulated_insts; //退出时的统计, 只由模拟线程写, 线程结束后读
+    u64 emulate_ticks;
+} emulator_t;
+
+bool init_sdl(sdl_t *sdl, config_t *config, audio_t *audio);          // 初始化SDL库
+bool set_config_from_args(config_t *config, const int argc, char **argv);   //设置配置
+void final_cleanup();   //最后退出
+void clear_screen(const sdl_t sdl, const config_t config);   //清除屏幕 / 屏幕变为背景色
+//更新屏幕, 纹理只重新上传dirty里的区域; heat不为NULL时叠加内存热度图
+void update_screen(sdl_t *sdl, const config_t config, const u128 display[DISPLAY_PLANES][DISPLAY_HEIGHT], const bool hires,
+                   const dirty_t dirty, const u32 *heat);
+void handle_input(emulator_t *emu);    //处理输入, 键盘事件发给模拟线程
+
+#endif //FRONTEND_H
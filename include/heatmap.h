@@ -0,0 +1,26 @@
+//内存访问热度: 每个字节被取指, 读(FX65, DXYN的sprite, F002)和写(FX33, FX55)的次数
+//可以看出自修改代码的区域和频繁访问的数据, 前端把它画成叠加在屏幕上的热度图
+//虚拟机的heatmap为NULL时不计数; 计数时和统计(metrics.h)一样, JIT和预先翻译的块改用预解码缓存引擎
+//计数由使用者定期取走并清零, 只由运行虚拟机的线程访问
+
+#ifndef HEATMAP_H
+#define HEATMAP_H
+
+#include "chip8.h"
+
+typedef struct heatmap {
+    u32 fetches[4096];  //指令的两个字节都算
+    u32 reads[4096];
+    u32 writes[4096];
+} heatmap_t;
+
+//从addr开始的len个字节各加一, 超出0xFFF的回绕
+static inline void count_access(u32 counts[4096], const u16 addr, const u16 len) {
+    for (u16 i = 0; i < len; i++) counts[(addr + i) & 0xFFF]++;
+}
+
+static inline void count_fetch(heatmap_t *heatmap, const u16 pc) {
+    count_access(heatmap->fetches, pc, 2);
+}
+
+#endif //HEATMAP_H
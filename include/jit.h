@@ -0,0 +1,18 @@
+//x86-64动态重编译器(JIT)
+//把从某个PC开始的一段直线型chip8代码翻译成本机代码, 块内V寄存器放在宿主寄存器中
+//块在跳转/跳过/调用/返回/DXYN/FX0A以及任何不支持的指令处结束, 不支持的指令交给解释器执行
+
+#ifndef JIT_H
+#define JIT_H
+
+#include "chip8.h"
+
+typedef struct jit jit_t;
+
+bool jit_available(void);   //当前平台是否支持JIT(只支持x86-64)
+jit_t *jit_create(void);    //分配翻译缓存和可执行内存, 失败返回NULL
+void jit_destroy(jit_t *jit);
+void jit_invalidate(jit_t *jit, const u16 addr, const u16 len); //内存addr开始的len字节被写入, 作废覆盖这些字节的块
+u32 run_jit(chip8_t *chip8, const config_t config, const u32 count);    //用JIT执行最多count条指令, 语义同run_instructions
+
+#endif //JIT_H
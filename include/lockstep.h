@@ -0,0 +1,36 @@
+//锁步(lockstep)引擎: 同一个ROM的多个虚拟机(lane)按结构体数组(SoA)存放, 每一步每个lane各执行一条指令
+//所有lane的PC相同时, ALU指令(6XNN, 7XNN, 8XY_, 3XNN, 4XNN, 5XY0, 9XY0)以及0NNN, 1NNN, ANNN用向量指令一次算完所有lane
+//PC不同或者遇到其他指令时, 逐个lane用预解码缓存引擎执行这一条指令, 分叉的lane走到同一个PC后自动重新汇合
+//用GCC的向量扩展编写, 编译器按目标平台生成AVX2或SSE2指令
+
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include "chip8.h"
+
+#define LOCKSTEP_LANES 32
+
+typedef u8 lane_u8 __attribute__((vector_size(LOCKSTEP_LANES)));         //每个lane一个u8
+typedef u16 lane_u16 __attribute__((vector_size(LOCKSTEP_LANES * 2)));   //每个lane一个u16
+
+typedef struct {
+    lane_u8 V[16];  //V[x]是所有lane的寄存器Vx
+    lane_u16 I;
+    lane_u16 PC;
+    lane_u8 delay_timer;
+    lane_u8 sound_timer;
+    lane_u16 active;    //使用中的lane是0xFFFF, 其余是0
+    chip8_t *vm[LOCKSTEP_LANES];    //每个lane的内存, 栈, 屏幕, 键盘和随机数; 其中的V, I, PC, 计时器只在逐lane执行时有效
+    rom_image_t *image; //所有lane共享的内存镜像
+    u32 lanes;  //实际使用的lane数
+    u64 written_pages;  //任何lane写过的64字节内存页, 这些页里的指令在各个lane中可能不同
+    u64 vector_steps;   //用向量指令执行的步数
+    u64 scalar_steps;   //逐lane执行的步数
+} lockstep_t;
+
+bool init_lockstep(lockstep_t *ls, const config_t config, const char rom_name[], const u32 lanes);  //第i个lane的随机数种子是config.seed + i
+void destroy_lockstep(lockstep_t *ls);
+void run_lockstep(lockstep_t *ls, const config_t config, const u32 steps);     //每个lane各执行steps条指令
+chip8_t *lockstep_lane(lockstep_t *ls, const u32 lane);    //把lane的寄存器写回它的chip8_t并返回
+
+#endif //LOCKSTEP_H
@@ -0,0 +1,57 @@
+//执行统计: 每类指令和每个地址的执行次数, DXYN画的像素, 计时器, 帧和每帧屏幕变化的区域
+//每个虚拟机一份, 只由运行它的线程写; 热路径上只是普通的自增, 没有原子操作, 可以一直开着
+//虚拟机的metrics为NULL时不统计; 统计时JIT和预先翻译的块改用预解码缓存引擎, 这样每条指令都能数到
+//write_metrics按Prometheus文本格式写进文件(给node_exporter的textfile收集器)或者Unix socket
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "chip8.h"
+
+#define METRICS_CLASSES 48  //指令分类数的上限, 分类就是预解码缓存引擎的处理程序编号(高4位加子操作)
+#define METRICS_FUSIONS 8   //融合指令种类数的上限
+
+typedef struct metrics {
+    _Alignas(64) u64 pc[4096];  //每个地址执行的指令数
+    _Alignas(64) u64 classes[METRICS_CLASSES];  //每类指令的执行次数
+    u64 fused[METRICS_FUSIONS]; //每种融合指令执行的次数(整组算一次, 组里的指令也分别算进classes)
+    _Alignas(64) u64 sprites;   //DXYN的次数
+    u64 sprite_rows;    //实际画到屏幕上的行, 超出屏幕被裁掉的不算
+    u64 sprite_pixels;  //异或到屏幕上的像素(sprite中为1的位)
+    u64 collisions;     //VF = 1的DXYN
+    u64 ticks;          //60Hz事件
+    u64 delay_ticks;    //其中delay_timer不为0的
+    u64 sound_ticks;    //其中sound_timer不为0的
+    u64 wait_cycles;    //display wait空等的周期
+    u64 key_wait_cycles;    //FX0A等键盘变化的周期
+    u64 frames;         //前端显示的帧
+    u64 dirty_frames;   //其中屏幕有变化的
+    u64 dirty_rows;     //每帧变了的行数之和
+    u64 dirty_pixels;   //每帧变了的区域(变了的行 x 变了的列)的像素数之和, 即只上传变化时的数据量
+    u64 screen_pixels;  //每帧整个屏幕的像素数之和, 即每帧都上传整屏时的数据量
+} metrics_t;
+
+//每条指令调用一次, pc是指令的地址, op是它的分类
+static inline void count_instruction(metrics_t *metrics, const u16 pc, const u8 op) {
+    metrics->pc[pc & 0xFFF]++;
+    metrics->classes[op]++;
+}
+
+//前端每显示一帧调用一次, dirty是这一帧里屏幕变过的区域
+static inline void count_frame(metrics_t *metrics, const dirty_t dirty, const u32 width, const u32 height) {
+    const dirty_t changed = clip_dirty(dirty, width, height);
+    const u32 rows = __builtin_popcountll(changed.rows);
+    metrics->frames++;
+    metrics->dirty_frames += rows != 0;
+    metrics->dirty_rows += rows;
+    metrics->dirty_pixels += rows ? rows * (u32)(changed.right - changed.left) : 0;
+    metrics->screen_pixels += width * height;
+}
+
+const char *op_class_name(const u8 op);     //分类的名字, 如"8XY4"; 没有这个分类返回NULL (cpu.c)
+u8 op_class(const u16 opcode);              //一条指令的分类 (cpu.c)
+const char *fusion_name(const u8 kind);     //融合指令的名字, 如"ANNN+DXYN"; 没有这种返回NULL (cpu.c)
+//把统计写进dest: 文件先写到<dest>.tmp再改名, 抓取的程序不会读到一半; "unix:<路径>"是连接这个Unix socket发过去
+bool write_metrics(const metrics_t *metrics, const char rom_name[], const char dest[]);
+
+#endif //METRICS_H
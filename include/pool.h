@@ -0,0 +1,28 @@
+//虚拟机和私有内存页的分配池(slab): 同样大小的对象成批向系统申请, 释放的对象放进空闲链表重复使用
+//省掉了每个对象的malloc头部和碎片, 大批虚拟机同时存在时占用的内存基本就是对象本身的大小
+//一个池只能在一个线程中使用
+
+#ifndef POOL_H
+#define POOL_H
+
+#include "chip8.h"
+
+typedef struct chip8_pool chip8_pool_t;
+
+//池的占用情况
+typedef struct {
+    size_t reserved_bytes;  //向系统申请的总字节数
+    u32 live_chip8;         //正在使用的虚拟机
+    u32 live_ram_pages;     //正在使用的私有内存页
+    u32 live_decoded_pages; //正在使用的私有预解码页
+} pool_stats_t;
+
+chip8_pool_t *create_pool(void);
+void destroy_pool(chip8_pool_t *pool);  //释放池的全部内存, 其中的虚拟机要先pool_free_chip8
+chip8_t *pool_alloc_chip8(chip8_pool_t *pool);  //清零的chip8_t, 它的私有页也从这个池分配
+void pool_free_chip8(chip8_pool_t *pool, chip8_t *chip8);  //free_chip8之后归还给池
+void *pool_alloc(chip8_pool_t *pool, const size_t size);   //分配一个私有页(PAGE_SIZE字节的内存页或预解码页)或者screen_t, pool为NULL时用malloc
+void pool_free(chip8_pool_t *pool, void *object, const size_t size);
+pool_stats_t pool_stats(const chip8_pool_t *pool);
+
+#endif //POOL_H
@@ -0,0 +1,41 @@
+//采样分析器: 每隔period个周期记下一次虚拟机的调用栈, 输出火焰图工具(flamegraph.pl, speedscope等)认识的折叠栈格式
+//调用栈来自2NNN/00EE维护的stk和SP: stk[i] - 2是第i层调用的位置, 那条2NNN的NNN就是第i + 1层函数的入口, 最内层现在执行到PC
+//采样由调度器触发(和60Hz事件一样按周期), 各个引擎都不用改, 不采样时没有任何开销
+//
+//符号表(可选)是文本文件, 每行"<十六进制地址> <名字>", #开头是注释; 每一层用地址不超过它位置的最近一个标签命名
+//没有符号表时每一层用函数入口命名, 如sub_2A0
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "chip8.h"
+
+#define PROFILE_DEPTH 17    //最多16层调用加上最外层
+
+//一种调用栈, 第0层是最外层
+typedef struct {
+    u16 depth;  //层数, 1 ~ PROFILE_DEPTH
+    u16 entry[PROFILE_DEPTH];   //每一层函数的入口, 0xFFFF表示调用它的不是2NNN(比如代码后来被改写了)
+    u16 at[PROFILE_DEPTH];      //每一层执行到的位置: 外层是调用的位置, 最内层是PC
+} profile_key_t;
+
+typedef struct {
+    profile_key_t key;  //没用的层全是0, 可以整个比较
+    u64 samples;    //0表示空位
+} profile_stack_t;
+
+typedef struct profile {
+    u32 period;     //每多少个周期采样一次
+    u32 countdown;  //离下一次采样还有多少个周期, 由调度器减少
+    profile_stack_t *stacks;    //开放寻址的哈希表
+    u32 capacity;   //2的幂
+    u32 used;
+    u64 samples;
+} profile_t;
+
+bool init_profile(profile_t *profile, const u32 period);
+void free_profile(profile_t *profile);
+void profile_sample(profile_t *profile, const chip8_t *chip8);  //记下现在的调用栈, 由调度器在countdown减到0时调用
+bool save_profile(const profile_t *profile, const char path[], const char labels_file[]);  //labels_file为NULL时不用符号表
+
+#endif //PROFILE_H
@@ -0,0 +1,62 @@
+//兼容性配置(quirks): 各个CHIP-8变种在几条指令上的行为不同, 同一个ROM只在对应的配置下才能正常运行
+//              8XY1~3清VF  FX55/FX65后的I  8XY6/8XYE移位  BNNN跳转   DXYN超出屏幕
+//  COSMAC VIP  清零        I += X + 1      移VY           V0 + NNN   裁掉
+//  CHIP-48     不变        I += X          移VX           VX + NNN   裁掉
+//  SUPER-CHIP  不变        不变            移VX           VX + NNN   裁掉
+//  XO-CHIP     不变        I += X + 1      移VY           V0 + NNN   回绕到另一边
+//SUPER-CHIP和XO-CHIP还有高分辨率(00FE/00FF), 滚屏(00CN, 00FB, 00FC)和16x16的sprite(DXY0);
+//XO-CHIP另有4个位平面(FN01)和向上滚屏(00DN); 其他配置里这些指令什么也不做, DXY0不画任何东西
+//DXYN之后等待刷新(display wait)不算在配置里, 由config.display_wait单独打开
+//
+//各个解释器按配置编译成不同的版本, 运行时选一次版本, 执行指令时不再检查配置:
+//  switch引擎的每个版本是同一份代码代入不同的常量quirks_t, 编译器在编译时就去掉了对它的判断
+//  预解码缓存引擎每种配置有自己的处理程序表, 分发时直接跳到对应版本的处理程序
+//  JIT按配置翻译, 换配置时清空翻译缓存; 预先翻译(AOT)的程序只在翻译时的配置下使用
+//
+//数据库(可选)是文本文件, 每行"<ROM文件的十六进制hash_bytes> <配置名> [说明]", #开头是注释
+
+#ifndef QUIRKS_H
+#define QUIRKS_H
+
+#include "chip8.h"
+
+//FX55/FX65之后I的变化
+typedef enum {
+    QUIRK_I_X1,     //I += X + 1
+    QUIRK_I_X,      //I += X
+    QUIRK_I_KEEP,   //I不变
+} quirk_memory_t;
+
+typedef struct {
+    bool vf_reset;  //8XY1~3把VF清零
+    quirk_memory_t memory;
+    bool shift_vy;  //8XY6/8XYE移VY的值, 否则移VX自己
+    bool jump_v0;   //BNNN跳到V0 + NNN, 否则是VX + NNN(X是NNN的最高4位)
+    bool wrap;      //DXYN超出屏幕的部分回绕到另一边, 否则裁掉
+    bool hires;     //有00CN, 00FB, 00FC, 00FE, 00FF和DXY0
+    bool planes;    //有XO-CHIP的FN01, 00DN, F002和FX3A
+} quirks_t;
+
+//下标是quirks_profile_t; 用常量下标取出的是编译时的常量
+static const quirks_t quirks_of[QUIRKS_COUNT] = {
+    [QUIRKS_VIP]    = { .vf_reset = true,  .memory = QUIRK_I_X1,   .shift_vy = true,  .jump_v0 = true,  .wrap = false,
+                        .hires = false, .planes = false },
+    [QUIRKS_CHIP48] = { .vf_reset = false, .memory = QUIRK_I_X,    .shift_vy = false, .jump_v0 = false, .wrap = false,
+                        .hires = false, .planes = false },
+    [QUIRKS_SCHIP]  = { .vf_reset = false, .memory = QUIRK_I_KEEP, .shift_vy = false, .jump_v0 = false, .wrap = false,
+                        .hires = true,  .planes = false },
+    [QUIRKS_XOCHIP] = { .vf_reset = false, .memory = QUIRK_I_X1,   .shift_vy = true,  .jump_v0 = true,  .wrap = true,
+                        .hires = true,  .planes = true },
+};
+
+//FX55/FX65之后I增加多少
+static inline u16 quirk_i_step(const quirks_t quirks, const u8 x) {
+    return quirks.memory == QUIRK_I_X1 ? x + 1 : quirks.memory == QUIRK_I_X ? x : 0;
+}
+
+const char *quirks_name(const quirks_profile_t profile);    //配置的名字, 即--quirks的参数
+bool parse_quirks(const char name[], quirks_profile_t *profile);   //不认识的名字返回false
+//在数据库里查ROM文件对应的配置: 查到时改写*profile; 数据库里没有这个ROM时*profile不变, 也返回true
+bool lookup_quirks(const char db_file[], const char rom_name[], quirks_profile_t *profile);
+
+#endif //QUIRKS_H
@@ -0,0 +1,36 @@
+//输入录像和回放: 录下随机数种子和每一次按键变化(按调度器的周期数标记), 回放时不开窗口, 不限速, 结果逐字节一致
+//虚拟机的运行只取决于ROM, 种子, 调度器的设置和每条指令执行时的按键, 所以在同样的周期喂同样的按键就能重现整个过程
+//
+//录像是文本文件, 每行一项:
+//  seed <种子>
+//  rom <ROM镜像的hash>
+//  ips <每秒指令数>
+//  display-wait <0或1>
+//  quirks <兼容性配置>        没有这一行的旧录像是vip
+//  state <存档文件>          (可选) 开始时先载入这个存档
+//  <周期> +<键> / -<键>       按下 / 松开, 键是十六进制
+//  <周期> reset              重置虚拟机
+//  <周期> load <存档文件>      载入存档
+//  end <周期> <状态hash>      录像结束时的周期和虚拟机状态的hash(savestate.h的hash_state)
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdio.h>
+
+#include "chip8.h"
+
+typedef struct {
+    FILE *file;     //NULL表示没在录像, 这时record_*什么都不做
+    u64 cycle;      //调度器当前的周期(scheduler_t.cycle), 由调用者更新
+    bool keypad[16];    //上一次记录时的按键, 只记录变化
+} recorder_t;
+
+bool start_recording(recorder_t *rec, const char path[], const chip8_t *chip8, const config_t config);
+void record_keypad(recorder_t *rec, const chip8_t *chip8); //执行下一条指令之前调用, 记下变化了的键
+void record_reset(recorder_t *rec, const chip8_t *chip8);  //虚拟机重置之后调用
+void record_load(recorder_t *rec, const chip8_t *chip8, const char state_file[]);  //载入存档之后调用
+void stop_recording(recorder_t *rec, const chip8_t *chip8);
+bool run_replay(const char path[], const config_t config, const char rom_name[]);  //回放并和录像结束时的状态比较, 一致返回true
+
+#endif //REPLAY_H
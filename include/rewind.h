@@ -0,0 +1,31 @@
+//倒带: 每帧保存一次虚拟机状态(savestate_t), 按住倒带键时逐帧退回去
+//只完整保存最新的一帧, 更早的每帧只存和后一帧的差(异或), 差里大部分是0, 再按游程压缩
+//压缩后的差放在固定大小的环形缓冲区里, 满了就丢掉最旧的; 异或是对称的, 从最新一帧开始逐个异或就能往回倒
+
+#ifndef REWIND_H
+#define REWIND_H
+
+#include "chip8.h"
+#include "savestate.h"
+
+typedef struct {
+    u8 *buffer;     //环形缓冲区, 每条记录是[u32长度][压缩的差][u32长度], 从两头都能找到记录的边界
+    u32 capacity;
+    u32 head;       //最旧的记录的开头
+    u32 used;       //已用字节数, 最新的记录结束在(head + used) % capacity
+    u32 frames;     //缓冲区中的记录数, 也就是能倒退的帧数
+    bool has_newest;
+    savestate_t newest; //最新一帧的完整状态
+    u8 *scratch;    //压缩用的临时空间
+    u64 snapshots;  //统计: 保存的帧数
+    u64 snapshot_ns;    //统计: 保存花的总时间(纳秒)
+    u64 max_snapshot_ns;
+    u64 delta_bytes;    //统计: 压缩后的差的总字节数(含记录头尾)
+} rewind_t;
+
+bool init_rewind(rewind_t *rw, const u32 capacity);    //capacity是缓冲区的字节数
+void free_rewind(rewind_t *rw);
+void rewind_push(rewind_t *rw, const chip8_t *chip8);  //每帧结束时调用一次
+bool rewind_step(rewind_t *rw, chip8_t *chip8);    //退回上一帧, 没有更早的记录时返回false; 按键状态保持当前的
+
+#endif //REWIND_H
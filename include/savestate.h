@@ -0,0 +1,49 @@
+//存档: 把虚拟机的完整状态保存成固定布局的二进制文件, 之后从这里继续运行
+//文件就是一个savestate_t(小端), 载入时把文件映射进内存直接当结构体用, 不需要逐字段解析
+//存档里有整个内存, 但恢复时只复制和当前内容不同的页, 没变的页继续和ROM镜像共享
+
+#ifndef SAVESTATE_H
+#define SAVESTATE_H
+
+#include "chip8.h"
+
+#define SAVESTATE_MAGIC "C8ST"
+#define SAVESTATE_VERSION 4     //布局改变时加一, 旧版本的存档拒绝载入
+
+//存档的布局, 每个字段都在自然边界上, 没有编译器插入的填充
+typedef struct {
+    char magic[4];  //SAVESTATE_MAGIC
+    u32 version;    //SAVESTATE_VERSION
+    u32 size;       //sizeof(savestate_t)
+    bool key_wait;  //停在FX0A上等键盘变化
+    u8 reserved[3];
+    u64 rom_hash;   //ROM镜像的hash, 只能恢复到载入了同一个ROM的虚拟机
+    u8 V[16];
+    u16 stk[16];
+    u16 I;
+    u16 PC;
+    u8 SP;
+    u8 delay_timer;
+    u8 sound_timer;
+    u8 wait_key;    //FX0A等待中的键
+    u32 rng;        //CXNN的随机数状态
+    bool keypad[16];
+    u8 pitch;       //XO-CHIP的音高
+    bool xo_audio;
+    bool hires;     //SUPER-CHIP的高分辨率
+    u8 planes;      //XO-CHIP选中的位平面
+    u8 audio_pattern[16];   //XO-CHIP的声音样本
+    u64 written_pages;
+    u64 display[DISPLAY_PLANES][DISPLAY_HEIGHT][2]; //每行是小端的u128: 低64位在前
+    u8 ram[4096];
+} savestate_t;
+
+_Static_assert(sizeof(savestate_t) == 8320, "savestate_t的布局变了, 要增加SAVESTATE_VERSION");
+
+void save_state(const chip8_t *chip8, savestate_t *state);  //把虚拟机的状态写进state
+bool restore_state(chip8_t *chip8, const savestate_t *state);  //版本或ROM不符时返回false, 虚拟机不变
+bool save_state_file(const chip8_t *chip8, const char path[]);
+bool load_state_file(chip8_t *chip8, const char path[]);   //映射文件后restore_state
+u64 hash_state(const chip8_t *chip8);  //存档内容的hash, 不含只和引擎有关的written_pages, 用来确认两次运行的结果逐字节一致
+
+#endif //SAVESTATE_H
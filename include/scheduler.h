@@ -0,0 +1,33 @@
+//调度器: 按模拟的周期数(一条指令一个周期)推进虚拟机, 每insts_per_second / 60个周期触发一次60Hz事件
+//60Hz事件让delay_timer和sound_timer减一, 并结束display wait; 它只取决于周期数, 和一次推进多少周期无关,
+//所以前端逐帧运行, 回放和批量运行一口气运行, 计时器都在同样的指令之间减一
+//真实时间的节奏(睡眠, 倍速)由调用者负责, 调度器本身不看时钟
+//
+//空转循环(config.skip_idle): 很多ROM用FX07, 3XNN/4XNN, 1NNN反复读delay_timer, 或者用1NNN跳到自己结束运行
+//调度器每次运行前从当前状态开始模拟几步只读寄存器的指令, 状态出现重复就说明在计时器变化或者按键之前都会一直转下去,
+//直接跳过整圈的周期, 剩下不足一圈的照常执行; 结果和逐条执行完全一样, 跳过的周期也算作执行的指令
+//循环不读计时器和键盘时(比如跳到自己), 虚拟机再也不会变化, 直接跳到要运行的周期数, 计时器按经过的60Hz事件减少
+//
+//FX0A(chip8->key_wait): 虚拟机暂停, 不执行指令, 直到键盘的变化能让它继续; 等待的周期不算执行的指令
+//键盘只在两次调用之间变化, 所以等待时也直接跳到要运行的周期数, 调用者看到key_wait就可以睡眠到有输入为止
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "chip8.h"
+
+typedef struct {
+    u64 cycle;      //已经过去的周期数: 执行的指令加上display wait和FX0A空等的周期
+    u64 next_tick;  //下一次60Hz事件的周期
+    u32 cycles_per_tick;
+    u64 ticks;      //已经触发的60Hz事件数
+    u64 skipped;    //空转循环中跳过的周期数
+    u32 idle_backoff;   //上次没找到值得跳过的空转循环, 隔几段再找; 每次都没找到就加倍
+    u32 idle_wait;      //还要隔几段
+    bool halted;    //上一次run_scheduled停在不读计时器和键盘的死循环里, 之后只有重置或载入存档才会改变状态
+} scheduler_t;
+
+void init_scheduler(scheduler_t *sched, const config_t config);
+u64 run_scheduled(scheduler_t *sched, chip8_t *chip8, const config_t config, const u64 cycles);  //推进cycles个周期, 返回执行的指令数
+
+#endif //SCHEDULER_H
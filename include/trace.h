@@ -0,0 +1,54 @@
+//指令跟踪: 每执行一条指令往环形缓冲区追加一条12字节的二进制记录, 满了覆盖最旧的
+//代替原来每条指令一次printf的DEBUG输出; 记录够还原出当时的描述, 由tools/chip8_trace.c解码
+//虚拟机的trace为NULL时不跟踪; 跟踪时run_instructions改用逐条解释执行, 不跟踪时各个引擎完全不受影响
+//
+//文件格式: trace_header_t, 然后是count条trace_record_t, 从旧到新(小端)
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "chip8.h"
+
+#define TRACE_MAGIC "C8TR"
+#define TRACE_VERSION 1
+
+//一条指令, 除了reg, value和flags的位1以外都是执行前的值
+typedef struct {
+    u16 pc;     //指令的地址
+    u16 opcode;
+    u16 I;
+    u8 vx;      //VX; BNNN是V0
+    u8 vy;      //VY
+    u8 reg;     //被改写的寄存器中编号最小的, 0xFF表示没有
+    u8 value;   //它的新值
+    u8 delay_timer;
+    u8 flags;   //TRACE_KEY | TRACE_VF
+} trace_record_t;
+
+#define TRACE_KEY 1     //VX对应的键按下了
+#define TRACE_VF 2      //执行后的VF(只看最低位)
+
+_Static_assert(sizeof(trace_record_t) == 12, "trace_record_t的布局变了, 要增加TRACE_VERSION");
+
+typedef struct {
+    char magic[4];  //TRACE_MAGIC
+    u32 version;    //TRACE_VERSION
+    u32 record_size;    //sizeof(trace_record_t)
+    u32 reserved;
+    u64 total;      //开始跟踪以来记录的指令数, 比count多的部分已经被覆盖了
+    u64 count;      //文件中的记录数
+} trace_header_t;
+
+typedef struct trace {
+    trace_record_t *records;
+    u32 capacity;   //2的幂
+    u64 total;      //写过的记录数, 下一条写在total % capacity
+} trace_t;
+
+bool init_trace(trace_t *trace, const u32 records);    //records向上取到2的幂
+void free_trace(trace_t *trace);
+void clear_trace(trace_t *trace);
+bool save_trace(const trace_t *trace, const char path[]);  //把缓冲区里的记录从旧到新写进文件
+u32 run_traced(chip8_t *chip8, const config_t config, const u32 count);   //逐条执行并记录, 由run_instructions调用
+
+#endif //TRACE_H
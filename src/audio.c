@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#include "SDL.h"
+#include "audio.h"
+
+#define PATTERN_BITS 128
+#define PHASE_ONE ((u64)1 << 32)    //32.32定点的一位
+#define INTEGRATOR_LEAK 0.999f      //积分器慢慢泄漏, 去掉直流(截止约7Hz), 浮点误差也不会累积
+
+//blep[p][k]: 在第p / BLEP_PHASES个采样处从0跳到1, 第k个采样要加上的量; 每一行加起来正好是1
+static float blep[BLEP_PHASES + 1][BLEP_TAPS];
+
+//加窗sinc: 截止在0.45倍采样率, Blackman窗, 半宽BLEP_TAPS / 2 - 2个采样
+static double blep_impulse(const double x) {
+    const double half = BLEP_TAPS / 2 - 2, cutoff = 0.45;
+    if (fabs(x) >= half) return 0;
+    const double w = 0.42 + 0.5 * cos(M_PI * x / half) + 0.08 * cos(2 * M_PI * x / half);
+    const double u = 2 * cutoff * x;
+    return 2 * cutoff * (u == 0 ? 1 : sin(M_PI * u) / (M_PI * u)) * w;
+}
+
+//第k个采样得到的是冲激响应在[k - 1 - f - BLEP_TAPS / 2, k - f - BLEP_TAPS / 2]上的积分, 用中点法算
+static void init_blep(void) {
+    const u32 steps = 32;
+    for (u32 p = 0; p <= BLEP_PHASES; p++) {
+        const double f = (double)p / BLEP_PHASES;
+        double sum = 0;
+        for (u32 k = 0; k < BLEP_TAPS; k++) {
+            const double from = k - 1 - f - BLEP_TAPS / 2;
+            double area = 0;
+            for (u32 s = 0; s < steps; s++) area += blep_impulse(from + (s + 0.5) / steps) / steps;
+            blep[p][k] = (float)area;
+            sum += area;
+        }
+        for (u32 k = 0; k < BLEP_TAPS; k++) blep[p][k] = (float)(blep[p][k] / sum);
+    }
+}
+
+//rate位每秒, 换算成每个采样前进的位数
+static u64 bits_per_sample(const double rate, const u32 sample_rate) {
+    return (u64)(rate / sample_rate * PHASE_ONE);
+}
+
+void init_audio(audio_t *audio, const config_t *config, const u32 sample_rate, const u32 buffer_samples) {
+    static bool blep_ready = false;
+    if (!blep_ready) {
+        init_blep();
+        blep_ready = true;
+    }
+
+    audio->sample_rate = sample_rate;
+    //一个缓冲区是回调提前生成的量, 半个留给模拟一帧的耗时
+    audio->latency = buffer_samples + buffer_samples / 2;
+    audio->beep_step = bits_per_sample(2.0 * config->square_wave_freq, sample_rate);
+    for (u32 pitch = 0; pitch < 256; pitch++)
+        audio->pitch_step[pitch] = bits_per_sample(4000 * pow(2, ((double)pitch - 64) / 48), sample_rate);
+    audio->voice = (audio_event_t){ .pitch = 64 };
+    audio->step = audio->beep_step;
+    audio->integrator = -1;     //开始时这一位是0, 波形在-1
+    atomic_init(&audio->volume, config->volume);
+}
+
+bool push_audio_event(audio_t *audio, const audio_event_t *event) {
+    const u32 tail = atomic_load_explicit(&audio->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&audio->head, memory_order_acquire) == AUDIO_EVENT_QUEUE) {
+        atomic_fetch_add_explicit(&audio->overruns, 1, memory_order_relaxed);
+        return false;
+    }
+
+    audio->events[tail & (AUDIO_EVENT_QUEUE - 1)] = *event;
+    atomic_store_explicit(&audio->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+//当前播放到的这一位; 蜂鸣器是0和1交替
+static bool pattern_bit(const audio_t *audio, const u64 phase) {
+    const u32 bit = (phase >> 32) & (PATTERN_BITS - 1);
+    if (!audio->voice.xo_audio) return bit & 1;
+    return (audio->voice.pattern[bit / 8] >> (7 - bit % 8)) & 1;
+}
+
+//在第i个采样之后fraction处从level跳到另一个值
+static void add_step(audio_t *audio, const u32 i, const double fraction, const bool level) {
+    const float *kernel = blep[(u32)(fraction * BLEP_PHASES + 0.5)];
+    const float delta = level ? 2.0f : -2.0f;  //波形在-1和1之间
+    for (u32 k = 0; k < BLEP_TAPS; k++) audio->deltas[i + k] += delta * kernel[k];
+}
+
+//换成新的声音: 播放速度和样本可能变了, 位置不变; 当前这一位变了就在这里跳变
+static void apply_event(audio_t *audio, const audio_event_t *event, const u32 i) {
+    audio->voice = *event;
+    audio->step = event->xo_audio ? audio->pitch_step[event->pitch] : audio->beep_step;
+    const bool level = pattern_bit(audio, audio->phase);
+    if (level != audio->level) {
+        add_step(audio, i, 0, level);
+        audio->level = level;
+    }
+}
+
+//合成从start开始的count个采样
+static void synthesize(audio_t *audio, int16_t *out, const u32 count, const u64 start, const int32_t volume,
+                       u32 *head, const u32 tail) {
+    for (u32 i = 0; i < count; i++) {
+        //处理落在这个采样上的事件
+        while (*head != tail && audio->events[*head & (AUDIO_EVENT_QUEUE - 1)].sample <= start + i) {
+            const audio_event_t *event = &audio->events[*head & (AUDIO_EVENT_QUEUE - 1)];
+            if (event->sample < start) atomic_fetch_add_explicit(&audio->underruns, 1, memory_order_relaxed);
+            apply_event(audio, event, i);
+            (*head)++;
+        }
+
+        //这个采样到下一个采样之间经过的每个位边界, 值变了就叠加一个带限阶跃
+        const u64 next = audio->phase + audio->step;
+        for (u64 edge = (audio->phase | (PHASE_ONE - 1)) + 1; edge <= next; edge += PHASE_ONE) {
+            const bool level = pattern_bit(audio, edge);
+            if (level == audio->level) continue;
+            add_step(audio, i, (double)(edge - audio->phase) / audio->step, level);
+            audio->level = level;
+        }
+        audio->phase = next & (((u64)PATTERN_BITS << 32) - 1);
+
+        //音量按gain渐变, 声音在事件所在的采样开始出现或消失
+        if (audio->voice.on && audio->gain < AUDIO_RAMP) audio->gain++;
+        else if (!audio->voice.on && audio->gain > 0) audio->gain--;
+
+        audio->integrator = audio->integrator * INTEGRATOR_LEAK + audio->deltas[i];
+        //带限阶跃有过冲, 波形会超出[-1, 1]; 音量最大是INT16_MAX, 转换前先限幅, 超出int16_t范围的转换是未定义的
+        const float sample = audio->integrator * volume * (int32_t)audio->gain / AUDIO_RAMP;
+        out[i] = sample > INT16_MAX ? INT16_MAX : sample < INT16_MIN ? INT16_MIN : (int16_t)sample;
+    }
+
+    //叠加到这次范围之外的跳变留给下一次
+    memmove(audio->deltas, &audio->deltas[count], BLEP_TAPS * sizeof audio->deltas[0]);
+    memset(&audio->deltas[BLEP_TAPS], 0, count * sizeof audio->deltas[0]);
+}
+
+void audio_callback(void *userdata, u8 *stream, int len) {
+    audio_t *audio = (audio_t *)userdata;
+    const u64 start_ticks = SDL_GetPerformanceCounter();
+
+    int16_t *audio_data = (int16_t *)stream;    //每个采样两字节; 有符号是因为音频数据可以有振幅, 振幅可正可负
+    const u32 samples = len / 2;
+    const u64 start = atomic_load_explicit(&audio->position, memory_order_relaxed);
+    const int32_t volume = atomic_load_explicit(&audio->volume, memory_order_relaxed);
+    u32 head = atomic_load_explicit(&audio->head, memory_order_relaxed);
+    const u32 tail = atomic_load_explicit(&audio->tail, memory_order_acquire);
+
+    for (u32 done = 0; done < samples; ) {
+        const u32 count = samples - done < SYNTH_CHUNK ? samples - done : SYNTH_CHUNK;
+        synthesize(audio, &audio_data[done], count, start + done, volume, &head, tail);
+        done += count;
+    }
+
+    atomic_store_explicit(&audio->head, head, memory_order_release);
+    atomic_store_explicit(&audio->position, start + samples, memory_order_release);
+    audio->synth_ticks += SDL_GetPerformanceCounter() - start_ticks;
+    audio->buffers++;
+}
+
+//合成seconds秒, 返回平均每个缓冲区的微秒数
+static double time_synth(audio_t *audio, const audio_event_t *voice, const u32 seconds) {
+    static int16_t buffer[SYNTH_CHUNK];
+    push_audio_event(audio, voice);
+    audio->synth_ticks = audio->buffers = 0;
+    while (audio->buffers < (u64)seconds * audio->sample_rate / SYNTH_CHUNK)
+        audio_callback(audio, (u8 *)buffer, sizeof buffer);
+    return (double)audio->synth_ticks * 1e6 / SDL_GetPerformanceFrequency() / audio->buffers;
+}
+
+void benchmark_audio(const config_t config) {
+    static audio_t audio;
+    const u32 rates[] = {44100, 48000};
+    const u32 seconds = 10;
+
+    for (u32 r = 0; r < sizeof rates / sizeof rates[0]; r++) {
+        memset(&audio, 0, sizeof audio);
+        init_audio(&audio, &config, rates[r], SYNTH_CHUNK);
+        const double buffer_us = 1e6 * SYNTH_CHUNK / rates[r];
+
+        //蜂鸣器; XO-CHIP最高音高, 0和1交替的样本, 跳变最多的情况
+        const audio_event_t beep = { .on = true };
+        audio_event_t pattern = { .on = true, .xo_audio = true, .pitch = 255 };
+        memset(pattern.pattern, 0xAA, sizeof pattern.pattern);
+        const double beep_us = time_synth(&audio, &beep, seconds);
+        pattern.sample = atomic_load(&audio.position);
+        const double pattern_us = time_synth(&audio, &pattern, seconds);
+
+        printf("音频合成 %uHz: 每个缓冲区(%u 采样, %.1f ms) 蜂鸣器 %.2f us(%.3f%%), XO-CHIP样本(音高255) %.2f us(%.3f%%)\n",
+               rates[r], SYNTH_CHUNK, buffer_us / 1000, beep_us, 100 * beep_us / buffer_us,
+               pattern_us, 100 * pattern_us / buffer_us);
+    }
+}
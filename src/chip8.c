@@ -3,40 +3,34 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
-
-#include "chip8.h"
-
-#define DEBUG
-
-void audio_callback(void *userdata, u8 *stream, int len) {
-    config_t *config = (config_t *)userdata;
-    
-    u16 *audio_data = (u16 *)stream;    //16是因为每次填充两字节; 有符号是因为音频数据可以有振幅, 振幅可正可负
-    static u32 running_sample_index = 0;   //用于跟踪生成音频的样本索引
-    const u32 square_wave_period = config->audio_sample_rate / config->square_wave_freq;    //方波周期, 音频采样率除以方波频率
-    const u32 half_square_wave_period = square_wave_period / 2; //方波的一般周期, 用于确定方波的高低电平
-
-    //向SDL的音频缓冲区以每次 2 字节的频率填充数据, 所以len除以2
-    //对于缓冲区的每个样本, 检查其在方波周期内(一个周期内, 方波有一半在高电平, 一般在低电平)的位置来输出音量, 处于方波的高电平就输出正音量, 反之输出负音量
-    for (int i = 0; i < len / 2; i++)
-        audio_data[i] = ((running_sample_index++ / half_square_wave_period) % 2) ? config->volume : -config->volume;
-}
+#include <math.h>
+
+#include "frontend.h"
+#include "lockstep.h"
+#include "savestate.h"
+#include "rewind.h"
+#include "replay.h"
+#include "scheduler.h"
+#include "trace.h"
+#include "metrics.h"
+#include "profile.h"
+#include "heatmap.h"
+#include "quirks.h"
+
+static recorder_t recorder; //--record: handle_input里的重置和载入存档也要录下来
+static trace_t trace;   //F9/--trace: 只由模拟线程使用
+static metrics_t metrics;   //--metrics: 只由模拟线程写
+static profile_t profile;   //--profile: 只由模拟线程使用
+static heatmap_t heatmap;   //F10/--heatmap: 只由模拟线程使用
+static float heat_levels[3][4096];  //衰减后的热度: 写, 取指, 读
 
 // 用传入的参数设置初始的模拟器配置
 bool set_config_from_args(config_t *config, const int argc, char **argv)
 {
-    *config = (config_t){
-        .window_width = 64,
-        .window_height = 32,
-        .fg_color = 0xFFFFFFFF, // 白色
-        .bg_color = 0x0000000F, // 黑色
-        .scale_factor = 20,
-        .pixel_outlines = true,     // 绘制像素边框
-        .insts_per_second = 600,    // 每秒执行600条指令
-        .square_wave_freq = 440,    // 方波频率: 440Hz
-        .audio_sample_rate = 44100, // 采样率: 44100Hz
-        .volume = 3000,             // INI16_MAX是最大音量
-    };
+    init_config(config);
+    config->seed = (u32)time(NULL);  //随机一个种子, 可以用--seed固定
+    const char *quirks_db = NULL;   //--quirks-db: 按ROM查兼容性配置的数据库
+    bool quirks_given = false;      //--quirks指定的配置优先于数据库
 
     for (int i = 1; i < argc; i++)
     {
@@ -52,12 +46,195 @@ bool set_config_from_args(config_t *config, const int argc, char **argv)
             i++;
             config->scale_factor = (u32)strtol(argv[i], NULL, 10); // strtol: 将字符串转为长整型
         }
+        // --renderer rects|texture: 选择渲染方式, rects是原来的逐像素绘制, 用来对比耗时
+        else if (strncmp(argv[i], "--renderer", strlen("--renderer")) == 0 && i + 1 < argc)
+        {
+            i++;
+            config->render_mode = (strcmp(argv[i], "rects") == 0) ? RENDER_RECTS : RENDER_TEXTURE;
+        }
+        // --engine switch|cached|jit: 选择解释器引擎, switch是原来的参考实现
+        else if (strncmp(argv[i], "--engine", strlen("--engine")) == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "switch") == 0) config->engine = ENGINE_SWITCH;
+            else if (strcmp(argv[i], "jit") == 0) config->engine = ENGINE_JIT;
+            else config->engine = ENGINE_CACHED;
+        }
+        // --benchmark N: 不打开窗口, 每种引擎各执行N条指令并报告每秒指令数, 再测量音频合成的耗时
+        else if (strncmp(argv[i], "--benchmark", strlen("--benchmark")) == 0 && i + 1 < argc)
+        {
+            i++;
+            config->benchmark_insts = (u32)strtoul(argv[i], NULL, 10);
+        }
+        // --verify N: 不打开窗口, 每种引擎和参考实现各执行N条指令, 比较最终状态
+        else if (strncmp(argv[i], "--verify", strlen("--verify")) == 0 && i + 1 < argc)
+        {
+            i++;
+            config->verify_insts = (u32)strtoul(argv[i], NULL, 10);
+        }
+        // --lockstep N: 不打开窗口, 锁步引擎的每个lane和同样多的独立虚拟机各执行N条指令, 比较速度和最终状态
+        else if (strncmp(argv[i], "--lockstep", strlen("--lockstep")) == 0 && i + 1 < argc)
+        {
+            i++;
+            config->lockstep_insts = (u32)strtoul(argv[i], NULL, 10);
+        }
+        // --seed N: 固定随机数种子, 同样的种子和输入得到同样的运行结果
+        else if (strncmp(argv[i], "--seed", strlen("--seed")) == 0 && i + 1 < argc)
+        {
+            i++;
+            config->seed = (u32)strtoul(argv[i], NULL, 10);
+        }
+        // --load-state 文件: 载入ROM后从这个存档继续运行, 跳过片头之类已经跑过的部分
+        else if (strncmp(argv[i], "--load-state", strlen("--load-state")) == 0 && i + 1 < argc)
+        {
+            i++;
+            config->state_file = argv[i];
+        }
+        // --rewind-kb N: 倒带缓冲区的大小(KB), 0表示关闭倒带
+        else if (strncmp(argv[i], "--rewind-kb", strlen("--rewind-kb")) == 0 && i + 1 < argc)
+        {
+            i++;
+            config->rewind_bytes = (u32)strtoul(argv[i], NULL, 10) * 1024;
+        }
+        // --record 文件: 把随机数种子和每次按键变化录下来, 用--replay重现
+        else if (strncmp(argv[i], "--record", strlen("--record")) == 0 && i + 1 < argc)
+        {
+            i++;
+            config->record_file = argv[i];
+        }
+        // --replay 文件: 不打开窗口, 不限速回放录像, 检查最终状态和录像时是否一致
+        else if (strncmp(argv[i], "--replay", strlen("--replay")) == 0 && i + 1 < argc)
+        {
+            i++;
+            config->replay_file = argv[i];
+        }
+        // --trace-records N: 跟踪缓冲区保留最近N条指令
+        else if (strncmp(argv[i], "--trace-records", strlen("--trace-records")) == 0 && i + 1 < argc)
+        {
+            i++;
+            config->trace_records = (u32)strtoul(argv[i], NULL, 10);
+        }
+        // --trace 文件: 一开始就跟踪指令, 按F9停止或退出时写进这个文件, 用chip8_trace查看
+        else if (strncmp(argv[i], "--trace", strlen("--trace")) == 0 && i + 1 < argc)
+        {
+            i++;
+            config->trace_file = argv[i];
+        }
+        // --metrics-interval N: 每隔N秒写一次统计
+        else if (strncmp(argv[i], "--metrics-interval", strlen("--metrics-interval")) == 0 && i + 1 < argc)
+        {
+            i++;
+            config->metrics_interval = (u32)strtoul(argv[i], NULL, 10);
+        }
+        // --metrics 文件|unix:路径: 统计每类指令和每个地址的执行次数等, 定期按Prometheus文本格式写出
+        else if (strncmp(argv[i], "--metrics", strlen("--metrics")) == 0 && i + 1 < argc)
+        {
+            i++;
+            config->metrics_dest = argv[i];
+        }
+        // --profile-period N: 每隔N个周期采样一次调用栈
+        else if (strncmp(argv[i], "--profile-period", strlen("--profile-period")) == 0 && i + 1 < argc)
+        {
+            i++;
+            config->profile_period = (u32)strtoul(argv[i], NULL, 10);
+        }
+        // --profile 文件: 定期采样调用栈, 退出时把折叠栈写进这个文件, 用flamegraph.pl等工具画火焰图
+        else if (strncmp(argv[i], "--profile", strlen("--profile")) == 0 && i + 1 < argc)
+        {
+            i++;
+            config->profile_file = argv[i];
+        }
+        // --labels 文件: 采样结果的符号表, 每行"<十六进制地址> <名字>"
+        else if (strncmp(argv[i], "--labels", strlen("--labels")) == 0 && i + 1 < argc)
+        {
+            i++;
+            config->labels_file = argv[i];
+        }
+        // --heatmap: 一开始就显示内存热度图, 之后按F10开关
+        else if (strncmp(argv[i], "--heatmap", strlen("--heatmap")) == 0)
+        {
+            config->heatmap = true;
+        }
+        // --speed N|max: N倍速运行, max(或0)表示不限速
+        else if (strncmp(argv[i], "--speed", strlen("--speed")) == 0 && i + 1 < argc)
+        {
+            i++;
+            config->speed = (strcmp(argv[i], "max") == 0) ? 0 : (u32)strtoul(argv[i], NULL, 10);
+        }
+        // --display-wait: 像COSMAC VIP一样, DXYN之后等到下一次60Hz刷新再继续执行
+        else if (strncmp(argv[i], "--display-wait", strlen("--display-wait")) == 0)
+        {
+            config->display_wait = true;
+        }
+        // --no-idle-skip: 空转循环也逐条执行, 用来比较或者测量引擎本身
+        else if (strncmp(argv[i], "--no-idle-skip", strlen("--no-idle-skip")) == 0)
+        {
+            config->skip_idle = false;
+        }
+        // --no-fuse: 预解码缓存引擎不使用融合指令, 用来比较
+        else if (strncmp(argv[i], "--no-fuse", strlen("--no-fuse")) == 0)
+        {
+            config->fuse = false;
+        }
+        // --quirks-db 文件: 在这个数据库里按ROM查兼容性配置(quirks.h), 查不到就用--quirks或者默认的vip
+        else if (strncmp(argv[i], "--quirks-db", strlen("--quirks-db")) == 0 && i + 1 < argc)
+        {
+            i++;
+            quirks_db = argv[i];
+        }
+        // --quirks vip|chip48|schip|xochip: 兼容性配置, 决定几条指令在各个CHIP-8变种中的行为
+        else if (strncmp(argv[i], "--quirks", strlen("--quirks")) == 0 && i + 1 < argc)
+        {
+            i++;
+            if (!parse_quirks(argv[i], &config->quirks)) {
+                fprintf(stderr, "不认识的兼容性配置: %s\n", argv[i]);
+                return false;
+            }
+            quirks_given = true;
+        }
     }
 
+    //命令行指定了配置就不查数据库
+    if (quirks_db && !quirks_given && !lookup_quirks(quirks_db, argv[1], &config->quirks)) return false;
+
     return true; // 成功
 }
 
-bool init_sdl(sdl_t *sdl, config_t *config) {
+//生成像素边框纹理: cols x rows个cell大小的格子, 每个格子画一圈1像素的背景色, 其余部分透明; 失败返回NULL
+static SDL_Texture *create_outline_texture(sdl_t *sdl, const config_t *config, const u32 cols, const u32 rows, const u32 cell) {
+    const u32 w = cols * cell;
+    const u32 h = rows * cell;
+    const u32 outline = config->bg_color | 0xFF;   //边框不透明, 和原来的SDL_RenderDrawRect效果一致
+
+    u32 *pixels = calloc((size_t)w * h, sizeof(u32));   //calloc清零, 即完全透明
+    if (!pixels) {
+        SDL_Log("无法分配边框纹理内存\n");
+        return NULL;
+    }
+
+    for (u32 y = 0; y < h; y++) {
+        for (u32 x = 0; x < w; x++) {
+            const u32 cx = x % cell;
+            const u32 cy = y % cell;
+            if (cx == 0 || cy == 0 || cx == cell - 1 || cy == cell - 1)
+                pixels[y * w + x] = outline;
+        }
+    }
+
+    SDL_Texture *texture = SDL_CreateTexture(sdl->renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STATIC, w, h);
+    if (!texture) {
+        SDL_Log("无法创建边框纹理 %s\n", SDL_GetError());
+        free(pixels);
+        return NULL;
+    }
+    SDL_UpdateTexture(texture, NULL, pixels, w * sizeof(u32));
+    SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+    free(pixels);
+
+    return texture;
+}
+
+bool init_sdl(sdl_t *sdl, config_t *config, audio_t *audio) {
     //1.初始化SDL库
     //等于0说明初始化成功
     if (SDL_Init(SDL_INIT_TIMER | SDL_INIT_AUDIO | SDL_INIT_VIDEO) != 0) {
@@ -86,14 +263,45 @@ bool init_sdl(sdl_t *sdl, config_t *config) {
         return false;
     }
 
-    // 4.初始化音频相关
+    //4.创建流式纹理: 每帧把display写进去, 再用一次SDL_RenderCopy缩放到整个窗口
+    sdl->screen_texture = SDL_CreateTexture(sdl->renderer, SDL_PIXELFORMAT_RGBA8888,
+                                            SDL_TEXTUREACCESS_STREAMING,
+                                            DISPLAY_WIDTH, DISPLAY_HEIGHT);
+    if (!sdl->screen_texture) {
+        SDL_Log("无法创建SDL纹理 %s\n", SDL_GetError());
+        return false;
+    }
+    //config中的颜色带有透明度, 屏幕纹理直接覆盖, 不做混合
+    SDL_SetTextureBlendMode(sdl->screen_texture, SDL_BLENDMODE_NONE);
+
+    //内存热度图: 4096字节排成64x64, 半透明地叠加在窗口右边
+    sdl->heat_texture = SDL_CreateTexture(sdl->renderer, SDL_PIXELFORMAT_RGBA8888,
+                                          SDL_TEXTUREACCESS_STREAMING, 64, 64);
+    if (!sdl->heat_texture) {
+        SDL_Log("无法创建热度图纹理 %s\n", SDL_GetError());
+        return false;
+    }
+    SDL_SetTextureBlendMode(sdl->heat_texture, SDL_BLENDMODE_BLEND);
+
+    //像素边框只和窗口大小有关, 预先画进一张透明纹理, 渲染时叠加一次即可; 高分辨率的格子边长是一半
+    if (config->pixel_outlines) {
+        sdl->outline_texture = create_outline_texture(sdl, config, config->window_width, config->window_height, config->scale_factor);
+        if (!sdl->outline_texture) return false;
+        if (config->scale_factor / 2 >= 3) {
+            sdl->outline_hires_texture = create_outline_texture(sdl, config, config->window_width * 2, config->window_height * 2,
+                                                                config->scale_factor / 2);
+            if (!sdl->outline_hires_texture) return false;
+        }
+    }
+
+    // 5.初始化音频相关
     sdl->want = (SDL_AudioSpec) {
-        .freq = 44100,  //44100Hz
+        .freq = config->audio_sample_rate,  //44100Hz
         .format = AUDIO_S16LSB, //有符号16位小端
         .channels = 1,  //Mono(单声道, stereo(2)是立体声, 双声道)
         .samples = 512, //缓冲区大小
         .callback = audio_callback,
-        .userdata = config, //将用户数据传递到音频回调函数
+        .userdata = audio, //将用户数据传递到音频回调函数
     };
 
     sdl->dev = SDL_OpenAudioDevice(NULL, 0, &sdl->want, &sdl->have, 0);
@@ -108,10 +316,24 @@ bool init_sdl(sdl_t *sdl, config_t *config) {
         return false;
     }
 
+    //设备一直播放, 没有声音时输出静音; 声音的变化由模拟线程放进队列的事件决定
+    init_audio(audio, config, sdl->have.freq, sdl->have.samples);
+
     return true;    //成功初始化
 }
 
 void final_cleanup(const sdl_t sdl) {
+    if (sdl.render_frames)
+        printf("渲染: %u 帧, 平均每帧 %.3f ms\n", sdl.render_frames,
+               (double)sdl.render_ticks * 1000 / SDL_GetPerformanceFrequency() / sdl.render_frames);
+    if (sdl.screen_pixels)
+        printf("纹理上传: 平均每帧 %.1f 像素, 是每帧上传整屏的 %.1f%%\n", (double)sdl.upload_pixels / sdl.render_frames,
+               100.0 * sdl.upload_pixels / sdl.screen_pixels);
+
+    if (sdl.outline_texture) SDL_DestroyTexture(sdl.outline_texture);
+    if (sdl.outline_hires_texture) SDL_DestroyTexture(sdl.outline_hires_texture);
+    if (sdl.heat_texture) SDL_DestroyTexture(sdl.heat_texture);
+    SDL_DestroyTexture(sdl.screen_texture);
     SDL_DestroyRenderer(sdl.renderer);     //关闭渲染器
     SDL_DestroyWindow(sdl.window);    //关闭窗口
     SDL_CloseAudioDevice(sdl.dev);  //关闭音频设备
@@ -129,58 +351,267 @@ void clear_screen(const sdl_t sdl, const config_t config) {
     SDL_RenderClear(sdl.renderer);
 }
 
-void update_screen(const sdl_t sdl, const config_t config, chip8_t *chip8) {
+//位平面叠加出的颜色, 下标的第p位是位平面p的像素; 0和1用config中的背景色和前景色, 其余只有XO-CHIP用得到
+static const u32 plane_colors[1 << DISPLAY_PLANES] = {
+    [2] = 0xFF6600FF,  [3] = 0x662200FF,  [4] = 0x3399FFFF,  [5] = 0x00CCCCFF,
+    [6] = 0x9966FFFF,  [7] = 0x66CC33FF,  [8] = 0xFF3366FF,  [9] = 0xFF99AAFF,
+    [10] = 0xCCFF66FF, [11] = 0xFFDD55FF, [12] = 0x555599FF, [13] = 0xBBBBBBFF,
+    [14] = 0x886644FF, [15] = 0x777777FF,
+};
+
+static void fill_palette(const config_t config, u32 palette[1 << DISPLAY_PLANES]) {
+    memcpy(palette, plane_colors, sizeof plane_colors);
+    palette[0] = config.bg_color;
+    palette[1] = config.fg_color;
+}
+
+//一行的像素颜色: 每个位平面取最高位拼成颜色下标, 然后左移一位
+static void expand_row(const u128 display[DISPLAY_PLANES][DISPLAY_HEIGHT], const u32 y, const u32 width, u8 colors[DISPLAY_WIDTH]) {
+    u128 bits[DISPLAY_PLANES];
+    for (u8 p = 0; p < DISPLAY_PLANES; p++) bits[p] = display[p][y];
+    for (u32 x = 0; x < width; x++) {
+        u8 color = 0;
+        for (u8 p = 0; p < DISPLAY_PLANES; p++) {
+            color |= (u8)(bits[p] >> (DISPLAY_WIDTH - 1)) << p;
+            bits[p] <<= 1;
+        }
+        colors[x] = color;
+    }
+}
+
+//旧的渲染方式: 每个像素调用一次SDL_RenderFillRect, 开启边框时再调用一次SDL_RenderDrawRect
+static void update_screen_rects(const sdl_t *sdl, const config_t config, const u128 display[DISPLAY_PLANES][DISPLAY_HEIGHT],
+                                const bool hires) {
+    const u32 width = hires ? DISPLAY_WIDTH : DISPLAY_WIDTH / 2;
+    const u32 height = hires ? DISPLAY_HEIGHT : DISPLAY_HEIGHT / 2;
+    const u32 cell = config.scale_factor * config.window_width / width;    //高分辨率时像素小一半
+
     //一个矩形
-    SDL_Rect rect = {.x = 0, .y = 0, .w = config.scale_factor, .h = config.scale_factor};
+    SDL_Rect rect = {.x = 0, .y = 0, .w = cell, .h = cell};
 
-    //获取背景色的值来绘制边框
+    //背景色也用来绘制边框
+    u32 palette[1 << DISPLAY_PLANES];
+    fill_palette(config, palette);
     const u8 bg_r = (config.bg_color >> 24) & 0xFF;
     const u8 bg_g = (config.bg_color >> 16) & 0xFF;
     const u8 bg_b = (config.bg_color >>  8) & 0xFF;
     const u8 bg_a = (config.bg_color >>  0) & 0xFF;
 
-    //每次遍历1个像素
-    for (u32 i = 0; i < sizeof chip8->display; i++) {
-        //把1维坐标i转化为二维左边(x, y)
-        // x = i % width
-        // y = i / width
-        rect.x = (i % config.window_width) * config.scale_factor;
-        rect.y = (i / config.window_width) * config.scale_factor;
-
-        if (chip8->display[i]) {
-            //用前景色绘制
-            if (chip8->pixel_color[i] != config.fg_color)
-                chip8->pixel_color[i] = config.fg_color;
-
-            const u8 r = (chip8->pixel_color[i] >> 24) & 0xFF;
-            const u8 g = (chip8->pixel_color[i] >> 16) & 0xFF;
-            const u8 b = (chip8->pixel_color[i] >>  8) & 0xFF;
-            const u8 a = (chip8->pixel_color[i] >>  0) & 0xFF;
-
-            SDL_SetRenderDrawColor(sdl.renderer, r, g, b, a);
-            SDL_RenderFillRect(sdl.renderer, &rect);    //绘制实心矩形
-
-            if (config.pixel_outlines) {
-                SDL_SetRenderDrawColor(sdl.renderer, bg_r, bg_g, bg_b, bg_a);
-                SDL_RenderDrawRect(sdl.renderer, &rect);    //绘制空心矩形, 即边框
+    //每次遍历1行像素
+    u8 colors[DISPLAY_WIDTH];
+    for (u32 y = 0; y < height; y++) {
+        expand_row(display, y, width, colors);
+        rect.y = y * cell;
+        for (u32 x = 0; x < width; x++) {
+            const u32 color = palette[colors[x]];
+            rect.x = x * cell;
+
+            //用像素的颜色绘制实心矩形, 未点亮的像素就是背景色
+            SDL_SetRenderDrawColor(sdl->renderer, (color >> 24) & 0xFF, (color >> 16) & 0xFF, (color >> 8) & 0xFF, color & 0xFF);
+            SDL_RenderFillRect(sdl->renderer, &rect);
+
+            if (colors[x] && config.pixel_outlines) {
+                SDL_SetRenderDrawColor(sdl->renderer, bg_r, bg_g, bg_b, bg_a);
+                SDL_RenderDrawRect(sdl->renderer, &rect);    //绘制空心矩形, 即边框
             }
         }
-        else {
-            //display[i] == false, 用背景色绘制
-            if (chip8->pixel_color[i] != config.bg_color)
-                chip8->pixel_color[i] = config.bg_color;
+    }
+}
 
-            const u8 r = (chip8->pixel_color[i] >> 24) & 0xFF;
-            const u8 g = (chip8->pixel_color[i] >> 16) & 0xFF;
-            const u8 b = (chip8->pixel_color[i] >>  8) & 0xFF;
-            const u8 a = (chip8->pixel_color[i] >>  0) & 0xFF;
+//新的渲染方式: 把display展开成像素写进流式纹理, 一次SDL_RenderCopy缩放到窗口, 边框用预先烘焙好的纹理叠加
+//低分辨率只用纹理左上角的64x32
+//只上传dirty中的行和列, 连续的几行一次SDL_UpdateTexture; 其余部分纹理里还是之前的像素(所以不能用SDL_LockTexture, 锁定的区域内容不确定)
+static void update_screen_texture(sdl_t *sdl, const config_t config, const u128 display[DISPLAY_PLANES][DISPLAY_HEIGHT],
+                                  const bool hires, const dirty_t dirty) {
+    const SDL_Rect area = { .x = 0, .y = 0, .w = hires ? DISPLAY_WIDTH : DISPLAY_WIDTH / 2, .h = hires ? DISPLAY_HEIGHT : DISPLAY_HEIGHT / 2 };
+    const dirty_t changed = clip_dirty(dirty, area.w, area.h);
+    const u32 columns = changed.right - changed.left;
+
+    u32 palette[1 << DISPLAY_PLANES];
+    fill_palette(config, palette);
+    u8 colors[DISPLAY_WIDTH];
+    u32 pixels[DISPLAY_HEIGHT][DISPLAY_WIDTH];  //每段只用前columns列
+    for (u32 y = 0; y < (u32)area.h; ) {
+        if (!((changed.rows >> y) & 1)) {
+            y++;
+            continue;
+        }
+        const u32 first = y;
+        for (; y < (u32)area.h && ((changed.rows >> y) & 1); y++) {
+            expand_row(display, y, changed.right, colors);
+            for (u32 x = changed.left; x < changed.right; x++) pixels[y - first][x - changed.left] = palette[colors[x]];
+        }
+        const SDL_Rect rect = { .x = changed.left, .y = first, .w = columns, .h = y - first };
+        if (SDL_UpdateTexture(sdl->screen_texture, &rect, pixels, sizeof pixels[0]) != 0) {
+            SDL_Log("无法更新纹理 %s\n", SDL_GetError());
+            return;
+        }
+        sdl->upload_pixels += columns * (y - first);
+    }
+    sdl->screen_pixels += area.w * area.h;
 
-            SDL_SetRenderDrawColor(sdl.renderer, r, g, b, a);
-            SDL_RenderFillRect(sdl.renderer, &rect);
+    SDL_RenderCopy(sdl->renderer, sdl->screen_texture, &area, NULL);    //NULL目标矩形: 缩放到整个窗口
+    SDL_Texture *outline = hires ? sdl->outline_hires_texture : sdl->outline_texture;
+    if (config.pixel_outlines && outline)
+        SDL_RenderCopy(sdl->renderer, outline, NULL, NULL);
+}
+
+void update_screen(sdl_t *sdl, const config_t config, const u128 display[DISPLAY_PLANES][DISPLAY_HEIGHT], const bool hires,
+                   const dirty_t dirty, const u32 *heat) {
+    const u64 start = SDL_GetPerformanceCounter();
+
+    if (config.render_mode == RENDER_RECTS) update_screen_rects(sdl, config, display, hires);
+    else update_screen_texture(sdl, config, display, hires, dirty);
+
+    //热度图: 每帧一次纹理更新, 缩放成窗口高度的正方形放在右边
+    if (heat) {
+        const int h = config.window_height * config.scale_factor;
+        const SDL_Rect dest = { .x = config.window_width * config.scale_factor - h, .y = 0, .w = h, .h = h };
+        SDL_UpdateTexture(sdl->heat_texture, NULL, heat, 64 * sizeof(u32));
+        SDL_RenderCopy(sdl->renderer, sdl->heat_texture, NULL, &dest);
+    }
+
+    SDL_RenderPresent(sdl->renderer);
+
+    //统计每帧的渲染耗时, 退出时打印平均值, 用来对比两种渲染方式
+    sdl->render_ticks += SDL_GetPerformanceCounter() - start;
+    sdl->render_frames++;
+}
+
+//存档栏位的文件名: <ROM路径>.state<栏位>
+static void slot_path(char *path, const size_t size, const chip8_t *chip8, const u32 slot) {
+    snprintf(path, size, "%s.state%u", chip8->rom_name, slot);
+}
+
+static void save_slot(const chip8_t *chip8, const u32 slot) {
+    char path[1024];
+    slot_path(path, sizeof path, chip8, slot);
+    if (save_state_file(chip8, path)) printf("==== 已保存到栏位 %u: %s ====\n", slot, path);
+}
+
+static void load_slot(chip8_t *chip8, const u32 slot) {
+    char path[1024];
+    slot_path(path, sizeof path, chip8, slot);
+    if (load_state_file(chip8, path)) {
+        printf("==== 已从栏位 %u 载入: %s ====\n", slot, path);
+        record_load(&recorder, chip8, path);
+    }
+}
+
+//开始跟踪: 清空缓冲区, 之后每条指令都记下来
+static void start_trace(chip8_t *chip8) {
+    clear_trace(&trace);
+    chip8->trace = &trace;
+    puts("==== 开始跟踪指令 ====");
+}
+
+//停止跟踪, 把缓冲区里最近的指令写进--trace的文件, 没有指定就是<ROM路径>.trace
+static void stop_trace(chip8_t *chip8, const config_t config) {
+    char path[1024];
+    if (config.trace_file) snprintf(path, sizeof path, "%s", config.trace_file);
+    else snprintf(path, sizeof path, "%s.trace", chip8->rom_name);
+
+    chip8->trace = NULL;
+    if (save_trace(&trace, path))
+        printf("==== 停止跟踪, %llu 条指令中最近的 %llu 条已保存到 %s ====\n", (unsigned long long)trace.total,
+               (unsigned long long)(trace.total < trace.capacity ? trace.total : trace.capacity), path);
+}
+
+//SDL线程: 把一个输入事件放进队列, 队列满了(模拟线程卡住了)就丢掉
+static void send_input(emulator_t *emu, const input_type_t type, const u8 arg) {
+    input_queue_t *q = &emu->input;
+    const u32 tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&q->head, memory_order_acquire) == INPUT_QUEUE_SIZE) return;
+
+    q->events[tail & (INPUT_QUEUE_SIZE - 1)] = (input_event_t){ .type = type, .arg = arg };
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    SDL_SemPost(emu->wake);
+}
+
+//模拟线程: 取出一个输入事件, 队列空了返回false
+static bool receive_input(emulator_t *emu, input_event_t *event) {
+    input_queue_t *q = &emu->input;
+    const u32 head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&q->tail, memory_order_acquire)) return false;
+
+    *event = q->events[head & (INPUT_QUEUE_SIZE - 1)];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return true;
+}
+
+//模拟线程: 睡眠到SDL线程发来输入或者请求退出
+//先清掉已经取走的事件留下的计数再看队列: 看过之后才放进来的事件一定会再加一, 不会错过
+static void wait_input(emulator_t *emu) {
+    while (SDL_SemTryWait(emu->wake) == 0) {}
+    const input_queue_t *q = &emu->input;
+    if (atomic_load_explicit(&q->head, memory_order_relaxed) == atomic_load_explicit(&q->tail, memory_order_acquire)
+        && !atomic_load(&emu->quit))
+        SDL_SemWait(emu->wake);
+}
+
+//叫醒在SDL_WaitEvent里睡眠的SDL线程
+static void wake_sdl_thread(const emulator_t *emu) {
+    SDL_Event event = { .type = emu->frame_event };
+    SDL_PushEvent(&event);
+}
+
+//任一线程: 请求退出, 叫醒可能在睡眠的另一个线程
+static void request_quit(emulator_t *emu) {
+    atomic_store(&emu->quit, true);
+    SDL_SemPost(emu->wake);
+    wake_sdl_thread(emu);
+}
+
+//热度图的一个通道: 访问次数按对数映射到0~255, 2^16次左右就是最亮
+static u8 heat_channel(const float level) {
+    if (level < 1) return (u8)(level * 16);
+    const float value = log2f(1 + level) * 16;
+    return value > 255 ? 255 : (u8)value;
+}
+
+//取走这一帧的访问次数, 和之前衰减后的热度合起来生成热度图的像素
+static void render_heat(u32 pixels[4096]) {
+    for (u32 i = 0; i < 4096; i++) {
+        float *w = &heat_levels[0][i], *f = &heat_levels[1][i], *r = &heat_levels[2][i];
+        *w = *w * HEAT_DECAY + heatmap.writes[i];
+        *f = *f * HEAT_DECAY + heatmap.fetches[i];
+        *r = *r * HEAT_DECAY + heatmap.reads[i];
+        if (*w + *f + *r < 1.0f / 16) {     //大部分内存没人访问, 不用算对数
+            *w = *f = *r = 0;
+            pixels[i] = HEAT_ALPHA;
+            continue;
         }
+        pixels[i] = ((u32)heat_channel(*w) << 24) | ((u32)heat_channel(*f) << 16) | ((u32)heat_channel(*r) << 8) | HEAT_ALPHA;
     }
+    memset(&heatmap, 0, sizeof heatmap);
+}
 
-    SDL_RenderPresent(sdl.renderer);
+//模拟线程: 写好back之后和middle交换, 新的一帧对SDL线程可见
+static void publish_frame(emulator_t *emu, const u64 cycle) {
+    frame_buffer_t *fb = &emu->frames;
+    frame_t *frame = &fb->frames[fb->back];
+    copy_display(&emu->chip8, frame->display);
+    frame->hires = emu->chip8.hires;
+    frame->dirty = fb->dropped;
+    mark_dirty(&frame->dirty, emu->chip8.dirty.rows, emu->chip8.dirty.left, emu->chip8.dirty.right);
+    frame->cycle = cycle;
+    frame->heat_on = emu->chip8.heatmap != NULL;
+    if (frame->heat_on) render_heat(frame->heat);
+    if (emu->chip8.metrics) count_frame(emu->chip8.metrics, emu->chip8.dirty, display_width(&emu->chip8), display_height(&emu->chip8));
+    emu->chip8.dirty = (dirty_t){0};
+    const u8 old = atomic_exchange_explicit(&fb->middle, fb->back | FRAME_FRESH, memory_order_acq_rel);
+    fb->back = old & 3;
+    //换回来的帧还没被SDL线程取走, 它的变化没有显示出来, 下一帧要一起上传; 也说明已经叫醒过SDL线程, 不用再发事件
+    fb->dropped = old & FRAME_FRESH ? fb->frames[fb->back].dirty : (dirty_t){0};
+    if (!(old & FRAME_FRESH)) wake_sdl_thread(emu);
+}
+
+//SDL线程: 有新的一帧就和middle交换, 返回它; 没有返回NULL
+static const frame_t *latest_frame(emulator_t *emu) {
+    frame_buffer_t *fb = &emu->frames;
+    if (!(atomic_load_explicit(&fb->middle, memory_order_relaxed) & FRAME_FRESH)) return NULL;
+    fb->front = atomic_exchange_explicit(&fb->middle, fb->front, memory_order_acq_rel) & 3;
+    return &fb->frames[fb->front];
 }
 
 /*
@@ -189,54 +620,61 @@ q w e r  ->  4 5 6 D
 a s d f      7 8 9 E
 z x c v      A 0 B F
 */
-void handle_input(chip8_t *chip8, config_t *config) {
+void handle_input(emulator_t *emu) {
     SDL_Event event;
 
     while (SDL_PollEvent(&event)) {
         switch (event.type) {
             case SDL_QUIT:
-                chip8->state = QUIT;
+                request_quit(emu);
                 return;
 
             case SDL_KEYDOWN:
                 switch (event.key.keysym.sym) {
-                    case SDLK_ESCAPE: chip8->state = QUIT; break;
-                    case SDLK_SPACE: //暂停
-                        if (chip8->state == RUNNING) {
-                            chip8->state = PAUSED;
-                            puts("==== PAUSED ====");
-                        }
-                        else chip8->state = RUNNING;
+                    case SDLK_ESCAPE: request_quit(emu); break;
+                    case SDLK_SPACE: send_input(emu, INPUT_PAUSE, 0); break;  //暂停
+                    case SDLK_EQUALS: send_input(emu, INPUT_RESET, 0); break; //为当前游戏重置chip8虚拟机
+                    case SDLK_BACKSPACE: send_input(emu, INPUT_REWIND, 1); break;   //按住时倒带
+                    case SDLK_DOWN: { //降低音量
+                        const u16 volume = atomic_load(&emu->audio.volume);
+                        atomic_store(&emu->audio.volume, volume > 500 ? volume - 500 : 0);
                         break;
-                    case SDLK_EQUALS:   //为当前游戏重置chip8虚拟机
-                        init_chip8(chip8, *config, chip8->rom_name);
+                    }
+                    case SDLK_UP: { //提高音量
+                        const u16 volume = atomic_load(&emu->audio.volume);
+                        atomic_store(&emu->audio.volume, volume < INT16_MAX - 500 ? volume + 500 : INT16_MAX);
                         break;
-                    case SDLK_DOWN: //降低音量
-                        if (config->volume < INT16_MAX) config->volume -= 500;
+                    }
+
+                    //F1~F4保存到存档栏位1~4, F5~F8从栏位1~4载入
+                    case SDLK_F1: case SDLK_F2: case SDLK_F3: case SDLK_F4:
+                        send_input(emu, INPUT_SAVE, event.key.keysym.sym - SDLK_F1 + 1);
                         break;
-                    case SDLK_UP: //提高音量
-                        if (config->volume < INT16_MAX) config->volume += 500;
+                    case SDLK_F5: case SDLK_F6: case SDLK_F7: case SDLK_F8:
+                        send_input(emu, INPUT_LOAD, event.key.keysym.sym - SDLK_F5 + 1);
                         break;
+                    case SDLK_F9: send_input(emu, INPUT_TRACE, 0); break;  //开始/停止跟踪指令
+                    case SDLK_F10: send_input(emu, INPUT_HEATMAP, 0); break;   //显示/隐藏内存热度图
                     
-                    case SDLK_1: chip8->keypad[0x1] = true; break;
-                    case SDLK_2: chip8->keypad[0x2] = true; break;
-                    case SDLK_3: chip8->keypad[0x3] = true; break;
-                    case SDLK_4: chip8->keypad[0xC] = true; break;
-
-                    case SDLK_q: chip8->keypad[0x4] = true; break;
-                    case SDLK_w: chip8->keypad[0x5] = true; break;
-                    case SDLK_e: chip8->keypad[0x6] = true; break;
-                    case SDLK_r: chip8->keypad[0xD] = true; break;
-
-                    case SDLK_a: chip8->keypad[0x7] = true; break;
-                    case SDLK_s: chip8->keypad[0x8] = true; break;
-                    case SDLK_d: chip8->keypad[0x9] = true; break;
-                    case SDLK_f: chip8->keypad[0xE] = true; break;
-
-                    case SDLK_z: chip8->keypad[0xA] = true; break;
-                    case SDLK_x: chip8->keypad[0x0] = true; break;
-                    case SDLK_c: chip8->keypad[0xB] = true; break;
-                    case SDLK_v: chip8->keypad[0xF] = true; break;
+                    case SDLK_1: send_input(emu, INPUT_KEY_DOWN, 0x1); break;
+                    case SDLK_2: send_input(emu, INPUT_KEY_DOWN, 0x2); break;
+                    case SDLK_3: send_input(emu, INPUT_KEY_DOWN, 0x3); break;
+                    case SDLK_4: send_input(emu, INPUT_KEY_DOWN, 0xC); break;
+
+                    case SDLK_q: send_input(emu, INPUT_KEY_DOWN, 0x4); break;
+                    case SDLK_w: send_input(emu, INPUT_KEY_DOWN, 0x5); break;
+                    case SDLK_e: send_input(emu, INPUT_KEY_DOWN, 0x6); break;
+                    case SDLK_r: send_input(emu, INPUT_KEY_DOWN, 0xD); break;
+
+                    case SDLK_a: send_input(emu, INPUT_KEY_DOWN, 0x7); break;
+                    case SDLK_s: send_input(emu, INPUT_KEY_DOWN, 0x8); break;
+                    case SDLK_d: send_input(emu, INPUT_KEY_DOWN, 0x9); break;
+                    case SDLK_f: send_input(emu, INPUT_KEY_DOWN, 0xE); break;
+
+                    case SDLK_z: send_input(emu, INPUT_KEY_DOWN, 0xA); break;
+                    case SDLK_x: send_input(emu, INPUT_KEY_DOWN, 0x0); break;
+                    case SDLK_c: send_input(emu, INPUT_KEY_DOWN, 0xB); break;
+                    case SDLK_v: send_input(emu, INPUT_KEY_DOWN, 0xF); break;
 
                     default: break;
                 }
@@ -244,25 +682,27 @@ void handle_input(chip8_t *chip8, config_t *config) {
             
             case SDL_KEYUP:
                 switch (event.key.keysym.sym) {
-                    case SDLK_1: chip8->keypad[0x1] = false; break;
-                    case SDLK_2: chip8->keypad[0x2] = false; break;
-                    case SDLK_3: chip8->keypad[0x3] = false; break;
-                    case SDLK_4: chip8->keypad[0xC] = false; break;
-
-                    case SDLK_q: chip8->keypad[0x4] = false; break;
-                    case SDLK_w: chip8->keypad[0x5] = false; break;
-                    case SDLK_e: chip8->keypad[0x6] = false; break;
-                    case SDLK_r: chip8->keypad[0xD] = false; break;
-
-                    case SDLK_a: chip8->keypad[0x7] = false; break;
-                    case SDLK_s: chip8->keypad[0x8] = false; break;
-                    case SDLK_d: chip8->keypad[0x9] = false; break;
-                    case SDLK_f: chip8->keypad[0xE] = false; break;
-
-                    case SDLK_z: chip8->keypad[0xA] = false; break;
-                    case SDLK_x: chip8->keypad[0x0] = false; break;
-                    case SDLK_c: chip8->keypad[0xB] = false; break;
-                    case SDLK_v: chip8->keypad[0xF] = false; break;
+                    case SDLK_BACKSPACE: send_input(emu, INPUT_REWIND, 0); break;
+
+                    case SDLK_1: send_input(emu, INPUT_KEY_UP, 0x1); break;
+                    case SDLK_2: send_input(emu, INPUT_KEY_UP, 0x2); break;
+                    case SDLK_3: send_input(emu, INPUT_KEY_UP, 0x3); break;
+                    case SDLK_4: send_input(emu, INPUT_KEY_UP, 0xC); break;
+
+                    case SDLK_q: send_input(emu, INPUT_KEY_UP, 0x4); break;
+                    case SDLK_w: send_input(emu, INPUT_KEY_UP, 0x5); break;
+                    case SDLK_e: send_input(emu, INPUT_KEY_UP, 0x6); break;
+                    case SDLK_r: send_input(emu, INPUT_KEY_UP, 0xD); break;
+
+                    case SDLK_a: send_input(emu, INPUT_KEY_UP, 0x7); break;
+                    case SDLK_s: send_input(emu, INPUT_KEY_UP, 0x8); break;
+                    case SDLK_d: send_input(emu, INPUT_KEY_UP, 0x9); break;
+                    case SDLK_f: send_input(emu, INPUT_KEY_UP, 0xE); break;
+
+                    case SDLK_z: send_input(emu, INPUT_KEY_UP, 0xA); break;
+                    case SDLK_x: send_input(emu, INPUT_KEY_UP, 0x0); break;
+                    case SDLK_c: send_input(emu, INPUT_KEY_UP, 0xB); break;
+                    case SDLK_v: send_input(emu, INPUT_KEY_UP, 0xF); break;
 
                     default: break;
                 }
@@ -273,650 +713,392 @@ void handle_input(chip8_t *chip8, config_t *config) {
     }
 }
 
-bool init_chip8(chip8_t *chip8, const config_t config, const char rom_name[]) {
-    const u16 entry = 0x200;  //chip8载入位置
-
-    //字体数据
-    const u8 font[] = {
-        0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
-        0x20, 0x60, 0x20, 0x20, 0x70, // 1
-        0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
-        0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
-        0x90, 0x90, 0xF0, 0x10, 0x10, // 4
-        0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
-        0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
-        0xF0, 0x10, 0x20, 0x40, 0x40, // 7
-        0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
-        0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
-        0xF0, 0x90, 0xF0, 0x90, 0x90, // A
-        0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
-        0xF0, 0x80, 0x80, 0x80, 0xF0, // C
-        0xE0, 0x90, 0x90, 0x90, 0xE0, // D
-        0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
-        0xF0, 0x80, 0xF0, 0x80, 0x80, // F
-    };
+//基准测试: 不打开窗口, 每种引擎各从头执行config.benchmark_insts条指令, 打印每秒执行的指令数; 最后测量音频合成
+static void run_benchmark(const config_t config, const char rom_name[]) {
+    static chip8_t chip8;
 
-    //1.初始化整个chip8虚拟机
-    memset(chip8, 0, sizeof(chip8_t));
+    for (engine_t engine = ENGINE_SWITCH; engine <= ENGINE_JIT; engine++) {
+        config_t bench_config = config;
+        bench_config.engine = engine;
+        if (!init_chip8(&chip8, bench_config, rom_name)) return;
 
-    //2.载入字体
-    memcpy(&chip8->ram[0], font, sizeof(font));
+        const u64 start = SDL_GetPerformanceCounter();
+        u64 executed = 0;
+        while (executed < config.benchmark_insts)
+            executed += run_instructions(&chip8, bench_config, config.benchmark_insts - executed);
+        const double seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
 
-    //读取并载入游戏
-    //i 打开文件:
-    FILE *rom = fopen(rom_name, "rb");  //"rb"以二进制模式读文件
-    if (!rom) {
-        SDL_Log("游戏: %s 打开失败\n", rom_name);
-        return false;
+        printf("引擎 %-6s: %llu 条指令, 耗时 %.3f s, 每秒 %.0f 条(兼容性配置 %s)\n",
+               engine_name(engine), (unsigned long long)executed, seconds, executed / seconds, quirks_name(config.quirks));
     }
-    
-    //ii 读取游戏大小
-    fseek(rom, 0, SEEK_END);    //将文件指针移动到文件末尾
-    const size_t rom_size = ftell(rom); //获取文件指针当前位置
-    const size_t max_size = sizeof(chip8->ram) - entry; //计算能加载的游戏大小上限
-    rewind(rom);    //将文件指针重新移动到文件开头
-
-    if (rom_size > max_size) {
-        SDL_Log("这个游戏: %s 太大了, 游戏大小: %llu, 可加载上限: %llu\n", rom_name, rom_size, max_size);
-        return false;
+    free_chip8(&chip8);
+
+    benchmark_audio(config);
+}
+
+//对照测试: 不打开窗口, 参考实现(switch)和其他每种引擎各从头执行config.verify_insts条指令, 比较最终状态
+static bool run_verify(const config_t config, const char rom_name[]) {
+    static chip8_t reference, other;
+    bool all_match = true;
+
+    config_t ref_config = config;
+    ref_config.engine = ENGINE_SWITCH;
+    if (!init_chip8(&reference, ref_config, rom_name)) return false;
+    for (u64 executed = 0; executed < config.verify_insts; )
+        executed += run_instructions(&reference, ref_config, config.verify_insts - executed);
+
+    for (engine_t engine = ENGINE_CACHED; engine <= ENGINE_JIT; engine++) {
+        config_t other_config = config;
+        other_config.engine = engine;
+        if (!init_chip8(&other, other_config, rom_name)) return false;   //和参考实现用同样的随机数种子
+        for (u64 executed = 0; executed < config.verify_insts; )
+            executed += run_instructions(&other, other_config, config.verify_insts - executed);
+
+        const bool match = same_state(&reference, &other);
+        printf("%s: 引擎 %-6s 执行 %u 条指令后与参考实现%s (PC = 0x%04X / 0x%04X)\n", rom_name,
+               engine_name(engine), config.verify_insts, match ? "一致" : "不一致", reference.PC, other.PC);
+        all_match &= match;
     }
-    /* ftell():
-        若流以二进制模式打开，则由此函数获得的值是从文件开始的字节数。
-        若流以文本模式打开，则由此函数返回的值未指定，且仅若作为 fseek() 的输入才有意义。
-    */
 
-    //iii 加载游戏
-    if (fread(&chip8->ram[entry], rom_size, 1, rom) != 1) {
-        SDL_Log("无法将游戏: %s 读取到内存中\n", rom_name);
-        return false;
+    free_chip8(&reference);
+    free_chip8(&other);
+    return all_match;
+}
+
+//锁步测试: 不打开窗口, LOCKSTEP_LANES个lane(种子各不相同)用锁步引擎执行config.lockstep_insts步,
+//再让同样多的独立虚拟机各用emulate_instruction执行同样多条指令, 报告两者每秒执行的指令总数并比较每个lane的最终状态
+static bool run_lockstep_benchmark(const config_t config, const char rom_name[]) {
+    static lockstep_t ls;
+    static chip8_t scalar[LOCKSTEP_LANES];
+    const u64 total = (u64)config.lockstep_insts * LOCKSTEP_LANES;
+
+    if (!init_lockstep(&ls, config, rom_name, LOCKSTEP_LANES)) return false;
+    u64 start = SDL_GetPerformanceCounter();
+    run_lockstep(&ls, config, config.lockstep_insts);
+    const double lockstep_seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+    start = SDL_GetPerformanceCounter();
+    for (u32 l = 0; l < LOCKSTEP_LANES; l++) {
+        config_t lane_config = config;
+        lane_config.seed = config.seed + l;     //和锁步引擎的第l个lane一样
+        if (!init_chip8(&scalar[l], lane_config, rom_name)) return false;
+        for (u32 i = 0; i < config.lockstep_insts; i++) emulate_instruction(&scalar[l], lane_config);
     }
-    fclose(rom);
-    /* 
-        size_t fread(void *ptr, size_t size, size_t nmemb, FILE *stream);
-        从stream中读取nmemb个数据块并存储到ptr指向的位置, 每个数据块有size个字节
-        成功则返回读取的数据块数量(nmemb); 如果返回值小于nmemb可能失败或以达到文件末尾
-    */
+    const double scalar_seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
 
-    //设置chip8虚拟机
-    chip8->state = RUNNING; //状态
-    chip8->PC = entry;
-    chip8->rom_name = rom_name;
-    chip8->SP = &chip8->stk[0];
-    memset(&chip8->pixel_color[0], config.bg_color, sizeof chip8->pixel_color);
+    bool all_match = true;
+    for (u32 l = 0; l < LOCKSTEP_LANES; l++) all_match &= same_state(lockstep_lane(&ls, l), &scalar[l]);
 
-    return true;
+    printf("锁步   : %u 个lane x %u 条指令, 耗时 %.3f s, 每秒 %.0f 条, 向量执行 %.1f%% 的步数\n",
+           LOCKSTEP_LANES, config.lockstep_insts, lockstep_seconds, total / lockstep_seconds,
+           100.0 * ls.vector_steps / (ls.vector_steps + ls.scalar_steps));
+    printf("逐个执行: %u 个虚拟机 x %u 条指令, 耗时 %.3f s, 每秒 %.0f 条\n",
+           LOCKSTEP_LANES, config.lockstep_insts, scalar_seconds, total / scalar_seconds);
+    printf("最终状态%s\n", all_match ? "一致" : "不一致");
+
+    destroy_lockstep(&ls);
+    for (u32 l = 0; l < LOCKSTEP_LANES; l++) free_chip8(&scalar[l]);
+    return all_match;
 }
 
-#ifdef DEBUG
-void print_debug_info(chip8_t *chip8)
-{
-    printf("Address: 0x%04X, Opcode: 0x%04X Desc: ",
-           chip8->PC - 2, chip8->inst.opcode);
+#define PACE_SPIN_MS 2
 
-    switch ((chip8->inst.opcode >> 12) & 0x0F)
-    {
-    case 0x00:
-        if (chip8->inst.NN == 0xE0)
-        {
-            // 0x00E0: Clear the screen
-            printf("Clear screen\n");
-        }
-        else if (chip8->inst.NN == 0xEE)
-        {
-            // 0x00EE: Return from subroutine
-            // Set program counter to last address on subroutine stack ("pop" it off the stack)
-            //   so that next opcode will be gotten from that address.
-            printf("Return from subroutine to address 0x%04X\n",
-                   *(chip8->SP - 1));
-        }
-        else
-        {
-            printf("Unimplemented Opcode.\n");
-        }
-        break;
-
-    case 0x01:
-        // 0x1NNN: Jump to address NNN
-        printf("Jump to address NNN (0x%04X)\n",
-               chip8->inst.NNN);
-        break;
-
-    case 0x02:
-        // 0x2NNN: Call subroutine at NNN
-        // Store current address to return to on subroutine stack ("push" it on the stack)
-        //   and set program counter to subroutine address so that the next opcode
-        //   is gotten from there.
-        printf("Call subroutine at NNN (0x%04X)\n",
-               chip8->inst.NNN);
-        break;
-
-    case 0x03:
-        // 0x3XNN: Check if VX == NN, if so, skip the next instruction
-        printf("Check if V%X (0x%02X) == NN (0x%02X), skip next instruction if true\n",
-               chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.NN);
-        break;
-
-    case 0x04:
-        // 0x4XNN: Check if VX != NN, if so, skip the next instruction
-        printf("Check if V%X (0x%02X) != NN (0x%02X), skip next instruction if true\n",
-               chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.NN);
-        break;
-
-    case 0x05:
-        // 0x5XY0: Check if VX == VY, if so, skip the next instruction
-        printf("Check if V%X (0x%02X) == V%X (0x%02X), skip next instruction if true\n",
-               chip8->inst.X, chip8->V[chip8->inst.X],
-               chip8->inst.Y, chip8->V[chip8->inst.Y]);
-        break;
-
-    case 0x06:
-        // 0x6XNN: Set register VX to NN
-        printf("Set register V%X = NN (0x%02X)\n",
-               chip8->inst.X, chip8->inst.NN);
-        break;
-
-    case 0x07:
-        // 0x7XNN: Set register VX += NN
-        printf("Set register V%X (0x%02X) += NN (0x%02X). Result: 0x%02X\n",
-               chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.NN,
-               chip8->V[chip8->inst.X] + chip8->inst.NN);
-        break;
-
-    case 0x08:
-        switch (chip8->inst.N)
-        {
-        case 0:
-            // 0x8XY0: Set register VX = VY
-            printf("Set register V%X = V%X (0x%02X)\n",
-                   chip8->inst.X, chip8->inst.Y, chip8->V[chip8->inst.Y]);
-            break;
+//抖动直方图每个桶的上限(微秒), 最后一个桶是其余的
+static const u32 jitter_bounds[JITTER_BUCKETS - 1] = {50, 100, 250, 500, 1000, 2000, 5000};
 
-        case 1:
-            // 0x8XY1: Set register VX |= VY
-            printf("Set register V%X (0x%02X) |= V%X (0x%02X); Result: 0x%02X\n",
-                   chip8->inst.X, chip8->V[chip8->inst.X],
-                   chip8->inst.Y, chip8->V[chip8->inst.Y],
-                   chip8->V[chip8->inst.X] | chip8->V[chip8->inst.Y]);
-            break;
+//从现在开始计时, 第一帧在一个周期之后
+static void reset_pacer(pacer_t *pacer) {
+    pacer->period = SDL_GetPerformanceFrequency() / 60;
+    pacer->deadline = SDL_GetPerformanceCounter() + pacer->period;
+}
 
-        case 2:
-            // 0x8XY2: Set register VX &= VY
-            printf("Set register V%X (0x%02X) &= V%X (0x%02X); Result: 0x%02X\n",
-                   chip8->inst.X, chip8->V[chip8->inst.X],
-                   chip8->inst.Y, chip8->V[chip8->inst.Y],
-                   chip8->V[chip8->inst.X] & chip8->V[chip8->inst.Y]);
-            break;
+//等到下一帧开始的时刻: 先睡眠, 最后一小段忙等; 记下实际开始的时刻晚了多少
+static void wait_next_frame(pacer_t *pacer) {
+    const u64 freq = SDL_GetPerformanceFrequency();
+    u64 now = SDL_GetPerformanceCounter();
+    while (now < pacer->deadline) {
+        const u64 left_ms = (pacer->deadline - now) * 1000 / freq;
+        if (left_ms > PACE_SPIN_MS) SDL_Delay((u32)(left_ms - PACE_SPIN_MS));
+        now = SDL_GetPerformanceCounter();
+    }
 
-        case 3:
-            // 0x8XY3: Set register VX ^= VY
-            printf("Set register V%X (0x%02X) ^= V%X (0x%02X); Result: 0x%02X\n",
-                   chip8->inst.X, chip8->V[chip8->inst.X],
-                   chip8->inst.Y, chip8->V[chip8->inst.Y],
-                   chip8->V[chip8->inst.X] ^ chip8->V[chip8->inst.Y]);
-            break;
+    const u64 late_us = (now - pacer->deadline) * 1000000 / freq;
+    u32 bucket = 0;
+    while (bucket < JITTER_BUCKETS - 1 && late_us >= jitter_bounds[bucket]) bucket++;
+    pacer->jitter[bucket]++;
+    pacer->frames++;
+
+    //落后超过4帧(比如窗口被拖动)就不再追赶, 否则接下来会连续跑很多帧
+    pacer->deadline += pacer->period;
+    if (now > pacer->deadline + 4 * pacer->period) {
+        pacer->deadline = now + pacer->period;
+        pacer->resyncs++;
+    }
+}
 
-        case 4:
-            // 0x8XY4: Set register VX += VY, set VF to 1 if carry
-            printf("Set register V%X (0x%02X) += V%X (0x%02X), VF = 1 if carry; Result: 0x%02X, VF = %X\n",
-                   chip8->inst.X, chip8->V[chip8->inst.X],
-                   chip8->inst.Y, chip8->V[chip8->inst.Y],
-                   chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y],
-                   ((u16)(chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y]) > 255));
-            break;
+static void print_jitter(const pacer_t *pacer) {
+    if (!pacer->frames) return;
 
-        case 5:
-            // 0x8XY5: Set register VX -= VY, set VF to 1 if there is not a borrow (result is positive/0)
-            printf("Set register V%X (0x%02X) -= V%X (0x%02X), VF = 1 if no borrow; Result: 0x%02X, VF = %X\n",
-                   chip8->inst.X, chip8->V[chip8->inst.X],
-                   chip8->inst.Y, chip8->V[chip8->inst.Y],
-                   chip8->V[chip8->inst.X] - chip8->V[chip8->inst.Y],
-                   (chip8->V[chip8->inst.Y] <= chip8->V[chip8->inst.X]));
-            break;
-
-        case 6:
-            // 0x8XY6: Set register VX >>= 1, store shifted off bit in VF
-            printf("Set register V%X (0x%02X) >>= 1, VF = shifted off bit (%X); Result: 0x%02X\n",
-                   chip8->inst.X, chip8->V[chip8->inst.X],
-                   chip8->V[chip8->inst.X] & 1,
-                   chip8->V[chip8->inst.X] >> 1);
-            break;
+    printf("帧开始时间比计划晚(%llu 帧, 重新计时 %llu 次):", (unsigned long long)pacer->frames,
+           (unsigned long long)pacer->resyncs);
+    for (u32 b = 0; b < JITTER_BUCKETS; b++) {
+        if (b < JITTER_BUCKETS - 1) printf(" <%uus", jitter_bounds[b]);
+        else printf(" >=%uus", jitter_bounds[b - 1]);
+        printf(" %.1f%%", 100.0 * pacer->jitter[b] / pacer->frames);
+    }
+    printf("\n");
+}
 
-        case 7:
-            // 0x8XY7: Set register VX = VY - VX, set VF to 1 if there is not a borrow (result is positive/0)
-            printf("Set register V%X = V%X (0x%02X) - V%X (0x%02X), VF = 1 if no borrow; Result: 0x%02X, VF = %X\n",
-                   chip8->inst.X, chip8->inst.Y, chip8->V[chip8->inst.Y],
-                   chip8->inst.X, chip8->V[chip8->inst.X],
-                   chip8->V[chip8->inst.Y] - chip8->V[chip8->inst.X],
-                   (chip8->V[chip8->inst.X] <= chip8->V[chip8->inst.Y]));
-            break;
+//虚拟机现在的声音
+static audio_event_t current_voice(const chip8_t *chip8) {
+    audio_event_t voice = { .on = chip8->sound_timer > 0, .xo_audio = chip8->xo_audio, .pitch = chip8->pitch };
+    memcpy(voice.pattern, chip8->audio_pattern, sizeof voice.pattern);
+    return voice;
+}
 
-        case 0xE:
-            // 0x8XYE: Set register VX <<= 1, store shifted off bit in VF
-            printf("Set register V%X (0x%02X) <<= 1, VF = shifted off bit (%X); Result: 0x%02X\n",
-                   chip8->inst.X, chip8->V[chip8->inst.X],
-                   (chip8->V[chip8->inst.X] & 0x80) >> 7,
-                   chip8->V[chip8->inst.X] << 1);
-            break;
+//除了时刻以外是否相同
+static bool same_voice(const audio_event_t *a, const audio_event_t *b) {
+    return a->on == b->on && a->xo_audio == b->xo_audio && a->pitch == b->pitch
+        && memcmp(a->pattern, b->pattern, sizeof a->pattern) == 0;
+}
 
-        default:
-            // Wrong/unimplemented opcode
-            break;
-        }
-        break;
-
-    case 0x09:
-        // 0x9XY0: Check if VX != VY; Skip next instruction if so
-        printf("Check if V%X (0x%02X) != V%X (0x%02X), skip next instruction if true\n",
-               chip8->inst.X, chip8->V[chip8->inst.X],
-               chip8->inst.Y, chip8->V[chip8->inst.Y]);
-        break;
-
-    case 0x0A:
-        // 0xANNN: Set index register I to NNN
-        printf("Set I to NNN (0x%04X)\n",
-               chip8->inst.NNN);
-        break;
-
-    case 0x0B:
-        // 0xBNNN: Jump to V0 + NNN
-        printf("Set PC to V0 (0x%02X) + NNN (0x%04X); Result PC = 0x%04X\n",
-               chip8->V[0], chip8->inst.NNN, chip8->V[0] + chip8->inst.NNN);
-        break;
-
-    case 0x0C:
-        // 0xCXNN: Sets register VX = rand() % 256 & NN (bitwise AND)
-        printf("Set V%X = rand() %% 256 & NN (0x%02X)\n",
-               chip8->inst.X, chip8->inst.NN);
-        break;
-
-    case 0x0D:
-        // 0xDXYN: Draw N-height sprite at coords X,Y; Read from memory location I;
-        //   Screen pixels are XOR'd with sprite bits,
-        //   VF (Carry flag) is set if any screen pixels are set off; This is useful
-        //   for collision detection or other reasons.
-        printf("Draw N (%u) height sprite at coords V%X (0x%02X), V%X (0x%02X) "
-               "from memory location I (0x%04X). Set VF = 1 if any pixels are turned off.\n",
-               chip8->inst.N, chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y,
-               chip8->V[chip8->inst.Y], chip8->I);
-        break;
-
-    case 0x0E:
-        if (chip8->inst.NN == 0x9E)
-        {
-            // 0xEX9E: Skip next instruction if key in VX is pressed
-            printf("Skip next instruction if key in V%X (0x%02X) is pressed; Keypad value: %d\n",
-                   chip8->inst.X, chip8->V[chip8->inst.X], chip8->keypad[chip8->V[chip8->inst.X]]);
-        }
-        else if (chip8->inst.NN == 0xA1)
-        {
-            // 0xEX9E: Skip next instruction if key in VX is not pressed
-            printf("Skip next instruction if key in V%X (0x%02X) is not pressed; Keypad value: %d\n",
-                   chip8->inst.X, chip8->V[chip8->inst.X], chip8->keypad[chip8->V[chip8->inst.X]]);
-        }
-        break;
+//声音变了(sound_timer开关, 或者XO-CHIP的样本和音高变了)就记下当前的周期
+static void beeper_sample(beeper_t *beeper, const chip8_t *chip8, const u64 cycle) {
+    if (beeper->voice.on == (chip8->sound_timer > 0) && !chip8->xo_audio && !beeper->voice.xo_audio) return;
+    const audio_event_t voice = current_voice(chip8);
+    if (same_voice(&voice, &beeper->voice)) return;
+    beeper->voice = voice;
+    if (beeper->count == BEEPER_EVENTS) return;
+    beeper->events[beeper->count] = voice;
+    beeper->events[beeper->count++].sample = cycle;
+}
 
-    case 0x0F:
-        switch (chip8->inst.NN)
-        {
-        case 0x0A:
-            // 0xFX0A: VX = get_key(); Await until a keypress, and store in VX
-            printf("Await until a key is pressed; Store key in V%X\n",
-                   chip8->inst.X);
-            break;
+//推进cycles个周期; 分成小段运行, 每段结束时检查声音, 变化最多晚1/BEEPER_STEPS个60Hz周期, 计时器减到0是准确的
+static u64 run_with_beeper(beeper_t *beeper, scheduler_t *sched, chip8_t *chip8, const config_t config, const u64 cycles) {
+    const u64 step = (sched->cycles_per_tick + BEEPER_STEPS - 1) / BEEPER_STEPS;
+    const u64 target = sched->cycle + cycles;
+    u64 executed = 0;
+
+    while (sched->cycle < target) {
+        u64 n = target - sched->cycle;
+        if (n > step) n = step;
+        if (n > sched->next_tick - sched->cycle) n = sched->next_tick - sched->cycle;
+        executed += run_scheduled(sched, chip8, config, n);
+        beeper_sample(beeper, chip8, sched->cycle);
+    }
 
-        case 0x1E:
-            // 0xFX1E: I += VX; Add VX to register I. For non-Amiga CHIP8, does not affect VF
-            printf("I (0x%04X) += V%X (0x%02X); Result (I): 0x%04X\n",
-                   chip8->I, chip8->inst.X, chip8->V[chip8->inst.X],
-                   chip8->I + chip8->V[chip8->inst.X]);
-            break;
+    return executed;
+}
 
-        case 0x07:
-            // 0xFX07: VX = delay timer
-            printf("Set V%X = delay timer value (0x%02X)\n",
-                   chip8->inst.X, chip8->delay_timer);
-            break;
+//一帧结束: 把这一帧的变化按周期在帧里的位置换算成采样, 放进音频队列
+//帧的起点跟着音频回调的位置走, 差得太远(刚开始, 暂停之后, 两边的时钟有偏差)就重新对齐
+static void flush_beeper(beeper_t *beeper, audio_t *audio, const u64 frame_start, const u64 frame_end) {
+    const u64 position = atomic_load_explicit(&audio->position, memory_order_acquire);
+    if (beeper->frame_sample < position || beeper->frame_sample > position + 2 * audio->latency) {
+        beeper->frame_sample = position + audio->latency;
+        beeper->resyncs++;
+    }
 
-        case 0x15:
-            // 0xFX15: delay timer = VX
-            printf("Set delay timer value = V%X (0x%02X)\n",
-                   chip8->inst.X, chip8->V[chip8->inst.X]);
-            break;
+    beeper->frame_rem += audio->sample_rate;
+    const u64 frame_samples = beeper->frame_rem / 60;
+    beeper->frame_rem %= 60;
 
-        case 0x18:
-            // 0xFX18: sound timer = VX
-            printf("Set sound timer value = V%X (0x%02X)\n",
-                   chip8->inst.X, chip8->V[chip8->inst.X]);
-            break;
+    const u64 frame_cycles = frame_end > frame_start ? frame_end - frame_start : 1;
+    for (u32 e = 0; e < beeper->count; e++) {
+        audio_event_t *event = &beeper->events[e];
+        event->sample = beeper->frame_sample + (event->sample - frame_start) * frame_samples / frame_cycles;
+        if (!same_voice(event, &beeper->sent) && push_audio_event(audio, event)) beeper->sent = *event;
+    }
+    //队列满丢了事件, 或者一帧的变化太多没记下, 在帧末补上最后的状态
+    if (!same_voice(&beeper->voice, &beeper->sent)) {
+        beeper->voice.sample = beeper->frame_sample + frame_samples;
+        if (push_audio_event(audio, &beeper->voice)) beeper->sent = beeper->voice;
+    }
 
-        case 0x29:
-            // 0xFX29: Set register I to sprite location in memory for character in VX (0x0-0xF)
-            printf("Set I to sprite location in memory for character in V%X (0x%02X). Result(VX*5) = (0x%02X)\n",
-                   chip8->inst.X, chip8->V[chip8->inst.X], chip8->V[chip8->inst.X] * 5);
-            break;
+    beeper->count = 0;
+    beeper->frame_sample += frame_samples;
+}
 
-        case 0x33:
-            // 0xFX33: Store BCD representation of VX at memory offset from I;
-            //   I = hundred's place, I+1 = ten's place, I+2 = one's place
-            printf("Store BCD representation of V%X (0x%02X) at memory from I (0x%04X)\n",
-                   chip8->inst.X, chip8->V[chip8->inst.X], chip8->I);
+//模拟线程执行一个输入事件
+static void apply_input(emulator_t *emu, const input_event_t event, bool *rewinding) {
+    chip8_t *chip8 = &emu->chip8;
+
+    switch (event.type) {
+        case INPUT_KEY_DOWN: chip8->keypad[event.arg & 0xF] = true; break;
+        case INPUT_KEY_UP: chip8->keypad[event.arg & 0xF] = false; break;
+        case INPUT_PAUSE:
+            if (chip8->state == RUNNING) {
+                chip8->state = PAUSED;
+                puts("==== PAUSED ====");
+            }
+            else chip8->state = RUNNING;
             break;
-
-        case 0x55:
-            // 0xFX55: Register dump V0-VX inclusive to memory offset from I;
-            //   SCHIP does not inrement I, CHIP8 does increment I
-            printf("Register dump V0-V%X (0x%02X) inclusive at memory from I (0x%04X)\n",
-                   chip8->inst.X, chip8->V[chip8->inst.X], chip8->I);
+        case INPUT_RESET:   //为当前游戏重置chip8虚拟机
+            init_chip8(chip8, emu->config, chip8->rom_name);
+            record_reset(&recorder, chip8);
             break;
-
-        case 0x65:
-            // 0xFX65: Register load V0-VX inclusive from memory offset from I;
-            //   SCHIP does not inrement I, CHIP8 does increment I
-            printf("Register load V0-V%X (0x%02X) inclusive at memory from I (0x%04X)\n",
-                   chip8->inst.X, chip8->V[chip8->inst.X], chip8->I);
+        case INPUT_SAVE: save_slot(chip8, event.arg); break;
+        case INPUT_LOAD: load_slot(chip8, event.arg); break;
+        case INPUT_REWIND: *rewinding = event.arg; break;
+        case INPUT_HEATMAP:
+            if (chip8->heatmap) chip8->heatmap = NULL;
+            else {
+                memset(&heatmap, 0, sizeof heatmap);
+                memset(heat_levels, 0, sizeof heat_levels);
+                chip8->heatmap = &heatmap;
+            }
+            chip8->draw = true;     //马上换成有或者没有热度图的画面
             break;
-
-        default:
+        case INPUT_TRACE:
+            if (!trace.records) break;
+            if (chip8->trace) stop_trace(chip8, emu->config);
+            else start_trace(chip8);
             break;
-        }
-        break;
-
-    default:
-        printf("Unimplemented Opcode.\n");
-        break; // Unimplemented or invalid opcode
+        default: break;
     }
 }
-#endif
-
-void emulate_instruction(chip8_t *chip8, const config_t config) {
-    bool carry; //VF的值, VF作为进位标志用于某些指令中
-
-    //1.结合PC寄存器在内存中获取指令, 同时PC后移
-    chip8->inst.opcode = (chip8->ram[chip8->PC] << 8) | chip8->ram[chip8->PC + 1];  /* **这里涉及到类型转换, 移位运算, 大小端** */
-    
-    chip8->PC += 2;
-
-    //2.将一条指令转为nnn,nn等
-    chip8->inst.NNN = chip8->inst.opcode & 0x0FFF; 
-    chip8->inst.NN  = chip8->inst.opcode & 0x0FF;
-    chip8->inst.N   = chip8->inst.opcode & 0x0F;
-    chip8->inst.X   = (chip8->inst.opcode >> 8) & 0x0F;
-    chip8->inst.Y   = (chip8->inst.opcode >> 4) & 0x0F;
 
-    #ifdef DEBUG
-        print_debug_info(chip8);
-    #endif
+//模拟线程: 按节奏运行虚拟机, 每帧把屏幕交给SDL线程
+static int emulation_main(void *data) {
+    emulator_t *emu = data;
+    chip8_t *chip8 = &emu->chip8;
+    const config_t config = emu->config;
+
+    //倒带: 每帧结束时保存一次, 按住退格键时每帧退回一帧
+    rewind_t rewind = {0};
+    if (config.rewind_bytes && !init_rewind(&rewind, config.rewind_bytes)) {
+        request_quit(emu);
+        return 1;
+    }
 
-    //3.模拟指令
-    switch ((chip8->inst.opcode >> 12) & 0x0F)    //保留高四位
-    {
-    case 0x00:
-        // 0x00E0: 清屏
-        if (chip8->inst.NN == 0xE0) {
-            memset(chip8->display, false, sizeof chip8->display);
-            chip8->draw = true;
-        }
-        else if (chip8->inst.NN == 0xEE) {
-            // 0x00EE: 从子程序返回   
-            // 栈顶指针减一(相当于pop), 再将SP指向的内容(父程序调用子程序之后的地址)赋值给PC
-            chip8->PC = *--chip8->SP;
+    //指令跟踪: 缓冲区一开始就分配好, 按F9只是开关; --trace时从第一条指令开始跟踪
+    if (config.trace_records && !init_trace(&trace, config.trace_records)) {
+        free_rewind(&rewind);
+        request_quit(emu);
+        return 1;
+    }
+    if (config.trace_file) start_trace(chip8);
+    if (config.heatmap) chip8->heatmap = &heatmap;
+
+    //调用栈采样: 由调度器按周期触发, 退出时写出
+    if (config.profile_file) {
+        if (!init_profile(&profile, config.profile_period)) {
+            free_rewind(&rewind);
+            free_trace(&trace);
+            request_quit(emu);
+            return 1;
         }
-        else {
-            // 0x0NNN: wiki上说大多数rom用不上
-        }
-        break;
-    case 0x01: 
-        // 0x1NNN: 跳转到NNN
-        chip8->PC = chip8->inst.NNN;
-        break;
-    case 0x02:
-        // 0x2NNN:调用位于NNN的子程序
-        // 先将当前PC推入栈中, 再将当前PC设置为NNN
-        *chip8->SP++ = chip8->PC;
-        chip8->PC = chip8->inst.NNN;
-        break;
-    case 0x03:
-        // 0x3XNN: 如果寄存器X的内容(VX) == NN, 跳过下一条指令
-        if (chip8->V[chip8->inst.X] == chip8->inst.NN) chip8->PC += 2;
-        break;
-    case 0x04:
-        // 0x4XNN: 如果VX != NN, 跳过下一条指令
-        if (chip8->V[chip8->inst.X] != chip8->inst.NN) chip8->PC += 2;
-        break;
-    case 0x05:
-        // 0x5XY0: 如果VX == VY, 跳过下一条指令
-        if (chip8->inst.N == 0 && chip8->V[chip8->inst.X] == chip8->V[chip8->inst.Y]) 
-            chip8->PC += 2;
-        break;
-    case 0x06:
-        // 0x6XNN: 设置VX为NN
-        chip8->V[chip8->inst.X] = chip8->inst.NN;
-        break;
-    case 0x07:
-        // 0x7XNN: VX += NN, 进位标志不变
-        chip8->V[chip8->inst.X] += chip8->inst.NN;
-        break;
-    case 0x08:
-        switch (chip8->inst.N) {
-            case 0x0:
-                // 0x8XY0: VX = VY
-                chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y];
-                break;
-            case 0x1:
-                // 0x8XY1: VX |= VY
-                chip8->V[chip8->inst.X] |= chip8->V[chip8->inst.Y];
-                chip8->V[0xF] = 0;  //chip888
-                break;
-            case 0x2:
-                // 0x8XY2: VX &= VY
-                chip8->V[chip8->inst.X] &= chip8->V[chip8->inst.Y];
-                chip8->V[0xF] = 0; //chip888
-                break;
-            case 0x3:
-                // 0x8XY1: VX ^= VY 异或
-                chip8->V[chip8->inst.X] ^= chip8->V[chip8->inst.Y];
-                chip8->V[0xF] = 0; //chip888
-                break;
-            case 0x4:
-                // 0x8XY1: VX += VY, 有溢出则置VF为1, 否则置0;
-                carry = (u16)(chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y]) > 0xFF;
-                chip8->V[chip8->inst.X] += chip8->V[chip8->inst.Y];
-                chip8->V[0x0F] = carry;
-                break;
-            case 0x5:
-                // 0x8XY5: VX -= VY, 如果VX >= VY, 则VF = 1, 否则VF = 0
-                carry = (chip8->V[chip8->inst.X] >= chip8->V[chip8->inst.Y]);
-                chip8->V[chip8->inst.X] -= chip8->V[chip8->inst.Y];
-                chip8->V[0x0F] = carry;
-                break;
-            case 0x6:
-                // 0x8XY6: 将VY的最低有效位存储在VF中, 然后VX = VY >> 1
-                carry = chip8->V[chip8->inst.Y] & 1;    //chip888
-                chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] >> 1;
-
-                //carry = chip8->V[chip8->inst.X] & 1;
-                //chip8->V[chip8->inst.X] >>= 1;
-
-                chip8->V[0x0F] = carry;
-                break;
-            case 0x7:
-                // 0x8XY7: 将VX的最低有效位存储在VF中, 然后VX >>= 1;
-                carry = (chip8->V[chip8->inst.X] <= chip8->V[chip8->inst.Y]);
-                chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] - chip8->V[chip8->inst.X];
-                chip8->V[0x0F] = carry;
-                break;
-            case 0xE:
-                // 0x8XYE: VF = (VY的最高有效位), 然后VX = VY << 1
-                carry = (chip8->V[chip8->inst.Y] & 0x80) >> 7;  //chip888
-                chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] << 1;
-
-                //carry = (chip8->V[chip8->inst.X] & 0x80) >> 7;
-                //chip8->V[chip8->inst.X] <<= 1;
-
-                chip8->V[0x0F] = carry;
-                break;
+        chip8->profile = &profile;
+    }
 
-            default: break;
-        }
-        break;
-    case 0x09:
-        // 9XY0: 如果VX != VY, 则跳过下一条指令
-        if (chip8->inst.N == 0 && chip8->V[chip8->inst.X] != chip8->V[chip8->inst.Y])
-            chip8->PC += 2;
-        break;
-    case 0x0A:
-        // 0xANNN: I = NNN
-        chip8->I = chip8->inst.NNN;
-        break;
-    case 0x0B:
-        // 0xBNNN: PC = V0 + NNN
-        chip8->PC = chip8->V[0x0] + chip8->inst.NNN;
-        break;
-    case 0x0C:
-        // 0xCXNN: VX = rand() & NN, 随机数范围:[0, 255]
-        chip8->V[chip8->inst.X] = (rand() % 256) & chip8->inst.NN;
-        break;
-    case 0x0D: {
-        // 0xDXYN: 绘制一个字体, 从(x, y)开始绘制(XOR), 宽8位, 高N位, 即N行8列;
-        //从内存I开始读取, I在执行指令之后不会改变;
-        //如果发生碰撞, 置VF = 1, 否则置VF = 0
-        //碰撞: 如果一个像素已经被渲染而它目前又要被渲染, 就发生了碰撞
-
-        //1.起始位置和终点位置
-        u8 X = chip8->V[chip8->inst.X] % config.window_width;
-        u8 Y = chip8->V[chip8->inst.Y] % config.window_height;
-        const u8 sX = X;
-
-        chip8->V[0xF] = 0;
-
-        //2.双层循环
-        for (u8 i = 0; i < chip8->inst.N; i++) {
-            const u8 sprite = chip8->ram[chip8->I + i];   //取1字节/ 1行8位
-            X = sX; //重置X
-
-            for (u8 j = 7; j >= 0; j--) {
-                bool *pixel = &chip8->display[Y * config.window_width + X];  //取得当前屏幕上某个像素的指针, 代表该像素是否要被绘制
-                const bool sprite_bit = sprite & (1 << j);  //取得读取到的图形中某个对应像素的值, 代表该像素是否要被绘制
-
-                //发生碰撞
-                if (sprite_bit && *pixel) chip8->V[0xF] = 1;
-
-                *pixel ^= sprite_bit;
-                
-                //屏幕边缘
-                if (++X >= config.window_width) break;
+    //执行统计: 每metrics_interval秒写一次, 退出时再写一次
+    if (config.metrics_dest) chip8->metrics = &metrics;
+    const u64 metrics_period = (u64)config.metrics_interval * SDL_GetPerformanceFrequency();
+    u64 next_metrics = SDL_GetPerformanceCounter() + metrics_period;
+
+    //调度器按周期推进虚拟机并触发60Hz计时器, 帧节奏按真实时间安排
+    scheduler_t sched;
+    init_scheduler(&sched, config);
+    pacer_t pacer = {0};
+    reset_pacer(&pacer);
+    bool rewinding = false;
+
+    //声音的变化按周期记下, 每帧结束时换算成音频采样交给音频回调
+    audio_t *audio = &emu->audio;
+    beeper_t beeper = { .frame_sample = atomic_load(&audio->position) + audio->latency };
+    beeper.voice = beeper.sent = (audio_event_t){ .pitch = 64 };   //和init_audio中音频回调开始时的声音一样
+
+    while (!atomic_load(&emu->quit)) {
+        //SDL线程发来的输入, 在这一帧的指令之前生效
+        input_event_t event;
+        while (receive_input(emu, &event)) apply_input(emu, event, &rewinding);
+
+        //暂停时睡眠到有输入; 继续之后从当时开始重新计时, 不去追赶暂停的时间
+        if (chip8->state == PAUSED) {
+            if (beeper.sent.on) {
+                audio_event_t silence = beeper.sent;
+                silence.on = false;
+                silence.sample = atomic_load(&audio->position);
+                if (push_audio_event(audio, &silence)) beeper.sent = silence;
             }
-
-            //屏幕边缘
-            if (++Y >= config.window_height) break;
+            wait_input(emu);
+            reset_pacer(&pacer);
+            continue;
         }
-        chip8->draw = true;
 
-        break;
-        }
-    case 0x0E:
-        if (chip8->inst.NN == 0x9E)  {
-            // 0xEX9E: 如果VX中存储的键被按下, 跳过下一条指令
-            if (chip8->keypad[chip8->V[chip8->inst.X]]) chip8->PC += 2;
-        }
-        else if (chip8->inst.NN == 0xA1) {
-            // 0xEX9E: 如果VX中存储的键被按下, 跳过下一条指令
-            if (chip8->keypad[chip8->V[chip8->inst.X]]) chip8->PC += 2;
+        //停在FX0A上, 计时器也停了: 键盘变化之前再运行也不会有任何变化, 和暂停一样睡眠到有输入
+        //统计, 热度图和采样要看到等待的周期, 倒带要每帧退一步, 这些时候照常逐帧运行
+        if (chip8->key_wait && !key_wait_ready(chip8) && !chip8->delay_timer && !chip8->sound_timer && !rewinding
+            && !instrumented(chip8) && !chip8->profile) {
+            wait_input(emu);
+            reset_pacer(&pacer);
+            continue;
         }
 
-        break;
-    case 0x0F:
-        switch (chip8->inst.NN) {
-        case 0x07:
-            // 0xFX07: VX = delay_timer
-            chip8->V[chip8->inst.X] = chip8->delay_timer;
-            break;
-        case 0x0A: {
-            // 0xFX0A: 等待按键, 所有指令暂停, 直到按键, 将那个键存在VX
-            static bool any = false;
-            static u8 key = 0xFF;
-            
-            //遍历是否有键被按下
-            for (u8 i = 0; key == 0xFF && i < sizeof chip8->keypad; i++) {
-                if (chip8->keypad[i]) {
-                    any = true;
-                    key = i;
-                    break;
-                }
-            }
+        const u64 start_frame_time = SDL_GetPerformanceCounter();
+        const u64 start_cycle = sched.cycle;
 
-            //遍历一遍后没有键被按下, 将PC往回调, 
-            if (!any) chip8->PC -= 2;
+        //每帧(1/60秒)推进insts_per_second / 60个周期, N倍速就是N倍; 不限速时一直运行到这一帧的时间用完
+        //按住退格键时不执行指令, 而是退回上一帧
+        if (rewinding && rewind.buffer) {
+            if (rewind_step(&rewind, chip8)) chip8->draw = true;
+            beeper_sample(&beeper, chip8, sched.cycle);
+        }
+        else {
+            record_keypad(&recorder, chip8);
+            if (config.speed) emu->emulated_insts += run_with_beeper(&beeper, &sched, chip8, config, (u64)sched.cycles_per_tick * config.speed);
             else {
-                //有键被按下, 将之存在VX中
-                if (chip8->keypad[key]) {
-                    //如果这个键还没松开, 就继续回调PC
-                    chip8->PC -= 2;
-                }
-                else {
-                    chip8->V[chip8->inst.X] = key;
-                    key = 0xFF;
-                    any = false;
-                }
+                //停在死循环里或者FX0A上时再运行也不会变化, 剩下的时间睡眠, 不占满CPU
+                do emu->emulated_insts += run_with_beeper(&beeper, &sched, chip8, config, (u64)sched.cycles_per_tick * 16);
+                while (!sched.halted && !chip8->key_wait && SDL_GetPerformanceCounter() < pacer.deadline);
             }
-            break;
-        }
-        case 0x15:
-            // 0xFX15: delay_timer = VX
-            chip8->delay_timer = chip8->V[chip8->inst.X];
-            break;
-        case 0x18:
-            // 0xFX18: sound_timer = VX;
-            chip8->sound_timer = chip8->V[chip8->inst.X];
-            break;
-        case 0x1E:
-            // 0xFX1E: I += VX, 不管VF
-            chip8->I += chip8->V[chip8->inst.X];
-            break;
-        case 0x29:
-            // 0xFX29: 将I设置为储存在VX中的值对应sprite字符的起始地址
-            // 我们的字符位置: 0x000~0x04F, 一个sprite字符用5个字节存储, 共80字节
-            chip8->I = chip8->V[chip8->inst.X] * 5;
-            break;
-        case 0x33:
-            //0xFX33: 将VX的百位, 十位和个位以BCD码形式分别存在内存I, I + 1, I + 2中
-            u8 bcd = chip8->V[chip8->inst.X];
-            chip8->ram[chip8->I + 2] = bcd % 10;
-            bcd /= 10;
-            chip8->ram[chip8->I + 1] = bcd % 10;
-            bcd /= 10;
-            chip8->ram[chip8->I] = bcd;
-            break;
-        case 0x55:
-            // 0xFX55: 从I开始存储V0~VX(包括VX), I会变化
-            for (u8 i = 0; i <= chip8->inst.X; i++)
-                chip8->ram[chip8->I++] = chip8->V[i];   //chip888
-                //chip8->ram[chip8->I + i] = chip8->V[i];
-            break;
-        case 0x65:
-            // 0xFX65: 从I开始, 往V0到VX中存, I会变化
-            for (u8 i = 0; i <= chip8->inst.X; i++)
-                chip8->V[i] = chip8->ram[chip8->I++];   //chip888
-                //chip8->V[i] = chip8->ram[chip8->I + i];
-            break;
+            recorder.cycle = sched.cycle;   //下一帧开始时处理的重置和载入存档发生在这个周期
+            emu->emulate_ticks += SDL_GetPerformanceCounter() - start_frame_time;
 
-        default: break;
+            //保存这一帧, 耗时也算在这一帧里
+            if (rewind.buffer) rewind_push(&rewind, chip8);
         }
-        break;
 
-    default: break;
-    }
-}
+        flush_beeper(&beeper, audio, start_cycle, sched.cycle);
+        if (chip8->draw || chip8->heatmap) {   //热度图每帧都在变
+            publish_frame(emu, sched.cycle);
+            chip8->draw = false;
+        }
 
-//每60Hz更新一次timers
-void update_timers(const sdl_t sdl, chip8_t *chip8) {
-    if (chip8->delay_timer > 0) chip8->delay_timer--;
+        if (chip8->metrics && metrics_period && SDL_GetPerformanceCounter() >= next_metrics) {
+            write_metrics(chip8->metrics, chip8->rom_name, config.metrics_dest);
+            next_metrics = SDL_GetPerformanceCounter() + metrics_period;  //暂停过也不连着补写
+        }
 
-    if (chip8->sound_timer > 0) {
-        chip8->sound_timer--;
-        SDL_PauseAudioDevice(sdl.dev, 0);   //播放
+        wait_next_frame(&pacer);
     }
-    else SDL_PauseAudioDevice(sdl.dev, 1);  //暂停
+
+    if (emu->emulate_ticks)
+        printf("引擎 %s: %llu 条指令, 每秒 %.0f 条(只计算模拟耗时)\n", engine_name(config.engine),
+               (unsigned long long)emu->emulated_insts,
+               (double)emu->emulated_insts * SDL_GetPerformanceFrequency() / emu->emulate_ticks);
+
+    print_jitter(&pacer);
+
+    //倒带的开销: 每帧保存用时和压缩后的大小, 以及缓冲区现在能退回多少秒
+    if (rewind.snapshots)
+        printf("倒带: 保存 %llu 帧, 平均 %.1f 微秒/帧(最长 %.1f), 平均 %.0f 字节/帧, 缓冲区 %u 字节可退回 %.1f 秒\n",
+               (unsigned long long)rewind.snapshots, rewind.snapshot_ns / 1e3 / rewind.snapshots,
+               rewind.max_snapshot_ns / 1e3, (double)rewind.delta_bytes / rewind.snapshots,
+               rewind.used, rewind.frames / 60.0);
+
+    printf("声音: 音频回调晚收到的事件 %u 个, 队列满丢掉的事件 %u 个, 和音频回调重新对齐 %u 次\n",
+           atomic_load(&audio->underruns), atomic_load(&audio->overruns), beeper.resyncs);
+
+    if (chip8->trace) stop_trace(chip8, config);
+    if (chip8->metrics) write_metrics(chip8->metrics, chip8->rom_name, config.metrics_dest);
+    if (chip8->profile && save_profile(chip8->profile, config.profile_file, config.labels_file))
+        printf("采样: %llu 次, %u 种调用栈, 已保存到 %s\n", (unsigned long long)profile.samples, profile.used, config.profile_file);
+    stop_recording(&recorder, chip8);
+    free_rewind(&rewind);
+    free_trace(&trace);
+    free_profile(&profile);
+    return 0;
 }
 
 int main(int argc, char** argv) {
@@ -929,61 +1111,86 @@ int main(int argc, char** argv) {
     config_t config = {0};
     if (!set_config_from_args(&config, argc, argv)) exit(EXIT_FAILURE);
 
-    //2.初始化SDL库
+    //基准测试不需要窗口和音频
+    if (config.benchmark_insts) {
+        run_benchmark(config, argv[1]);
+        exit(EXIT_SUCCESS);
+    }
+    if (config.verify_insts) exit(run_verify(config, argv[1]) ? EXIT_SUCCESS : EXIT_FAILURE);
+    if (config.lockstep_insts) exit(run_lockstep_benchmark(config, argv[1]) ? EXIT_SUCCESS : EXIT_FAILURE);
+    if (config.replay_file) exit(run_replay(config.replay_file, config, argv[1]) ? EXIT_SUCCESS : EXIT_FAILURE);
+
+    //2.初始化SDL库, 音频回调和模拟线程共享emu.audio
+    static emulator_t emu = {0};
     sdl_t sdl = {0};
-    if (!init_sdl(&sdl, &config)) exit(EXIT_FAILURE);
+    if (!init_sdl(&sdl, &config, &emu.audio)) exit(EXIT_FAILURE);
     
-    //3.初始化chip8虚拟机
-    chip8_t chip8 = {0};
+    //3.初始化chip8虚拟机, 之后它只归模拟线程使用
+    emu.config = config;
+    emu.frames.back = 0;
+    atomic_init(&emu.frames.middle, 1);
+    emu.frames.front = 2;
+    atomic_init(&emu.quit, false);
+    atomic_init(&emu.audio.head, 0);
+    atomic_init(&emu.audio.tail, 0);
+    atomic_init(&emu.audio.position, 0);
+    atomic_init(&emu.audio.underruns, 0);
+    atomic_init(&emu.audio.overruns, 0);
+    atomic_init(&emu.input.head, 0);
+    atomic_init(&emu.input.tail, 0);
+    emu.wake = SDL_CreateSemaphore(0);
+    emu.frame_event = SDL_RegisterEvents(1);
+    if (!emu.wake || emu.frame_event == (u32)-1) {
+        SDL_Log("无法创建线程之间的通知 %s\n", SDL_GetError());
+        exit(EXIT_FAILURE);
+    }
+
+    chip8_t *chip8 = &emu.chip8;
     const char *rom_name = argv[1];
-    if (!init_chip8(&chip8, config, rom_name)) exit(EXIT_FAILURE);
+    if (!init_chip8(chip8, config, rom_name)) exit(EXIT_FAILURE);
+    if (config.state_file && !load_state_file(chip8, config.state_file)) exit(EXIT_FAILURE);
+    if (config.record_file && !start_recording(&recorder, config.record_file, chip8, config)) exit(EXIT_FAILURE);
+
+    //倒带会让虚拟机回到录像里没有的状态, 录像时不能倒带
+    if (config.record_file) emu.config.rewind_bytes = 0;
 
     //4.用背景色初始化屏幕
     clear_screen(sdl, config);
+    static u128 display[DISPLAY_PLANES][DISPLAY_HEIGHT];
+    copy_display(chip8, display);
+    update_screen(&sdl, config, display, chip8->hires, chip8->dirty, NULL);  //刚初始化, 整屏都是变化
+
+    //5.模拟在自己的线程里按节奏运行, 这个线程只处理输入和显示, SDL_RenderPresent再慢也不会拖慢模拟
+    SDL_Thread *thread = SDL_CreateThread(emulation_main, "emulation", &emu);
+    if (!thread) {
+        SDL_Log("无法创建模拟线程 %s\n", SDL_GetError());
+        exit(EXIT_FAILURE);
+    }
 
-    //随机一个种子
-    srand(time(NULL));
+    //音频设备一直播放, 声音的开关由模拟线程按采样安排
+    SDL_PauseAudioDevice(sdl.dev, 0);
 
-    //5.进入主循环
-    while (chip8.state != QUIT) {
+    while (!atomic_load(&emu.quit)) {
         //处理输入
-        handle_input(&chip8, &config);
-
-        if (chip8.state == PAUSED) continue;
-
-        /* 1帧(Hz)的周期(frame, 时间)可以执行若干条指令 */
-
-        //在运行指令之前获取时间, (frame表示周期, 代表1帧的执行时间)
-        const uint64_t start_frame_time = SDL_GetPerformanceCounter();  //此函数用于计算时间差
-
-        //模拟指令: "config.insts_per_second / 60"代表 60Hz, 1Hz执行config.insts_per_second / 60条指令
-        //同理:"config.insts_per_second / 144"代表 144Hz, 1Hz执行config.insts_per_second / 144条指令
-        for (u32 i = 0; i < config.insts_per_second / 60; i++) {
-            emulate_instruction(&chip8, config);
+        handle_input(&emu);
 
-            //指令中可能要求绘制sprite字体, 一个frame绘制1个sprite
-            if (chip8.inst.opcode >> 12 == 0xD) break;  //chip888
-        }
-
-        //指令结束后获取时间
-        const u64 end_frame_time = SDL_GetPerformanceCounter();
-
-        //计算当前帧的实际执行时间, 确保每帧的执行时间接近16.67ms(即每秒60帧)
-        const double time_elapsed = (double)((end_frame_time - start_frame_time) * 1000) / SDL_GetPerformanceFrequency();   //此函数返回计数器的频率, 即每秒钟的计数器刻度数, 也就是计数器每秒增加多少次
-
-        //Delay: (大约)60hz/60fps(16.67ms), 根据当前帧的实际执行时间进行延迟, 如果不足16.67ms, 就延迟余下的时间, 否则不延迟
-        SDL_Delay(16.67f > time_elapsed ? 16.67f - time_elapsed : 0);
-
-        //渲染窗口
-        if (chip8.draw) {
-            update_screen(sdl, config, &chip8);
-            chip8.draw = false;
-        }
+        //显示最新的一帧, 没有新帧就睡眠到有输入事件或者模拟线程交出新的一帧
+        const frame_t *frame = latest_frame(&emu);
+        if (frame) update_screen(&sdl, config, frame->display, frame->hires, frame->dirty, frame->heat_on ? frame->heat : NULL);
+        else SDL_WaitEvent(NULL);
     }
 
+    SDL_WaitThread(thread, NULL);
+    SDL_DestroySemaphore(emu.wake);
+
     //6.最后退出  
+    free_chip8(chip8);
     final_cleanup(sdl);
 
+    //音频设备已经关闭, 可以读音频回调自己的统计
+    if (emu.audio.buffers)
+        printf("音频合成: %llu 个缓冲区, 平均每个 %.2f us\n", (unsigned long long)emu.audio.buffers,
+               (double)emu.audio.synth_ticks * 1e6 / SDL_GetPerformanceFrequency() / emu.audio.buffers);
+
     exit(EXIT_SUCCESS);
 }
-
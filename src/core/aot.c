@@ -0,0 +1,36 @@
+#include "aot.h"
+#include "trace.h"
+
+//块的代码是否和翻译时一样: 块所在的页没被写过就一定一样, 写过的话再逐字节比较
+static inline bool block_intact(const chip8_t *chip8, const aot_block_t *block) {
+    if (!(chip8->written_pages & block->pages)) return true;
+    for (u16 i = 0; i < block->len; i++)
+        if (ram_read(chip8, chip8->PC + i) != block->code[i]) return false;
+    return true;
+}
+
+u32 run_aot(chip8_t *chip8, const config_t config, const aot_program_t *program, const u32 count) {
+    if (chip8->trace) return run_traced(chip8, config, count);  //跟踪时不执行翻译好的块
+    config_t interp = config;   //没有翻译的代码交给预解码缓存引擎, 一次执行一条
+    interp.engine = ENGINE_CACHED;
+    if (program->quirks != config.quirks) return run_instructions(chip8, interp, count);    //块的语义和配置不符
+    u32 executed = 0;
+
+    while (executed < count) {
+        const aot_block_t *block = (chip8->PC <= 0xFFF && !instrumented(chip8)) ? program->blocks[chip8->PC] : NULL;   //计数时不执行翻译好的块
+
+        //整个块都在剩余的指令数之内才执行, 保证执行的指令数和解释器完全一致
+        if (block && block->insts <= count - executed && block_intact(chip8, block)) {
+            chip8->PC = block->fn(chip8, &config);
+            executed += block->insts;
+            if (block->draws) break;    //一个frame绘制1个sprite, chip888
+            continue;
+        }
+
+        const bool draw = (ram_read(chip8, chip8->PC) >> 4) == 0xD;  //chip888
+        executed += run_instructions(chip8, interp, 1);
+        if (draw || chip8->key_wait) break;     //FX0A暂停时也返回
+    }
+
+    return executed;
+}
@@ -0,0 +1,1419 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "jit.h"
+#include "pool.h"
+#include "trace.h"
+#include "metrics.h"
+#include "heatmap.h"
+#include "quirks.h"
+
+static decoded_t decode_opcode(const u16 opcode);
+static void fuse_instructions(decoded_t decoded[4096]);
+
+//被改写过的共享预解码页换成这一页: 全部是未解码(0), 执行到时再解码进自己的页, 不会被写
+static decoded_t undecoded_page[PAGE_SIZE];
+
+#define FUSE_BACK 5 //融合指令最多3条(6字节), 写入的字节之前这么多字节处开始的组都要作废
+
+//默认的模拟器配置, 前端和各种无窗口工具共用
+void init_config(config_t *config) {
+    *config = (config_t){
+        .window_width = 64,
+        .window_height = 32,
+        .fg_color = 0xFFFFFFFF, // 白色
+        .bg_color = 0x0000000F, // 黑色
+        .scale_factor = 20,
+        .pixel_outlines = true,     // 绘制像素边框
+        .render_mode = RENDER_TEXTURE,  // 默认用流式纹理渲染
+        .engine = ENGINE_CACHED,    // 默认用预解码缓存引擎
+        .benchmark_insts = 0,       // 0表示正常运行, 不跑基准测试
+        .verify_insts = 0,          // 0表示正常运行, 不跑对照测试
+        .lockstep_insts = 0,        // 0表示正常运行, 不跑锁步测试
+        .seed = 0,                  // 随机数种子
+        .state_file = NULL,         // 从头开始运行
+        .rewind_bytes = 512 * 1024, // 倒带缓冲区512KB
+        .record_file = NULL,        // 不录像
+        .replay_file = NULL,        // 不回放
+        .trace_file = NULL,         // 不跟踪, 按F9开始
+        .trace_records = 1 << 16,   // 跟踪最近65536条指令(768KB)
+        .metrics_dest = NULL,       // 不统计
+        .metrics_interval = 10,     // 统计每10秒写一次
+        .profile_file = NULL,       // 不采样
+        .profile_period = 97,       // 每97个周期采样一次; 用质数, 不容易和循环的长度同步
+        .labels_file = NULL,        // 没有符号表
+        .heatmap = false,           // 不显示内存热度图, 按F10打开
+        .insts_per_second = 600,    // 每秒执行600条指令
+        .speed = 1,                 // 实时
+        .display_wait = false,      // DXYN之后不等刷新
+        .skip_idle = true,          // 跳过空转循环
+        .fuse = true,               // 预解码缓存引擎使用融合指令
+        .quirks = QUIRKS_VIP,       // 兼容性配置: COSMAC VIP
+        .square_wave_freq = 440,    // 方波频率: 440Hz
+        .audio_sample_rate = 44100, // 采样率: 44100Hz
+        .volume = 3000,             // INI16_MAX是最大音量
+    };
+}
+
+//载入ROM的内存镜像, 同一个ROM的所有虚拟机可以共享它
+rom_image_t *load_rom_image(const char rom_name[]) {
+    const u16 entry = 0x200;  //chip8载入位置
+
+    //字体数据
+    const u8 font[] = {
+        0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
+        0x20, 0x60, 0x20, 0x20, 0x70, // 1
+        0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
+        0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
+        0x90, 0x90, 0xF0, 0x10, 0x10, // 4
+        0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
+        0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
+        0xF0, 0x10, 0x20, 0x40, 0x40, // 7
+        0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
+        0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
+        0xF0, 0x90, 0xF0, 0x90, 0x90, // A
+        0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
+        0xF0, 0x80, 0x80, 0x80, 0xF0, // C
+        0xE0, 0x90, 0x90, 0x90, 0xE0, // D
+        0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
+        0xF0, 0x80, 0xF0, 0x80, 0x80, // F
+    };
+
+    rom_image_t *image = calloc(1, sizeof(rom_image_t));
+    if (!image) {
+        fprintf(stderr, "游戏: %s 内存不足\n", rom_name);
+        return NULL;
+    }
+
+    //1.载入字体
+    memcpy(&image->ram[0], font, sizeof(font));
+
+    //2.读取并载入游戏
+    //i 打开文件:
+    FILE *rom = fopen(rom_name, "rb");  //"rb"以二进制模式读文件
+    if (!rom) {
+        fprintf(stderr, "游戏: %s 打开失败\n", rom_name);
+        free(image);
+        return NULL;
+    }
+    
+    //ii 读取游戏大小
+    fseek(rom, 0, SEEK_END);    //将文件指针移动到文件末尾
+    const size_t rom_size = ftell(rom); //获取文件指针当前位置
+    const size_t max_size = sizeof(image->ram) - entry; //计算能加载的游戏大小上限
+    rewind(rom);    //将文件指针重新移动到文件开头
+
+    if (rom_size > max_size) {
+        fprintf(stderr, "这个游戏: %s 太大了, 游戏大小: %llu, 可加载上限: %llu\n", rom_name, (unsigned long long)rom_size, (unsigned long long)max_size);
+        fclose(rom);
+        free(image);
+        return NULL;
+    }
+    /* ftell():
+        若流以二进制模式打开，则由此函数获得的值是从文件开始的字节数。
+        若流以文本模式打开，则由此函数返回的值未指定，且仅若作为 fseek() 的输入才有意义。
+    */
+
+    //iii 加载游戏
+    if (fread(&image->ram[entry], rom_size, 1, rom) != 1) {
+        fprintf(stderr, "无法将游戏: %s 读取到内存中\n", rom_name);
+        fclose(rom);
+        free(image);
+        return NULL;
+    }
+    fclose(rom);
+    /* 
+        size_t fread(void *ptr, size_t size, size_t nmemb, FILE *stream);
+        从stream中读取nmemb个数据块并存储到ptr指向的位置, 每个数据块有size个字节
+        成功则返回读取的数据块数量(nmemb); 如果返回值小于nmemb可能失败或以达到文件末尾
+    */
+
+    //3.预先解码每个地址的指令, 没被改写过的代码各个虚拟机都直接用这份
+    for (u32 addr = 0; addr < sizeof image->ram; addr++)
+        image->decoded[addr] = decode_opcode((image->ram[addr] << 8) | image->ram[(addr + 1) & 0xFFF]);
+    fuse_instructions(image->decoded);
+    image->hash = hash_bytes(image->ram, sizeof image->ram);
+
+    return image;
+}
+
+void free_rom_image(rom_image_t *image) {
+    free(image);
+}
+
+bool init_chip8(chip8_t *chip8, const config_t config, const char rom_name[]) {
+    rom_image_t *image = load_rom_image(rom_name);
+    if (!image) return false;
+
+    init_chip8_shared(chip8, config, image, rom_name);
+    chip8->owns_image = true;
+    return true;
+}
+
+void init_chip8_shared(chip8_t *chip8, const config_t config, const rom_image_t *image, const char rom_name[]) {
+    const u16 entry = 0x200;  //chip8载入位置
+
+    //1.初始化整个chip8虚拟机, 旧的私有页和JIT缓存对应的是旧的内存内容, 先释放
+    free_chip8(chip8);
+    struct chip8_pool *pool = chip8->pool;
+    struct trace *trace = chip8->trace;
+    struct metrics *metrics = chip8->metrics;
+    struct profile *profile = chip8->profile;
+    struct heatmap *heatmap = chip8->heatmap;
+    memset(chip8, 0, sizeof(chip8_t));
+    chip8->pool = pool;
+    chip8->trace = trace;   //重置之后继续跟踪
+    chip8->metrics = metrics;   //统计是累计的, 重置不清零
+    chip8->profile = profile;
+    chip8->heatmap = heatmap;
+
+    //2.所有页都先指向共享的镜像, 写的时候再复制
+    for (u8 page = 0; page < PAGE_COUNT; page++) {
+        chip8->ram[page] = (u8 *)&image->ram[page * PAGE_SIZE];
+        chip8->decoded[page] = (decoded_t *)&image->decoded[page * PAGE_SIZE];
+    }
+    chip8->image = image;
+
+    //设置chip8虚拟机
+    chip8->state = RUNNING; //状态
+    chip8->PC = entry;
+    chip8->rom_name = rom_name;
+    chip8->SP = 0;
+    chip8->rng = config.seed ^ 0x9E3779B9;  //xorshift的状态不能是0
+    if (!chip8->rng) chip8->rng = 1;
+    chip8->wait_key = 0xFF;
+    chip8->pitch = 64;  //XO-CHIP的默认音高, 样本每秒播放4000位
+    chip8->planes = 1;  //只画第一个位平面, 和没有位平面的CHIP-8一样
+    mark_dirty(&chip8->dirty, ~(u64)0, 0, DISPLAY_WIDTH);   //重置之后前端显示的还是旧的画面
+}
+
+void free_chip8(chip8_t *chip8) {
+    for (u8 page = 0; page < PAGE_COUNT; page++) {
+        if (chip8->private_ram & (1 << page)) pool_free(chip8->pool, chip8->ram[page], PAGE_SIZE);
+        if (chip8->private_decoded & (1 << page))
+            pool_free(chip8->pool, chip8->decoded[page], PAGE_SIZE * sizeof(decoded_t));
+    }
+    chip8->private_ram = chip8->private_decoded = 0;
+    if (chip8->screen) pool_free(chip8->pool, chip8->screen, sizeof(screen_t));
+    chip8->screen = NULL;
+
+    if (chip8->owns_image) free_rom_image((rom_image_t *)chip8->image);
+    chip8->image = NULL;
+    chip8->owns_image = false;
+
+    jit_destroy(chip8->jit);
+    chip8->jit = NULL;
+}
+
+//写时复制: 第一次写共享的页时复制一份, 之后只写自己的拷贝
+void copy_ram_page(chip8_t *chip8, const u8 page) {
+    u8 *copy = pool_alloc(chip8->pool, PAGE_SIZE);
+    if (!copy) {
+        fprintf(stderr, "内存不足, 无法复制内存页\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(copy, chip8->ram[page], PAGE_SIZE);
+    chip8->ram[page] = copy;
+    chip8->private_ram |= 1 << page;
+}
+
+//ROM第一次用到高分辨率或别的位平面: 分配整块屏幕, 把低分辨率的display搬进去, 之后只用screen
+static void use_screen(chip8_t *chip8) {
+    if (chip8->screen) return;
+    screen_t *screen = pool_alloc(chip8->pool, sizeof(screen_t));
+    if (!screen) {
+        fprintf(stderr, "内存不足, 无法分配屏幕\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(screen, 0, sizeof(screen_t));
+    for (u32 y = 0; y < DISPLAY_HEIGHT / 2; y++) screen->rows[0][y] = (u128)chip8->display[y] << 64;
+    chip8->screen = screen;
+}
+
+//v不为0: 最高位/最低位往里数有几个0, 即最左/最右边的像素前后有几列
+static inline u8 leading_zeros(const u128 v) {
+    const u64 high = v >> 64;
+    return high ? __builtin_clzll(high) : 64 + __builtin_clzll((u64)v);
+}
+
+static inline u8 trailing_zeros(const u128 v) {
+    return (u64)v ? __builtin_ctzll((u64)v) : 64 + __builtin_ctzll((u64)(v >> 64));
+}
+
+//0xDXYN的实现, 各个引擎共用: 从内存I开始读取n行sprite, 绘制到(vx, vy)处, 有碰撞时VF = 1
+//DXY0(SUPER-CHIP, XO-CHIP)是16x16的sprite, 每行2字节; 选中了几个位平面, 就依次为每个平面读一份sprite
+//quirks是常量, 下面按配置生成的draw_*各自编译成没有这些判断的版本
+static inline __attribute__((always_inline))
+void draw_rows(chip8_t *chip8, const config_t config, const u8 vx, const u8 vy, const u8 n, const quirks_t quirks) {
+    const bool hires = quirks.hires && chip8->hires;
+    const u32 width = hires ? DISPLAY_WIDTH : DISPLAY_WIDTH / 2;
+    const u32 height = hires ? DISPLAY_HEIGHT : DISPLAY_HEIGHT / 2;
+    const bool wide = quirks.hires && n == 0;
+    const u8 rows = wide ? 16 : n;
+    const u8 planes = quirks.planes ? chip8->planes : 1;
+    const u128 visible = hires ? ~(u128)0 : ~(u128)0 << 64;  //低分辨率时只有高64位在屏幕上
+
+    //1.起始位置, 起始坐标超出屏幕时取模回绕, 绘制时超出屏幕的部分被裁掉(或者回绕到另一边, quirks.h)
+    const u8 X = vx & (width - 1);
+    const u8 Y = vy & (height - 1);
+
+    chip8->V[0xF] = 0;
+
+    //2.每行sprite移到u128的最高处再右移X位就对齐到了屏幕上的位置, 和visible相与丢掉移出右边缘的位
+    //  回绕时移出右边缘的位再左移width位回到左边; 碰撞检测只需要一次与运算, 绘制只需要一次异或
+    //  变了的只有sprite中有1的行和列: 记下这些行, 列取所有行的并集
+    //没有screen时不是高分辨率, 也只选了第一个位平面, 行存在display里, sprite只有高64位
+    screen_t *screen = chip8->screen;
+    u16 addr = chip8->I;
+    u64 dirty_rows = 0;
+    u128 dirty_cols = 0;
+    for (u8 p = 0; p < DISPLAY_PLANES; p++) {
+        if (!(planes & (1 << p))) continue;
+        u8 i;
+        for (i = 0; i < rows && (quirks.wrap || Y + i < height); i++) {
+            const u128 bits = wide ? (u128)((ram_read(chip8, addr + 2 * i) << 8) | ram_read(chip8, addr + 2 * i + 1)) << 112
+                                   : (u128)ram_read(chip8, addr + i) << 120;
+            const u128 sprite = (quirks.wrap ? (bits >> X) | (X ? bits << (width - X) : 0) : bits >> X) & visible;
+            const u8 y = quirks.wrap ? (Y + i) & (height - 1) : Y + i;
+            const u128 row = screen ? screen->rows[p][y] : (u128)chip8->display[y] << 64;
+
+            if (row & sprite) chip8->V[0xF] = 1;  //发生碰撞
+            if (screen) screen->rows[p][y] = row ^ sprite;
+            else chip8->display[y] ^= (u64)(sprite >> 64);
+            dirty_rows |= (u64)(sprite != 0) << y;
+            dirty_cols |= sprite;
+            if (chip8->metrics) {
+                chip8->metrics->sprite_rows++;
+                chip8->metrics->sprite_pixels += __builtin_popcountll((u64)(sprite >> 64)) + __builtin_popcountll((u64)sprite);
+            }
+        }
+        if (chip8->heatmap) count_access(chip8->heatmap->reads, addr, i * (wide ? 2 : 1));  //裁掉的行没有读
+        addr += rows * (wide ? 2 : 1);
+    }
+    if (chip8->metrics) {
+        chip8->metrics->sprites++;
+        chip8->metrics->collisions += chip8->V[0xF];
+    }
+    if (dirty_rows) mark_dirty(&chip8->dirty, dirty_rows, leading_zeros(dirty_cols), DISPLAY_WIDTH - trailing_zeros(dirty_cols));
+    chip8->draw = true;
+    if (config.display_wait) chip8->vblank_wait = true;
+}
+
+//CHIP-8和CHIP-48: 64x32, 一个位平面, 裁掉
+static void draw_clip(chip8_t *chip8, const config_t config, const u8 vx, const u8 vy, const u8 n) {
+    draw_rows(chip8, config, vx, vy, n, quirks_of[QUIRKS_VIP]);
+}
+
+static void draw_schip(chip8_t *chip8, const config_t config, const u8 vx, const u8 vy, const u8 n) {
+    draw_rows(chip8, config, vx, vy, n, quirks_of[QUIRKS_SCHIP]);
+}
+
+static void draw_xochip(chip8_t *chip8, const config_t config, const u8 vx, const u8 vy, const u8 n) {
+    draw_rows(chip8, config, vx, vy, n, quirks_of[QUIRKS_XOCHIP]);
+}
+
+static void (*const draw_variants[QUIRKS_COUNT])(chip8_t *, const config_t, const u8, const u8, const u8) = {
+    [QUIRKS_VIP] = draw_clip, [QUIRKS_CHIP48] = draw_clip, [QUIRKS_SCHIP] = draw_schip, [QUIRKS_XOCHIP] = draw_xochip,
+};
+
+void draw_sprite(chip8_t *chip8, const config_t config, const u8 vx, const u8 vy, const u8 n) {
+    draw_variants[config.quirks](chip8, config, vx, vy, n);
+}
+
+void clear_display(chip8_t *chip8) {
+    if (!chip8->screen) {
+        if (chip8->planes & 1) memset(chip8->display, 0, sizeof chip8->display);
+    }
+    else for (u8 p = 0; p < DISPLAY_PLANES; p++)
+        if (chip8->planes & (1 << p)) memset(chip8->screen->rows[p], 0, display_height(chip8) * sizeof(u128));
+    mark_dirty(&chip8->dirty, ~(u64)0, 0, DISPLAY_WIDTH);
+    chip8->draw = true;
+}
+
+//上下滚动是整行移动, 左右滚动是每行一次移位; 移出屏幕的像素丢弃, 空出来的地方是0
+void scroll_display(chip8_t *chip8, const int dx, const int dy) {
+    const u32 height = display_height(chip8);
+    const u32 up = dy < 0 ? -dy : 0, down = dy > 0 ? dy : 0;
+    const u128 visible = chip8->hires ? ~(u128)0 : ~(u128)0 << 64;
+    if (up >= height || down >= height || (u32)abs(dx) >= display_width(chip8)) {
+        clear_display(chip8);
+        return;
+    }
+
+    if (!chip8->screen) {
+        //低分辨率的第一个位平面, 每行一个u64
+        if (chip8->planes & 1) {
+            u64 *rows = chip8->display;
+            memmove(&rows[down], &rows[up], (height - up - down) * sizeof(u64));
+            memset(down ? rows : &rows[height - up], 0, (up + down) * sizeof(u64));
+            if (dx > 0) for (u32 y = 0; y < height; y++) rows[y] >>= dx;
+            else if (dx < 0) for (u32 y = 0; y < height; y++) rows[y] <<= -dx;
+        }
+    }
+    else for (u8 p = 0; p < DISPLAY_PLANES; p++) {
+        if (!(chip8->planes & (1 << p))) continue;
+        u128 *rows = chip8->screen->rows[p];
+        memmove(&rows[down], &rows[up], (height - up - down) * sizeof(u128));
+        memset(down ? rows : &rows[height - up], 0, (up + down) * sizeof(u128));
+        if (dx > 0) for (u32 y = 0; y < height; y++) rows[y] = (rows[y] >> dx) & visible;
+        else if (dx < 0) for (u32 y = 0; y < height; y++) rows[y] <<= -dx;
+    }
+    mark_dirty(&chip8->dirty, ~(u64)0, 0, DISPLAY_WIDTH);
+    chip8->draw = true;
+}
+
+//切换分辨率时清除所有位平面(和XO-CHIP一样); 低分辨率只用屏幕的左上角, 不清的话切回高分辨率时会看到旧的像素
+void set_hires(chip8_t *chip8, const bool hires) {
+    if (hires) use_screen(chip8);
+    chip8->hires = hires;
+    if (chip8->screen) memset(chip8->screen, 0, sizeof(screen_t));
+    else memset(chip8->display, 0, sizeof chip8->display);
+    mark_dirty(&chip8->dirty, ~(u64)0, 0, DISPLAY_WIDTH);
+    chip8->draw = true;
+}
+
+//只选第一个位平面(或者都不选)时还可以只用display
+void select_planes(chip8_t *chip8, const u8 planes) {
+    if (planes & ~1) use_screen(chip8);
+    chip8->planes = planes;
+}
+
+void copy_display(const chip8_t *chip8, u128 rows[DISPLAY_PLANES][DISPLAY_HEIGHT]) {
+    for (u8 p = 0; p < DISPLAY_PLANES; p++)
+        for (u32 y = 0; y < DISPLAY_HEIGHT; y++) rows[p][y] = display_row(chip8, p, y);
+}
+
+//display放不下的内容(高分辨率, 别的位平面, 低64位或后32行的像素)才分配screen
+void load_display(chip8_t *chip8, const u128 rows[DISPLAY_PLANES][DISPLAY_HEIGHT]) {
+    bool fits = !chip8->hires && !(chip8->planes & ~1);
+    for (u8 p = 0; p < DISPLAY_PLANES && fits; p++)
+        for (u32 y = 0; y < DISPLAY_HEIGHT && fits; y++)
+            fits = (p == 0 && y < DISPLAY_HEIGHT / 2) ? (u64)rows[p][y] == 0 : rows[p][y] == 0;
+
+    if (!fits) use_screen(chip8);
+    if (chip8->screen) memcpy(chip8->screen->rows, rows, sizeof chip8->screen->rows);
+    else for (u32 y = 0; y < DISPLAY_HEIGHT / 2; y++) chip8->display[y] = rows[0][y] >> 64;
+}
+
+u64 hash_display(const chip8_t *chip8) {
+    u128 rows[DISPLAY_PLANES][DISPLAY_HEIGHT];
+    copy_display(chip8, rows);
+    return hash_bytes(rows, sizeof rows);
+}
+
+//按下的键要等它松开才算数, 和COSMAC VIP一样; 等待的状态都在chip8_t里, 可以存档
+//还在等时PC退回这条FX0A并设置key_wait, 各个引擎执行完它就返回; 调度器在键盘变化之前不再执行指令, 之后从这条FX0A继续
+//直接调用run_instructions时每次都重新执行一遍这条FX0A, 和原来逐条重试的结果一样
+void wait_for_key(chip8_t *chip8, const u8 x) {
+    for (u8 i = 0; chip8->wait_key == 0xFF && i < sizeof chip8->keypad; i++)
+        if (chip8->keypad[i]) chip8->wait_key = i;
+
+    chip8->key_wait = chip8->wait_key == 0xFF || chip8->keypad[chip8->wait_key];
+    if (chip8->key_wait) chip8->PC -= 2;
+    else {
+        chip8->V[x] = chip8->wait_key;
+        chip8->wait_key = 0xFF;
+    }
+}
+
+//内存addr开始的len字节被写入了, 对应的预解码指令和JIT块需要作废
+//一条指令占2字节, 所以addr - 1处的指令也包含了被写的字节; 融合指令的组更长, 从addr - FUSE_BACK开始作废
+void invalidate_code(chip8_t *chip8, const u16 addr, const u16 len) {
+    for (u16 i = 0; i < len + FUSE_BACK; i++) {
+        const u16 a = (addr - FUSE_BACK + i) & 0xFFF;
+        const u8 page = a >> 8;
+        if (chip8->private_decoded & (1 << page)) chip8->decoded[page][a & 0xFF].op = 0;
+        else chip8->decoded[page] = undecoded_page; //共享的页不能改, 整页换成未解码, 执行到时再重新解码
+    }
+
+    //记下被写过的页, 预先翻译(AOT)的块据此判断自己的代码有没有被改写; 和上面一样按回绕后的地址算, 写过0xFFF之后接着是页0
+    for (u16 i = 0; i <= len; i++)
+        chip8->written_pages |= (u64)1 << (((addr - 1 + i) & 0xFFF) >> 6);
+
+    if (chip8->jit) jit_invalidate(chip8->jit, addr, len);
+}
+
+//FX55: 把V0~VX存进从I开始的内存, 不改变I
+static inline void store_registers(chip8_t *chip8, const u8 x) {
+    invalidate_code(chip8, chip8->I, x + 1);
+    if (chip8->heatmap) count_access(chip8->heatmap->writes, chip8->I, x + 1);
+    for (u8 i = 0; i <= x; i++) ram_write(chip8, chip8->I + i, chip8->V[i]);
+}
+
+//FX65: 从I开始的内存读进V0~VX, 不改变I
+static inline void load_registers(chip8_t *chip8, const u8 x) {
+    if (chip8->heatmap) count_access(chip8->heatmap->reads, chip8->I, x + 1);
+    for (u8 i = 0; i <= x; i++) chip8->V[i] = ram_read(chip8, chip8->I + i);
+}
+
+//一条指令的参考实现, profile决定各个变种不同的那几条指令的行为(quirks.h)
+//总是以常量profile内联进下面按配置生成的各个版本, 对quirks的判断在编译时就确定了
+static inline __attribute__((always_inline))
+void execute_instruction(chip8_t *chip8, const config_t config, const quirks_profile_t profile) {
+    const quirks_t quirks = quirks_of[profile];
+    bool carry; //VF的值, VF作为进位标志用于某些指令中
+    u8 source;  //8XY6/8XYE移位的值
+
+    //1.结合PC寄存器在内存中获取指令, 同时PC后移
+    chip8->inst.opcode = (ram_read(chip8, chip8->PC) << 8) | ram_read(chip8, chip8->PC + 1);  /* **这里涉及到类型转换, 移位运算, 大小端** */
+    
+    if (chip8->metrics) count_instruction(chip8->metrics, chip8->PC, decode_opcode(chip8->inst.opcode).op);
+    if (chip8->heatmap) count_fetch(chip8->heatmap, chip8->PC);
+
+    chip8->PC += 2;
+
+    //2.将一条指令转为nnn,nn等
+    chip8->inst.NNN = chip8->inst.opcode & 0x0FFF; 
+    chip8->inst.NN  = chip8->inst.opcode & 0x0FF;
+    chip8->inst.N   = chip8->inst.opcode & 0x0F;
+    chip8->inst.X   = (chip8->inst.opcode >> 8) & 0x0F;
+    chip8->inst.Y   = (chip8->inst.opcode >> 4) & 0x0F;
+
+    //3.模拟指令
+    switch ((chip8->inst.opcode >> 12) & 0x0F)    //保留高四位
+    {
+    case 0x00:
+        // 0x00E0: 清屏, XO-CHIP只清选中的位平面
+        if (chip8->inst.NN == 0xE0) clear_display(chip8);
+        else if (chip8->inst.NN == 0xEE) {
+            // 0x00EE: 从子程序返回   
+            // 栈顶指针减一(相当于pop), 再将SP指向的内容(父程序调用子程序之后的地址)赋值给PC
+            //空栈时不弹出, 防止SP越过stk的开头
+            if (chip8->SP > 0) chip8->PC = chip8->stk[--chip8->SP];
+        }
+        else if (quirks.hires && chip8->inst.X == 0 && (chip8->inst.NN & 0xF0) == 0xC0) {
+            // 0x00CN: SUPER-CHIP, 向下滚动N个像素
+            scroll_display(chip8, 0, chip8->inst.N);
+        }
+        else if (quirks.planes && chip8->inst.X == 0 && (chip8->inst.NN & 0xF0) == 0xD0) {
+            // 0x00DN: XO-CHIP, 向上滚动N个像素
+            scroll_display(chip8, 0, -chip8->inst.N);
+        }
+        else if (quirks.hires && chip8->inst.X == 0 && (chip8->inst.NN == 0xFB || chip8->inst.NN == 0xFC)) {
+            // 0x00FB/0x00FC: SUPER-CHIP, 向右/向左滚动4个像素
+            scroll_display(chip8, chip8->inst.NN == 0xFB ? 4 : -4, 0);
+        }
+        else if (quirks.hires && chip8->inst.X == 0 && (chip8->inst.NN == 0xFE || chip8->inst.NN == 0xFF)) {
+            // 0x00FE/0x00FF: SUPER-CHIP, 切换到低/高分辨率
+            set_hires(chip8, chip8->inst.NN == 0xFF);
+        }
+        else {
+            // 0x0NNN: wiki上说大多数rom用不上
+        }
+        break;
+    case 0x01: 
+        // 0x1NNN: 跳转到NNN
+        chip8->PC = chip8->inst.NNN;
+        break;
+    case 0x02:
+        // 0x2NNN:调用位于NNN的子程序
+        // 先将当前PC推入栈中, 再将当前PC设置为NNN
+        //栈满时不再压栈, 防止SP越过stk的末尾
+        if (chip8->SP < 16) chip8->stk[chip8->SP++] = chip8->PC;
+        chip8->PC = chip8->inst.NNN;
+        break;
+    case 0x03:
+        // 0x3XNN: 如果寄存器X的内容(VX) == NN, 跳过下一条指令
+        if (chip8->V[chip8->inst.X] == chip8->inst.NN) chip8->PC += 2;
+        break;
+    case 0x04:
+        // 0x4XNN: 如果VX != NN, 跳过下一条指令
+        if (chip8->V[chip8->inst.X] != chip8->inst.NN) chip8->PC += 2;
+        break;
+    case 0x05:
+        // 0x5XY0: 如果VX == VY, 跳过下一条指令
+        if (chip8->inst.N == 0 && chip8->V[chip8->inst.X] == chip8->V[chip8->inst.Y]) 
+            chip8->PC += 2;
+        break;
+    case 0x06:
+        // 0x6XNN: 设置VX为NN
+        chip8->V[chip8->inst.X] = chip8->inst.NN;
+        break;
+    case 0x07:
+        // 0x7XNN: VX += NN, 进位标志不变
+        chip8->V[chip8->inst.X] += chip8->inst.NN;
+        break;
+    case 0x08:
+        switch (chip8->inst.N) {
+            case 0x0:
+                // 0x8XY0: VX = VY
+                chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y];
+                break;
+            case 0x1:
+                // 0x8XY1: VX |= VY
+                chip8->V[chip8->inst.X] |= chip8->V[chip8->inst.Y];
+                if (quirks.vf_reset) chip8->V[0xF] = 0;  //chip888
+                break;
+            case 0x2:
+                // 0x8XY2: VX &= VY
+                chip8->V[chip8->inst.X] &= chip8->V[chip8->inst.Y];
+                if (quirks.vf_reset) chip8->V[0xF] = 0; //chip888
+                break;
+            case 0x3:
+                // 0x8XY1: VX ^= VY 异或
+                chip8->V[chip8->inst.X] ^= chip8->V[chip8->inst.Y];
+                if (quirks.vf_reset) chip8->V[0xF] = 0; //chip888
+                break;
+            case 0x4:
+                // 0x8XY1: VX += VY, 有溢出则置VF为1, 否则置0;
+                carry = (u16)(chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y]) > 0xFF;
+                chip8->V[chip8->inst.X] += chip8->V[chip8->inst.Y];
+                chip8->V[0x0F] = carry;
+                break;
+            case 0x5:
+                // 0x8XY5: VX -= VY, 如果VX >= VY, 则VF = 1, 否则VF = 0
+                carry = (chip8->V[chip8->inst.X] >= chip8->V[chip8->inst.Y]);
+                chip8->V[chip8->inst.X] -= chip8->V[chip8->inst.Y];
+                chip8->V[0x0F] = carry;
+                break;
+            case 0x6:
+                // 0x8XY6: 将VY的最低有效位存储在VF中, 然后VX = VY >> 1
+                //CHIP-48和SUPER-CHIP移的是VX自己: VF = VX的最低有效位, VX >>= 1
+                source = quirks.shift_vy ? chip8->V[chip8->inst.Y] : chip8->V[chip8->inst.X];   //chip888
+                carry = source & 1;
+                chip8->V[chip8->inst.X] = source >> 1;
+                chip8->V[0x0F] = carry;
+                break;
+            case 0x7:
+                // 0x8XY7: 将VX的最低有效位存储在VF中, 然后VX >>= 1;
+                carry = (chip8->V[chip8->inst.X] <= chip8->V[chip8->inst.Y]);
+                chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] - chip8->V[chip8->inst.X];
+                chip8->V[0x0F] = carry;
+                break;
+            case 0xE:
+                // 0x8XYE: VF = (VY的最高有效位), 然后VX = VY << 1
+                //CHIP-48和SUPER-CHIP同样移VX自己
+                source = quirks.shift_vy ? chip8->V[chip8->inst.Y] : chip8->V[chip8->inst.X];   //chip888
+                carry = (source & 0x80) >> 7;
+                chip8->V[chip8->inst.X] = source << 1;
+                chip8->V[0x0F] = carry;
+                break;
+
+            default: break;
+        }
+        break;
+    case 0x09:
+        // 9XY0: 如果VX != VY, 则跳过下一条指令
+        if (chip8->inst.N == 0 && chip8->V[chip8->inst.X] != chip8->V[chip8->inst.Y])
+            chip8->PC += 2;
+        break;
+    case 0x0A:
+        // 0xANNN: I = NNN
+        chip8->I = chip8->inst.NNN;
+        break;
+    case 0x0B:
+        // 0xBNNN: PC = V0 + NNN; CHIP-48和SUPER-CHIP是BXNN: PC = VX + XNN
+        chip8->PC = chip8->V[quirks.jump_v0 ? 0x0 : chip8->inst.X] + chip8->inst.NNN;
+        break;
+    case 0x0C:
+        // 0xCXNN: VX = rand() & NN, 随机数范围:[0, 255], 每个虚拟机有自己的随机数发生器
+        chip8->V[chip8->inst.X] = chip8_rand(chip8) & chip8->inst.NN;
+        break;
+    case 0x0D: {
+        // 0xDXYN: 绘制一个字体, 从(x, y)开始绘制(XOR), 宽8位, 高N位, 即N行8列;
+        //从内存I开始读取, I在执行指令之后不会改变;
+        //如果发生碰撞, 置VF = 1, 否则置VF = 0
+        //碰撞: 如果一个像素已经被渲染而它目前又要被渲染, 就发生了碰撞
+        //SUPER-CHIP和XO-CHIP的DXY0画16x16的sprite
+
+        draw_variants[profile](chip8, config, chip8->V[chip8->inst.X], chip8->V[chip8->inst.Y], chip8->inst.N);
+
+        break;
+        }
+    case 0x0E:
+        if (chip8->inst.NN == 0x9E)  {
+            // 0xEX9E: 如果VX中存储的键被按下, 跳过下一条指令
+            if (chip8->keypad[chip8->V[chip8->inst.X] & 0xF]) chip8->PC += 2;
+        }
+        else if (chip8->inst.NN == 0xA1) {
+            // 0xEXA1: 如果VX中存储的键没有被按下, 跳过下一条指令
+            if (!chip8->keypad[chip8->V[chip8->inst.X] & 0xF]) chip8->PC += 2;
+        }
+
+        break;
+    case 0x0F:
+        switch (chip8->inst.NN) {
+        case 0x07:
+            // 0xFX07: VX = delay_timer
+            chip8->V[chip8->inst.X] = chip8->delay_timer;
+            break;
+        case 0x0A:
+            // 0xFX0A: 等待按键, 所有指令暂停, 直到按键, 将那个键存在VX
+            wait_for_key(chip8, chip8->inst.X);
+            break;
+        case 0x15:
+            // 0xFX15: delay_timer = VX
+            chip8->delay_timer = chip8->V[chip8->inst.X];
+            break;
+        case 0x18:
+            // 0xFX18: sound_timer = VX;
+            chip8->sound_timer = chip8->V[chip8->inst.X];
+            break;
+        case 0x02:
+            // 0xF002: XO-CHIP, 从I开始的16字节作为声音样本
+            if (quirks.planes && chip8->inst.X == 0) {
+                if (chip8->heatmap) count_access(chip8->heatmap->reads, chip8->I, sizeof chip8->audio_pattern);
+                load_audio_pattern(chip8);
+            }
+            break;
+        case 0x3A:
+            // 0xFX3A: XO-CHIP, 音高 = VX
+            if (quirks.planes) chip8->pitch = chip8->V[chip8->inst.X];
+            break;
+        case 0x01:
+            // 0xFN01: XO-CHIP, 选中位平面N(按位), 之后的绘制, 清屏和滚屏只作用于这些平面
+            if (quirks.planes) select_planes(chip8, chip8->inst.X);
+            break;
+        case 0x1E:
+            // 0xFX1E: I += VX, 不管VF
+            chip8->I += chip8->V[chip8->inst.X];
+            break;
+        case 0x29:
+            // 0xFX29: 将I设置为储存在VX中的值对应sprite字符的起始地址
+            // 我们的字符位置: 0x000~0x04F, 一个sprite字符用5个字节存储, 共80字节
+            chip8->I = chip8->V[chip8->inst.X] * 5;
+            break;
+        case 0x33:
+            //0xFX33: 将VX的百位, 十位和个位以BCD码形式分别存在内存I, I + 1, I + 2中
+            u8 bcd = chip8->V[chip8->inst.X];
+            ram_write(chip8, chip8->I + 2, bcd % 10);
+            bcd /= 10;
+            ram_write(chip8, chip8->I + 1, bcd % 10);
+            bcd /= 10;
+            ram_write(chip8, chip8->I, bcd);
+            invalidate_code(chip8, chip8->I, 3);
+            if (chip8->heatmap) count_access(chip8->heatmap->writes, chip8->I, 3);
+            break;
+        case 0x55:
+            // 0xFX55: 从I开始存储V0~VX(包括VX), I怎样变化取决于配置
+            store_registers(chip8, chip8->inst.X);
+            chip8->I += quirk_i_step(quirks, chip8->inst.X);   //chip888
+            break;
+        case 0x65:
+            // 0xFX65: 从I开始, 往V0到VX中存, I怎样变化取决于配置
+            load_registers(chip8, chip8->inst.X);
+            chip8->I += quirk_i_step(quirks, chip8->inst.X);   //chip888
+            break;
+
+        default: break;
+        }
+        break;
+
+    default: break;
+    }
+}
+
+//switch引擎执行最多count条指令, 执行完一条DXYN后提前返回
+static inline __attribute__((always_inline))
+u32 run_switch(chip8_t *chip8, const config_t config, const u32 count, const quirks_profile_t profile) {
+    u32 executed = 0;
+    while (executed < count) {
+        execute_instruction(chip8, config, profile);
+        executed++;
+
+        //指令中可能要求绘制sprite字体, 一个frame绘制1个sprite
+        if (chip8->inst.opcode >> 12 == 0xD) break;  //chip888
+        if (chip8->key_wait) break;     //FX0A: 暂停到键盘变化, 由调度器决定什么时候再执行
+    }
+    return executed;
+}
+
+//每种兼容性配置生成一份参考实现和switch引擎, profile是编译时的常量
+#define QUIRKS_VARIANT(name, profile)                                                   \
+    static void emulate_##name(chip8_t *chip8, const config_t config) {                \
+        execute_instruction(chip8, config, profile);                                   \
+    }                                                                                  \
+    static u32 run_switch_##name(chip8_t *chip8, const config_t config, const u32 count) { \
+        return run_switch(chip8, config, count, profile);                              \
+    }
+
+QUIRKS_VARIANT(vip, QUIRKS_VIP)
+QUIRKS_VARIANT(chip48, QUIRKS_CHIP48)
+QUIRKS_VARIANT(schip, QUIRKS_SCHIP)
+QUIRKS_VARIANT(xochip, QUIRKS_XOCHIP)
+#undef QUIRKS_VARIANT
+
+static void (*const emulate_variants[QUIRKS_COUNT])(chip8_t *, const config_t) = {
+    [QUIRKS_VIP] = emulate_vip, [QUIRKS_CHIP48] = emulate_chip48,
+    [QUIRKS_SCHIP] = emulate_schip, [QUIRKS_XOCHIP] = emulate_xochip,
+};
+
+static u32 (*const switch_variants[QUIRKS_COUNT])(chip8_t *, const config_t, const u32) = {
+    [QUIRKS_VIP] = run_switch_vip, [QUIRKS_CHIP48] = run_switch_chip48,
+    [QUIRKS_SCHIP] = run_switch_schip, [QUIRKS_XOCHIP] = run_switch_xochip,
+};
+
+void emulate_instruction(chip8_t *chip8, const config_t config) {
+    emulate_variants[config.quirks](chip8, config);
+}
+
+/* ===================== 预解码缓存引擎 ===================== */
+
+//预解码后每条指令对应的处理程序编号, 0表示这个地址还没有解码(或者已经作废)
+enum {
+    OP_DECODE = 0,
+    OP_NOP,         //0x0NNN以及未实现的指令
+    OP_CLS,         //00E0
+    OP_RET,         //00EE
+    OP_JP,          //1NNN
+    OP_CALL,        //2NNN
+    OP_SE_NN,       //3XNN
+    OP_SNE_NN,      //4XNN
+    OP_SE_VY,       //5XY0
+    OP_LD_NN,       //6XNN
+    OP_ADD_NN,      //7XNN
+    OP_LD_VY,       //8XY0
+    OP_OR,          //8XY1
+    OP_AND,         //8XY2
+    OP_XOR,         //8XY3
+    OP_ADD_VY,      //8XY4
+    OP_SUB,         //8XY5
+    OP_SHR,         //8XY6
+    OP_SUBN,        //8XY7
+    OP_SHL,         //8XYE
+    OP_SNE_VY,      //9XY0
+    OP_LD_I,        //ANNN
+    OP_JP_V0,       //BNNN
+    OP_RND,         //CXNN
+    OP_DRW,         //DXYN
+    OP_SKP,         //EX9E
+    OP_SKNP,        //EXA1
+    OP_LD_VX_DT,    //FX07
+    OP_LD_VX_K,     //FX0A
+    OP_LD_DT,       //FX15
+    OP_LD_ST,       //FX18
+    OP_ADD_I,       //FX1E
+    OP_LD_F,        //FX29
+    OP_LD_B,        //FX33
+    OP_LD_MEM,      //FX55
+    OP_LD_REGS,     //FX65
+    OP_AUDIO,       //F002(XO-CHIP)
+    OP_PITCH,       //FX3A(XO-CHIP)
+    OP_SCROLL_DOWN, //00CN(SUPER-CHIP)
+    OP_SCROLL_UP,   //00DN(XO-CHIP)
+    OP_SCROLL_RIGHT,    //00FB(SUPER-CHIP)
+    OP_SCROLL_LEFT, //00FC(SUPER-CHIP)
+    OP_LORES,       //00FE(SUPER-CHIP)
+    OP_HIRES,       //00FF(SUPER-CHIP)
+    OP_PLANE,       //FN01(XO-CHIP)
+    OP_COUNT,
+
+    //融合指令(超级指令): 载入ROM时把常见的相邻指令换成一个处理程序, 只出现在组的第一条指令的地址上
+    OP_FUSED = OP_COUNT,
+    OP_LD_I_DRW = OP_FUSED, //ANNN + DXYN
+    OP_LD_NN2,      //6XNN + 6XNN
+    OP_LD_NN3,      //6XNN + 6XNN + 6XNN
+    OP_ADD_SE,      //7XNN + 3XNN, 循环计数
+    OP_ADD_SNE,     //7XNN + 4XNN
+    OP_DT_SE,       //FX07 + 3XNN, 等待计时器
+    OP_DT_SNE,      //FX07 + 4XNN
+    OP_HANDLERS,
+};
+
+#define FUSED_COUNT (OP_HANDLERS - OP_FUSED)
+
+_Static_assert(OP_COUNT <= METRICS_CLASSES, "metrics_t的classes放不下所有分类");
+_Static_assert(FUSED_COUNT <= METRICS_FUSIONS, "metrics_t的fused放不下所有融合指令");
+
+//统计中每类指令的名字, 和上面的注释一致
+static const char *const op_names[OP_COUNT] = {
+    [OP_NOP] = "0NNN",      [OP_CLS] = "00E0",      [OP_RET] = "00EE",      [OP_JP] = "1NNN",
+    [OP_CALL] = "2NNN",     [OP_SE_NN] = "3XNN",    [OP_SNE_NN] = "4XNN",   [OP_SE_VY] = "5XY0",
+    [OP_LD_NN] = "6XNN",    [OP_ADD_NN] = "7XNN",   [OP_LD_VY] = "8XY0",    [OP_OR] = "8XY1",
+    [OP_AND] = "8XY2",      [OP_XOR] = "8XY3",      [OP_ADD_VY] = "8XY4",   [OP_SUB] = "8XY5",
+    [OP_SHR] = "8XY6",      [OP_SUBN] = "8XY7",     [OP_SHL] = "8XYE",      [OP_SNE_VY] = "9XY0",
+    [OP_LD_I] = "ANNN",     [OP_JP_V0] = "BNNN",    [OP_RND] = "CXNN",      [OP_DRW] = "DXYN",
+    [OP_SKP] = "EX9E",      [OP_SKNP] = "EXA1",     [OP_LD_VX_DT] = "FX07", [OP_LD_VX_K] = "FX0A",
+    [OP_LD_DT] = "FX15",    [OP_LD_ST] = "FX18",    [OP_ADD_I] = "FX1E",    [OP_LD_F] = "FX29",
+    [OP_LD_B] = "FX33",     [OP_LD_MEM] = "FX55",   [OP_LD_REGS] = "FX65",  [OP_AUDIO] = "F002",
+    [OP_PITCH] = "FX3A",    [OP_SCROLL_DOWN] = "00CN", [OP_SCROLL_UP] = "00DN", [OP_SCROLL_RIGHT] = "00FB",
+    [OP_SCROLL_LEFT] = "00FC", [OP_LORES] = "00FE", [OP_HIRES] = "00FF",  [OP_PLANE] = "FN01",
+};
+
+const char *op_class_name(const u8 op) {
+    return op < OP_COUNT ? op_names[op] : NULL;
+}
+
+//融合指令的名字和它第一条指令的分类
+static const char *const fused_names[FUSED_COUNT] = {
+    [OP_LD_I_DRW - OP_FUSED] = "ANNN+DXYN", [OP_LD_NN2 - OP_FUSED] = "6XNN+6XNN",
+    [OP_LD_NN3 - OP_FUSED] = "6XNN+6XNN+6XNN",
+    [OP_ADD_SE - OP_FUSED] = "7XNN+3XNN",   [OP_ADD_SNE - OP_FUSED] = "7XNN+4XNN",
+    [OP_DT_SE - OP_FUSED] = "FX07+3XNN",    [OP_DT_SNE - OP_FUSED] = "FX07+4XNN",
+};
+
+static const u8 fused_first[FUSED_COUNT] = {
+    [OP_LD_I_DRW - OP_FUSED] = OP_LD_I,     [OP_LD_NN2 - OP_FUSED] = OP_LD_NN,
+    [OP_LD_NN3 - OP_FUSED] = OP_LD_NN,
+    [OP_ADD_SE - OP_FUSED] = OP_ADD_NN,     [OP_ADD_SNE - OP_FUSED] = OP_ADD_NN,
+    [OP_DT_SE - OP_FUSED] = OP_LD_VX_DT,    [OP_DT_SNE - OP_FUSED] = OP_LD_VX_DT,
+};
+
+const char *fusion_name(const u8 kind) {
+    return kind < FUSED_COUNT ? fused_names[kind] : NULL;
+}
+
+u8 op_class(const u16 opcode) {
+    return decode_opcode(opcode).op;
+}
+
+//解码一条指令, 分类方式和emulate_instruction中的switch完全一致
+static decoded_t decode_opcode(const u16 opcode) {
+    decoded_t decoded;
+    decoded_t *d = &decoded;
+
+    d->NNN = opcode & 0x0FFF;
+    d->NN  = opcode & 0x0FF;
+    d->N   = opcode & 0x0F;
+    d->X   = (opcode >> 8) & 0x0F;
+    d->Y   = (opcode >> 4) & 0x0F;
+
+    switch ((opcode >> 12) & 0x0F) {
+    case 0x00:
+        //SUPER-CHIP和XO-CHIP的指令总是按它们解码, 不支持的配置在处理程序表里把它们当成0NNN
+        if (d->NN == 0xE0) d->op = OP_CLS;
+        else if (d->NN == 0xEE) d->op = OP_RET;
+        else if (d->X != 0) d->op = OP_NOP;
+        else if ((d->NN & 0xF0) == 0xC0) d->op = OP_SCROLL_DOWN;
+        else if ((d->NN & 0xF0) == 0xD0) d->op = OP_SCROLL_UP;
+        else if (d->NN == 0xFB) d->op = OP_SCROLL_RIGHT;
+        else if (d->NN == 0xFC) d->op = OP_SCROLL_LEFT;
+        else if (d->NN == 0xFE) d->op = OP_LORES;
+        else if (d->NN == 0xFF) d->op = OP_HIRES;
+        else d->op = OP_NOP;
+        break;
+    case 0x01: d->op = OP_JP; break;
+    case 0x02: d->op = OP_CALL; break;
+    case 0x03: d->op = OP_SE_NN; break;
+    case 0x04: d->op = OP_SNE_NN; break;
+    case 0x05: d->op = (d->N == 0) ? OP_SE_VY : OP_NOP; break;
+    case 0x06: d->op = OP_LD_NN; break;
+    case 0x07: d->op = OP_ADD_NN; break;
+    case 0x08:
+        switch (d->N) {
+        case 0x0: d->op = OP_LD_VY; break;
+        case 0x1: d->op = OP_OR; break;
+        case 0x2: d->op = OP_AND; break;
+        case 0x3: d->op = OP_XOR; break;
+        case 0x4: d->op = OP_ADD_VY; break;
+        case 0x5: d->op = OP_SUB; break;
+        case 0x6: d->op = OP_SHR; break;
+        case 0x7: d->op = OP_SUBN; break;
+        case 0xE: d->op = OP_SHL; break;
+        default:  d->op = OP_NOP; break;
+        }
+        break;
+    case 0x09: d->op = (d->N == 0) ? OP_SNE_VY : OP_NOP; break;
+    case 0x0A: d->op = OP_LD_I; break;
+    case 0x0B: d->op = OP_JP_V0; break;
+    case 0x0C: d->op = OP_RND; break;
+    case 0x0D: d->op = OP_DRW; break;
+    case 0x0E: d->op = (d->NN == 0x9E) ? OP_SKP : (d->NN == 0xA1) ? OP_SKNP : OP_NOP; break;
+    case 0x0F:
+        switch (d->NN) {
+        case 0x07: d->op = OP_LD_VX_DT; break;
+        case 0x0A: d->op = OP_LD_VX_K; break;
+        case 0x15: d->op = OP_LD_DT; break;
+        case 0x18: d->op = OP_LD_ST; break;
+        case 0x1E: d->op = OP_ADD_I; break;
+        case 0x29: d->op = OP_LD_F; break;
+        case 0x33: d->op = OP_LD_B; break;
+        case 0x55: d->op = OP_LD_MEM; break;
+        case 0x65: d->op = OP_LD_REGS; break;
+        case 0x02: d->op = (d->X == 0) ? OP_AUDIO : OP_NOP; break;
+        case 0x3A: d->op = OP_PITCH; break;
+        case 0x01: d->op = OP_PLANE; break;
+        default:   d->op = OP_NOP; break;
+        }
+        break;
+    }
+    return decoded;
+}
+
+//解码addr处的指令, 存进自己的预解码页; 这一页还是共享的话先换成自己的
+static void decode_instruction(chip8_t *chip8, const u16 addr) {
+    const u8 page = (addr >> 8) & 0xF;
+
+    if (!(chip8->private_decoded & (1 << page))) {
+        decoded_t *copy = pool_alloc(chip8->pool, PAGE_SIZE * sizeof(decoded_t));
+        if (!copy) {
+            fprintf(stderr, "内存不足, 无法复制预解码页\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(copy, chip8->decoded[page], PAGE_SIZE * sizeof(decoded_t));
+        chip8->decoded[page] = copy;
+        chip8->private_decoded |= 1 << page;
+    }
+
+    chip8->decoded[page][addr & 0xFF] = decode_opcode((ram_read(chip8, addr) << 8) | ram_read(chip8, addr + 1));
+}
+
+//载入时把常见的相邻指令换成融合指令, 一次分发执行整组; 重新解码(自修改代码)时不再融合
+//组里后面的指令仍然有自己的预解码项, 跳转或者跳过到组中间时照常逐条执行
+//融合指令的处理程序直接读后面几项, 所以整组必须在同一个预解码页里
+static void fuse_instructions(decoded_t decoded[4096]) {
+    for (u32 addr = 0; addr < 4096; addr++) {
+        const u32 offset = addr % PAGE_SIZE;
+        if (offset > PAGE_SIZE - 3) continue;
+        decoded_t *d = &decoded[addr];
+        const u8 next = decoded[addr + 2].op;   //还没融合过: 从低地址往高地址处理
+        const u8 third = offset <= PAGE_SIZE - 5 ? decoded[addr + 4].op : OP_DECODE;
+
+        switch (d->op) {
+        case OP_LD_I:
+            if (next == OP_DRW) d->op = OP_LD_I_DRW;
+            break;
+        case OP_LD_NN:
+            if (next == OP_LD_NN) d->op = (third == OP_LD_NN) ? OP_LD_NN3 : OP_LD_NN2;
+            break;
+        case OP_ADD_NN:
+            if (next == OP_SE_NN) d->op = OP_ADD_SE;
+            else if (next == OP_SNE_NN) d->op = OP_ADD_SNE;
+            break;
+        case OP_LD_VX_DT:
+            if (next == OP_SE_NN) d->op = OP_DT_SE;
+            else if (next == OP_SNE_NN) d->op = OP_DT_SNE;
+            break;
+        }
+    }
+}
+
+//预解码缓存引擎: 每个地址只解码一次, 之后直接按处理程序编号分发
+//分发用的是GCC的computed goto扩展(CMakeLists中指定了gcc), 每个处理程序结尾直接跳到下一条指令的处理程序,
+//省掉了switch的边界检查和回到循环顶部的跳转
+//预解码缓存引擎每条指令的计数: 统计和内存热度, PC是还没后移的; 融合指令按它的第一条指令分类
+static void count_dispatch(chip8_t *chip8, const u8 op) {
+    if (chip8->metrics) count_instruction(chip8->metrics, chip8->PC, op < OP_FUSED ? op : fused_first[op - OP_FUSED]);
+    if (chip8->heatmap) count_fetch(chip8->heatmap, chip8->PC);
+}
+
+static u32 run_cached(chip8_t *chip8, const config_t config, const u32 count) {
+    //各种配置都一样的处理程序
+    #define COMMON_HANDLERS                                                                 \
+        [OP_DECODE] = &&op_decode,     [OP_NOP] = &&op_nop,         [OP_CLS] = &&op_cls,       \
+        [OP_RET] = &&op_ret,           [OP_JP] = &&op_jp,           [OP_CALL] = &&op_call,     \
+        [OP_SE_NN] = &&op_se_nn,       [OP_SNE_NN] = &&op_sne_nn,   [OP_SE_VY] = &&op_se_vy,   \
+        [OP_LD_NN] = &&op_ld_nn,       [OP_ADD_NN] = &&op_add_nn,   [OP_LD_VY] = &&op_ld_vy,   \
+        [OP_ADD_VY] = &&op_add_vy,     [OP_SUB] = &&op_sub,         [OP_SUBN] = &&op_subn,     \
+        [OP_SNE_VY] = &&op_sne_vy,     [OP_LD_I] = &&op_ld_i,       [OP_RND] = &&op_rnd,       \
+        [OP_SKP] = &&op_skp,           [OP_SKNP] = &&op_sknp,       [OP_LD_VX_DT] = &&op_ld_vx_dt, \
+        [OP_LD_VX_K] = &&op_ld_vx_k,   [OP_LD_DT] = &&op_ld_dt,     [OP_LD_ST] = &&op_ld_st,   \
+        [OP_ADD_I] = &&op_add_i,       [OP_LD_F] = &&op_ld_f,       [OP_LD_B] = &&op_ld_b
+    //融合指令的整组处理程序, ANNN + DXYN按配置进入裁掉或回绕的DXYN
+    #define FUSED_HANDLERS(ld_i_drw)                                                        \
+        [OP_LD_I_DRW] = &&ld_i_drw,    [OP_LD_NN2] = &&op_ld_nn2,   [OP_LD_NN3] = &&op_ld_nn3, \
+        [OP_ADD_SE] = &&op_add_se,     [OP_ADD_SNE] = &&op_add_sne, [OP_DT_SE] = &&op_dt_se,   \
+        [OP_DT_SNE] = &&op_dt_sne
+    //不融合(config.fuse关闭)时融合指令只执行它的第一条, 和单独的指令一样
+    #define PLAIN_HANDLERS                                                                  \
+        [OP_LD_I_DRW] = &&op_ld_i,     [OP_LD_NN2] = &&op_ld_nn,    [OP_LD_NN3] = &&op_ld_nn,  \
+        [OP_ADD_SE] = &&op_add_nn,     [OP_ADD_SNE] = &&op_add_nn,  [OP_DT_SE] = &&op_ld_vx_dt, \
+        [OP_DT_SNE] = &&op_ld_vx_dt
+    //各个变种不同的指令(quirks.h), 参数是处理程序名字的后缀, 和quirks_of一致
+    #define QUIRK_HANDLERS(logic, shift, jump, memory, draw)                                \
+        [OP_OR] = &&op_or##logic,      [OP_AND] = &&op_and##logic,  [OP_XOR] = &&op_xor##logic, \
+        [OP_SHR] = &&op_shr##shift,    [OP_SHL] = &&op_shl##shift,  [OP_JP_V0] = &&op_jp##jump, \
+        [OP_LD_MEM] = &&op_ld_mem##memory, [OP_LD_REGS] = &&op_ld_regs##memory, [OP_DRW] = &&op_drw##draw
+    //高分辨率和XO-CHIP(位平面和声音)的指令, 参数是处理程序名字的前缀, 不支持的配置里是nop_*, 什么也不做
+    #define SCREEN_HANDLERS(hires, planes)                                                  \
+        [OP_SCROLL_DOWN] = &&hires##_scroll_down, [OP_SCROLL_RIGHT] = &&hires##_scroll_right,  \
+        [OP_SCROLL_LEFT] = &&hires##_scroll_left, [OP_LORES] = &&hires##_lores,              \
+        [OP_HIRES] = &&hires##_hires,  [OP_SCROLL_UP] = &&planes##_scroll_up, [OP_PLANE] = &&planes##_plane, \
+        [OP_AUDIO] = &&planes##_audio, [OP_PITCH] = &&planes##_pitch
+    #define VIP_HANDLERS    QUIRK_HANDLERS(, , _v0, , ), SCREEN_HANDLERS(nop, nop)
+    #define CHIP48_HANDLERS QUIRK_HANDLERS(_novf, _vx, _vx, _x, ), SCREEN_HANDLERS(nop, nop)
+    #define SCHIP_HANDLERS  QUIRK_HANDLERS(_novf, _vx, _vx, _keep, _schip), SCREEN_HANDLERS(op, nop)
+    #define XOCHIP_HANDLERS QUIRK_HANDLERS(_novf, , _v0, , _xochip), SCREEN_HANDLERS(op, op)
+
+    //按是否融合和兼容性配置选一张表, 执行时不再检查配置
+    static const void *const handler_tables[2][QUIRKS_COUNT][OP_HANDLERS] = {
+        {
+            [QUIRKS_VIP]    = { COMMON_HANDLERS, PLAIN_HANDLERS, VIP_HANDLERS },
+            [QUIRKS_CHIP48] = { COMMON_HANDLERS, PLAIN_HANDLERS, CHIP48_HANDLERS },
+            [QUIRKS_SCHIP]  = { COMMON_HANDLERS, PLAIN_HANDLERS, SCHIP_HANDLERS },
+            [QUIRKS_XOCHIP] = { COMMON_HANDLERS, PLAIN_HANDLERS, XOCHIP_HANDLERS },
+        },
+        {
+            [QUIRKS_VIP]    = { COMMON_HANDLERS, FUSED_HANDLERS(op_ld_i_drw), VIP_HANDLERS },
+            [QUIRKS_CHIP48] = { COMMON_HANDLERS, FUSED_HANDLERS(op_ld_i_drw), CHIP48_HANDLERS },
+            [QUIRKS_SCHIP]  = { COMMON_HANDLERS, FUSED_HANDLERS(op_ld_i_drw_schip), SCHIP_HANDLERS },
+            [QUIRKS_XOCHIP] = { COMMON_HANDLERS, FUSED_HANDLERS(op_ld_i_drw_xochip), XOCHIP_HANDLERS },
+        },
+    };
+    const void *const *handlers = handler_tables[config.fuse][config.quirks];
+
+    #undef XOCHIP_HANDLERS
+    #undef SCHIP_HANDLERS
+    #undef CHIP48_HANDLERS
+    #undef VIP_HANDLERS
+    #undef SCREEN_HANDLERS
+    #undef QUIRK_HANDLERS
+    #undef PLAIN_HANDLERS
+    #undef FUSED_HANDLERS
+    #undef COMMON_HANDLERS
+
+    u8 *V = chip8->V;
+    const bool counting = instrumented(chip8);
+    const decoded_t *d;
+    u32 executed = 0;
+    bool carry;
+
+    //取出PC处的预解码指令, PC后移, 跳到它的处理程序; 不计数时多出的只是一个总是不成立的分支
+    #define DISPATCH() do {                                 \
+        if (executed == count) return executed;             \
+        d = &chip8->decoded[(chip8->PC >> 8) & 0xF][chip8->PC & 0xFF];  \
+        if (counting) count_dispatch(chip8, d->op);         \
+        chip8->PC += 2;                                     \
+        executed++;                                         \
+        goto *handlers[d->op];                              \
+    } while (0)
+
+    //融合指令的一条执行完之后, 不经过分发直接进入组里下一条(分类为op)的处理程序; 剩下的条数不够时停在组中间
+    #define FUSE_NEXT(label, op) do {                       \
+        if (executed == count) return executed;             \
+        d += 2;                                             \
+        if (counting) count_dispatch(chip8, op);            \
+        chip8->PC += 2;                                     \
+        executed++;                                         \
+        goto label;                                         \
+    } while (0)
+
+    DISPATCH();
+
+op_decode:
+    //第一次执行到这个地址(或者这里被写过), 先解码再跳到它的处理程序; 这条指令已经算过了, 只改正分类
+    decode_instruction(chip8, chip8->PC - 2);
+    d = &chip8->decoded[((chip8->PC - 2) >> 8) & 0xF][(chip8->PC - 2) & 0xFF];
+    if (chip8->metrics) {
+        chip8->metrics->classes[OP_DECODE]--;
+        chip8->metrics->classes[d->op]++;
+    }
+    goto *handlers[d->op];
+op_nop:
+nop_scroll_down:
+nop_scroll_up:
+nop_scroll_right:
+nop_scroll_left:
+nop_lores:
+nop_hires:
+nop_plane:
+nop_audio:
+nop_pitch:
+    DISPATCH();
+op_cls:
+    clear_display(chip8);
+    DISPATCH();
+op_ret:
+    if (chip8->SP > 0) chip8->PC = chip8->stk[--chip8->SP];
+    DISPATCH();
+op_jp:
+    chip8->PC = d->NNN;
+    DISPATCH();
+op_call:
+    if (chip8->SP < 16) chip8->stk[chip8->SP++] = chip8->PC;
+    chip8->PC = d->NNN;
+    DISPATCH();
+op_se_nn:
+    if (V[d->X] == d->NN) chip8->PC += 2;
+    DISPATCH();
+op_sne_nn:
+    if (V[d->X] != d->NN) chip8->PC += 2;
+    DISPATCH();
+op_se_vy:
+    if (V[d->X] == V[d->Y]) chip8->PC += 2;
+    DISPATCH();
+op_ld_nn:
+    V[d->X] = d->NN;
+    DISPATCH();
+op_add_nn:
+    V[d->X] += d->NN;
+    DISPATCH();
+op_ld_vy:
+    V[d->X] = V[d->Y];
+    DISPATCH();
+op_or:
+    V[d->X] |= V[d->Y];
+    V[0xF] = 0; //chip888
+    DISPATCH();
+op_and:
+    V[d->X] &= V[d->Y];
+    V[0xF] = 0; //chip888
+    DISPATCH();
+op_xor:
+    V[d->X] ^= V[d->Y];
+    V[0xF] = 0; //chip888
+    DISPATCH();
+op_or_novf:
+    V[d->X] |= V[d->Y];
+    DISPATCH();
+op_and_novf:
+    V[d->X] &= V[d->Y];
+    DISPATCH();
+op_xor_novf:
+    V[d->X] ^= V[d->Y];
+    DISPATCH();
+op_add_vy:
+    carry = (u16)(V[d->X] + V[d->Y]) > 0xFF;
+    V[d->X] += V[d->Y];
+    V[0xF] = carry;
+    DISPATCH();
+op_sub:
+    carry = (V[d->X] >= V[d->Y]);
+    V[d->X] -= V[d->Y];
+    V[0xF] = carry;
+    DISPATCH();
+op_shr:
+    carry = V[d->Y] & 1;    //chip888
+    V[d->X] = V[d->Y] >> 1;
+    V[0xF] = carry;
+    DISPATCH();
+op_shr_vx:
+    carry = V[d->X] & 1;
+    V[d->X] >>= 1;
+    V[0xF] = carry;
+    DISPATCH();
+op_subn:
+    carry = (V[d->X] <= V[d->Y]);
+    V[d->X] = V[d->Y] - V[d->X];
+    V[0xF] = carry;
+    DISPATCH();
+op_shl:
+    carry = (V[d->Y] & 0x80) >> 7;  //chip888
+    V[d->X] = V[d->Y] << 1;
+    V[0xF] = carry;
+    DISPATCH();
+op_shl_vx:
+    carry = (V[d->X] & 0x80) >> 7;
+    V[d->X] <<= 1;
+    V[0xF] = carry;
+    DISPATCH();
+op_sne_vy:
+    if (V[d->X] != V[d->Y]) chip8->PC += 2;
+    DISPATCH();
+op_ld_i:
+    chip8->I = d->NNN;
+    DISPATCH();
+op_jp_v0:
+    chip8->PC = V[0x0] + d->NNN;
+    DISPATCH();
+op_jp_vx:
+    chip8->PC = V[d->X] + d->NNN;
+    DISPATCH();
+op_rnd:
+    V[d->X] = chip8_rand(chip8) & d->NN;
+    DISPATCH();
+op_drw:
+    draw_clip(chip8, config, V[d->X], V[d->Y], d->N);
+    return executed;    //一帧只绘制一个sprite, chip888
+op_drw_schip:
+    draw_schip(chip8, config, V[d->X], V[d->Y], d->N);
+    return executed;
+op_drw_xochip:
+    draw_xochip(chip8, config, V[d->X], V[d->Y], d->N);
+    return executed;
+op_skp:
+    if (chip8->keypad[V[d->X] & 0xF]) chip8->PC += 2;
+    DISPATCH();
+op_sknp:
+    if (!chip8->keypad[V[d->X] & 0xF]) chip8->PC += 2;
+    DISPATCH();
+op_ld_vx_dt:
+    V[d->X] = chip8->delay_timer;
+    DISPATCH();
+op_ld_vx_k:
+    wait_for_key(chip8, d->X);
+    if (chip8->key_wait) return executed;
+    DISPATCH();
+op_ld_dt:
+    chip8->delay_timer = V[d->X];
+    DISPATCH();
+op_ld_st:
+    chip8->sound_timer = V[d->X];
+    DISPATCH();
+op_add_i:
+    chip8->I += V[d->X];
+    DISPATCH();
+op_ld_f:
+    chip8->I = V[d->X] * 5;
+    DISPATCH();
+op_ld_b: {
+    const u8 vx = V[d->X];
+    ram_write(chip8, chip8->I + 2, vx % 10);
+    ram_write(chip8, chip8->I + 1, vx / 10 % 10);
+    ram_write(chip8, chip8->I, vx / 100);
+    invalidate_code(chip8, chip8->I, 3);
+    if (chip8->heatmap) count_access(chip8->heatmap->writes, chip8->I, 3);
+    DISPATCH();
+}
+op_ld_mem:
+    store_registers(chip8, d->X);
+    chip8->I += d->X + 1;   //chip888
+    DISPATCH();
+op_ld_mem_x:
+    store_registers(chip8, d->X);
+    chip8->I += d->X;
+    DISPATCH();
+op_ld_mem_keep:
+    store_registers(chip8, d->X);
+    DISPATCH();
+op_ld_regs:
+    load_registers(chip8, d->X);
+    chip8->I += d->X + 1;   //chip888
+    DISPATCH();
+op_ld_regs_x:
+    load_registers(chip8, d->X);
+    chip8->I += d->X;
+    DISPATCH();
+op_ld_regs_keep:
+    load_registers(chip8, d->X);
+    DISPATCH();
+op_audio:
+    if (chip8->heatmap) count_access(chip8->heatmap->reads, chip8->I, sizeof chip8->audio_pattern);
+    load_audio_pattern(chip8);
+    DISPATCH();
+op_pitch:
+    chip8->pitch = V[d->X];
+    DISPATCH();
+op_scroll_down:
+    scroll_display(chip8, 0, d->N);
+    DISPATCH();
+op_scroll_up:
+    scroll_display(chip8, 0, -d->N);
+    DISPATCH();
+op_scroll_right:
+    scroll_display(chip8, 4, 0);
+    DISPATCH();
+op_scroll_left:
+    scroll_display(chip8, -4, 0);
+    DISPATCH();
+op_lores:
+    set_hires(chip8, false);
+    DISPATCH();
+op_hires:
+    set_hires(chip8, true);
+    DISPATCH();
+op_plane:
+    select_planes(chip8, d->X);
+    DISPATCH();
+
+op_ld_i_drw:
+    if (chip8->metrics) chip8->metrics->fused[OP_LD_I_DRW - OP_FUSED]++;
+    chip8->I = d->NNN;
+    FUSE_NEXT(op_drw, OP_DRW);
+op_ld_i_drw_schip:
+    if (chip8->metrics) chip8->metrics->fused[OP_LD_I_DRW - OP_FUSED]++;
+    chip8->I = d->NNN;
+    FUSE_NEXT(op_drw_schip, OP_DRW);
+op_ld_i_drw_xochip:
+    if (chip8->metrics) chip8->metrics->fused[OP_LD_I_DRW - OP_FUSED]++;
+    chip8->I = d->NNN;
+    FUSE_NEXT(op_drw_xochip, OP_DRW);
+op_ld_nn3:
+    if (chip8->metrics) chip8->metrics->fused[OP_LD_NN3 - OP_FUSED]++;
+    V[d->X] = d->NN;
+    FUSE_NEXT(op_ld_nn2_next, OP_LD_NN);
+op_ld_nn2:
+    if (chip8->metrics) chip8->metrics->fused[OP_LD_NN2 - OP_FUSED]++;
+op_ld_nn2_next:
+    V[d->X] = d->NN;
+    FUSE_NEXT(op_ld_nn, OP_LD_NN);
+op_add_se:
+    if (chip8->metrics) chip8->metrics->fused[OP_ADD_SE - OP_FUSED]++;
+    V[d->X] += d->NN;
+    FUSE_NEXT(op_se_nn, OP_SE_NN);
+op_add_sne:
+    if (chip8->metrics) chip8->metrics->fused[OP_ADD_SNE - OP_FUSED]++;
+    V[d->X] += d->NN;
+    FUSE_NEXT(op_sne_nn, OP_SNE_NN);
+op_dt_se:
+    if (chip8->metrics) chip8->metrics->fused[OP_DT_SE - OP_FUSED]++;
+    V[d->X] = chip8->delay_timer;
+    FUSE_NEXT(op_se_nn, OP_SE_NN);
+op_dt_sne:
+    if (chip8->metrics) chip8->metrics->fused[OP_DT_SNE - OP_FUSED]++;
+    V[d->X] = chip8->delay_timer;
+    FUSE_NEXT(op_sne_nn, OP_SNE_NN);
+
+    #undef FUSE_NEXT
+    #undef DISPATCH
+}
+
+//执行最多count条指令, 执行完一条DXYN后提前返回(一帧只绘制一个sprite), 返回实际执行的指令数
+u32 run_instructions(chip8_t *chip8, const config_t config, const u32 count) {
+    if (chip8->trace) return run_traced(chip8, config, count);  //跟踪时逐条解释执行
+    //计数时JIT也用预解码缓存引擎, 翻译好的代码里没有计数
+    if (config.engine == ENGINE_CACHED || (config.engine == ENGINE_JIT && instrumented(chip8))) return run_cached(chip8, config, count);
+    if (config.engine == ENGINE_JIT) return run_jit(chip8, config, count);
+
+    return switch_variants[config.quirks](chip8, config, count);    //按配置选一次版本
+}
+
+const char *engine_name(const engine_t engine) {
+    switch (engine) {
+    case ENGINE_SWITCH: return "switch";
+    case ENGINE_CACHED: return "cached";
+    case ENGINE_JIT: return "jit";
+    default: return "unknown";
+    }
+}
+
+//两个虚拟机的内存是否一致, 共享同一页的直接跳过
+static bool same_ram(const chip8_t *a, const chip8_t *b) {
+    for (u8 page = 0; page < PAGE_COUNT; page++)
+        if (a->ram[page] != b->ram[page] && memcmp(a->ram[page], b->ram[page], PAGE_SIZE) != 0) return false;
+    return true;
+}
+
+//一个有screen一个没有也可能一样: 比较展开后的每一行
+static bool same_display(const chip8_t *a, const chip8_t *b) {
+    for (u8 p = 0; p < DISPLAY_PLANES; p++)
+        for (u32 y = 0; y < DISPLAY_HEIGHT; y++)
+            if (display_row(a, p, y) != display_row(b, p, y)) return false;
+    return true;
+}
+
+//比较两个虚拟机的状态是否完全一致(不比较只和引擎有关的缓存)
+bool same_state(const chip8_t *a, const chip8_t *b) {
+    return memcmp(a->V, b->V, sizeof a->V) == 0
+        && memcmp(a->stk, b->stk, sizeof a->stk) == 0
+        && a->SP == b->SP
+        && a->I == b->I
+        && a->PC == b->PC
+        && a->delay_timer == b->delay_timer
+        && a->sound_timer == b->sound_timer
+        && same_ram(a, b)
+        && same_display(a, b)
+        && a->hires == b->hires
+        && a->planes == b->planes
+        && a->rng == b->rng
+        && a->wait_key == b->wait_key
+        && a->key_wait == b->key_wait
+        && memcmp(a->audio_pattern, b->audio_pattern, sizeof a->audio_pattern) == 0
+        && a->pitch == b->pitch
+        && a->xo_audio == b->xo_audio;
+}
+
+//FNV-1a 64位哈希, 从hash开始接着算
+static u64 fnv1a(u64 hash, const u8 *p, const size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001B3ull;
+    }
+    return hash;
+}
+
+u64 hash_bytes(const void *data, const size_t len) {
+    return fnv1a(0xCBF29CE484222325ull, data, len);
+}
+
+//逐页接着算, 结果和把整个内存连起来算hash_bytes一样
+u64 hash_ram(const chip8_t *chip8) {
+    u64 hash = 0xCBF29CE484222325ull;
+    for (u8 page = 0; page < PAGE_COUNT; page++) hash = fnv1a(hash, chip8->ram[page], PAGE_SIZE);
+    return hash;
+}
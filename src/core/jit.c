@@ -0,0 +1,548 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "jit.h"
+#include "quirks.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define JIT_X86_64
+#endif
+
+#ifdef JIT_X86_64
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+#define JIT_CODE_SIZE (1 << 20) //可执行内存大小, 用完就整个清空重新翻译
+#define JIT_BLOCK_RESERVE 4096  //翻译一个块前至少要剩下这么多字节, 一个块最长远小于这个值
+#define JIT_MAX_BLOCK_INSTS 64  //一个块最多包含的指令数
+
+//翻译出的块: 参数是虚拟机, 返回块执行完之后的PC
+typedef u32 (*jit_block_fn)(chip8_t *chip8);
+
+//翻译缓存中的一项, 下标是块的起始PC
+typedef struct {
+    jit_block_fn fn;    //本机代码
+    u16 insts;  //块内的指令数(包括结尾的跳转/跳过), 0表示这个地址的第一条指令就不能翻译, 交给解释器
+    bool translated;    //是否已经尝试过翻译
+} jit_entry_t;
+
+struct jit {
+    jit_entry_t entries[4096];
+    u8 *code;   //可执行内存
+    u32 used;   //已经用掉的字节数
+    u64 code_pages; //已翻译的代码覆盖了哪些64字节的内存页, 写内存时只有写到这些页才需要清空缓存
+    quirks_profile_t quirks;    //翻译时的兼容性配置, 换配置时清空缓存
+};
+
+#ifdef JIT_X86_64
+
+/* ===================== x86-64指令编码 ===================== */
+
+//宿主寄存器编号, 即x86-64指令编码中的寄存器号
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+//条件码, 用于setcc/cmovcc
+enum { CC_C = 0x2, CC_NC = 0x3, CC_E = 0x4, CC_NE = 0x5 };
+
+//8位运算的操作码, 形式都是 op r/m8, r8
+enum { X86_ADD = 0x00, X86_OR = 0x08, X86_AND = 0x20, X86_SUB = 0x28, X86_XOR = 0x30, X86_CMP = 0x38, X86_MOV = 0x88 };
+
+//rdi在块内一直指向chip8_t, rax是临时寄存器, 其余13个寄存器分配给块内用到的V寄存器
+//调用者保存的寄存器排在前面, 用到的V寄存器少时不需要压栈
+#define BASE RDI
+static const u8 reg_pool[] = { RCX, RDX, R8, R9, R10, R11, RSI, RBX, RBP, R12, R13, R14, R15 };
+#define POOL_SIZE (sizeof reg_pool / sizeof reg_pool[0])
+
+//被调用者保存的寄存器(按位), 用到了就要在序言中压栈; Win64中rsi和rdi也是被调用者保存的
+#ifdef _WIN32
+#define CALLEE_SAVED ((1 << RBX) | (1 << RBP) | (1 << RSI) | (1 << RDI) | (1 << R12) | (1 << R13) | (1 << R14) | (1 << R15))
+#else
+#define CALLEE_SAVED ((1 << RBX) | (1 << RBP) | (1 << R12) | (1 << R13) | (1 << R14) | (1 << R15))
+#endif
+
+typedef struct {
+    u8 *p;
+} emitter_t;
+
+static inline void emit8(emitter_t *e, const u8 b) { *e->p++ = b; }
+
+static inline void emit16(emitter_t *e, const u16 v) {
+    emit8(e, v & 0xFF);
+    emit8(e, v >> 8);
+}
+
+static inline void emit32(emitter_t *e, const u32 v) {
+    emit16(e, v & 0xFFFF);
+    emit16(e, v >> 16);
+}
+
+//REX前缀; 8位运算总是带REX, 这样4~7号寄存器表示spl/bpl/sil/dil而不是ah/ch/dh/bh
+static inline void emit_rex(emitter_t *e, const bool w, const u8 reg, const u8 rm) {
+    emit8(e, 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3));
+}
+
+static inline void emit_modrm(emitter_t *e, const u8 mod, const u8 reg, const u8 rm) {
+    emit8(e, (mod << 6) | ((reg & 7) << 3) | (rm & 7));
+}
+
+//op r/m8, r8 (寄存器之间)
+static void emit_op_rr8(emitter_t *e, const u8 op, const u8 dst, const u8 src) {
+    emit_rex(e, false, src, dst);
+    emit8(e, op);
+    emit_modrm(e, 3, src, dst);
+}
+
+//mov r8, imm8
+static void emit_mov_r8_imm(emitter_t *e, const u8 reg, const u8 imm) {
+    emit_rex(e, false, 0, reg);
+    emit8(e, 0xB0 + (reg & 7));
+    emit8(e, imm);
+}
+
+//add/cmp r8, imm8; ext是ModRM中的扩展操作码: 0是add, 7是cmp
+static void emit_alu_r8_imm(emitter_t *e, const u8 ext, const u8 reg, const u8 imm) {
+    emit_rex(e, false, 0, reg);
+    emit8(e, 0x80);
+    emit_modrm(e, 3, ext, reg);
+    emit8(e, imm);
+}
+
+//shl/shr r8, 1; ext: 4是shl, 5是shr, 移出的位进入CF
+static void emit_shift1_r8(emitter_t *e, const u8 ext, const u8 reg) {
+    emit_rex(e, false, 0, reg);
+    emit8(e, 0xD0);
+    emit_modrm(e, 3, ext, reg);
+}
+
+//setcc r8
+static void emit_setcc(emitter_t *e, const u8 cc, const u8 reg) {
+    emit_rex(e, false, 0, reg);
+    emit8(e, 0x0F);
+    emit8(e, 0x90 + cc);
+    emit_modrm(e, 3, 0, reg);
+}
+
+//mov r8, [rdi + off]
+static void emit_load_r8(emitter_t *e, const u8 reg, const u32 off) {
+    emit_rex(e, false, reg, BASE);
+    emit8(e, 0x8A);
+    emit_modrm(e, 2, reg, BASE);
+    emit32(e, off);
+}
+
+//mov [rdi + off], r8
+static void emit_store_r8(emitter_t *e, const u32 off, const u8 reg) {
+    emit_rex(e, false, reg, BASE);
+    emit8(e, 0x88);
+    emit_modrm(e, 2, reg, BASE);
+    emit32(e, off);
+}
+
+//mov word [rdi + off], imm16
+static void emit_store_m16_imm(emitter_t *e, const u32 off, const u16 imm) {
+    emit8(e, 0x66);
+    emit8(e, 0xC7);
+    emit_modrm(e, 2, 0, BASE);
+    emit32(e, off);
+    emit16(e, imm);
+}
+
+//movzx eax, r8
+static void emit_movzx_eax_r8(emitter_t *e, const u8 reg) {
+    emit_rex(e, false, RAX, reg);
+    emit8(e, 0x0F);
+    emit8(e, 0xB6);
+    emit_modrm(e, 3, RAX, reg);
+}
+
+//add/mov word [rdi + off], ax; op: 0x01是add, 0x89是mov
+static void emit_op_m16_ax(emitter_t *e, const u8 op, const u32 off) {
+    emit8(e, 0x66);
+    emit8(e, op);
+    emit_modrm(e, 2, RAX, BASE);
+    emit32(e, off);
+}
+
+//mov r32, imm32
+static void emit_mov_r32_imm(emitter_t *e, const u8 reg, const u32 imm) {
+    emit8(e, 0xB8 + reg);
+    emit32(e, imm);
+}
+
+/* ===================== 块的翻译 ===================== */
+
+//指令在块中的角色
+typedef enum {
+    INST_STOP,  //不支持, 块在它之前结束, 交给解释器
+    INST_BODY,  //翻译成本机代码, 执行完PC顺序后移
+    INST_END,   //翻译成本机代码并结束块: 1NNN和各种跳过指令
+} inst_kind_t;
+
+//对一条指令分类, 同时给出它读写的V寄存器(按位)
+static inst_kind_t classify(const u16 opcode, u16 *regs, u16 *written) {
+    const u8 X = (opcode >> 8) & 0x0F;
+    const u8 Y = (opcode >> 4) & 0x0F;
+    const u8 N = opcode & 0x0F;
+    const u8 NN = opcode & 0xFF;
+
+    *regs = 0;
+    *written = 0;
+
+    switch (opcode >> 12) {
+    case 0x0:
+        if (NN == 0xE0 || NN == 0xEE) return INST_STOP;
+        //SUPER-CHIP/XO-CHIP的滚屏和切换分辨率交给解释器, 其他配置里解释器把它们当成0NNN
+        if (X == 0 && ((NN & 0xF0) == 0xC0 || (NN & 0xF0) == 0xD0 || NN >= 0xFB)) return INST_STOP;
+        return INST_BODY;   //0NNN什么也不做
+    case 0x1:
+        return INST_END;
+    case 0x3: case 0x4:
+        *regs = 1 << X;
+        return INST_END;
+    case 0x5: case 0x9:
+        if (N != 0) return INST_BODY;   //5XYN/9XYN(N != 0)什么也不做
+        *regs = (1 << X) | (1 << Y);
+        return INST_END;
+    case 0x6: case 0x7:
+        *regs = *written = 1 << X;
+        return INST_BODY;
+    case 0x8:
+        switch (N) {
+        case 0x0:
+            *regs = (1 << X) | (1 << Y);
+            *written = 1 << X;
+            return INST_BODY;
+        case 0x1: case 0x2: case 0x3: case 0x4: case 0x5: case 0x6: case 0x7: case 0xE:
+            *regs = (1 << X) | (1 << Y) | (1 << 0xF);
+            *written = (1 << X) | (1 << 0xF);
+            return INST_BODY;
+        default:
+            return INST_BODY;   //其他8XYN什么也不做
+        }
+    case 0xA:
+        return INST_BODY;
+    case 0xE:
+        return (NN == 0x9E || NN == 0xA1) ? INST_STOP : INST_BODY;
+    case 0xF:
+        switch (NN) {
+        case 0x07:
+            *regs = *written = 1 << X;
+            return INST_BODY;
+        case 0x15: case 0x18: case 0x1E: case 0x29: case 0x3A:
+            *regs = 1 << X;
+            return INST_BODY;
+        case 0x0A: case 0x33: case 0x55: case 0x65: case 0x01:  //FN01选位平面, 交给解释器
+            return INST_STOP;
+        case 0x02:
+            return (X == 0) ? INST_STOP : INST_BODY;    //F002读16字节内存, 交给解释器
+        default:
+            return INST_BODY;   //其他FXNN什么也不做
+        }
+    default:
+        return INST_STOP;   //2NNN, BNNN, CXNN, DXYN
+    }
+}
+
+//翻译一条块内指令, host[i]是V[i]所在的宿主寄存器; 兼容性配置在翻译时决定生成哪种代码
+static void emit_body(emitter_t *e, const u16 opcode, const u8 host[16], const quirks_t quirks) {
+    const u8 X = (opcode >> 8) & 0x0F;
+    const u8 Y = (opcode >> 4) & 0x0F;
+    const u8 NN = opcode & 0xFF;
+    const u8 vx = host[X], vy = host[Y], vf = host[0xF];
+
+    switch (opcode >> 12) {
+    case 0x6: emit_mov_r8_imm(e, vx, NN); break;
+    case 0x7: emit_alu_r8_imm(e, 0, vx, NN); break;
+    case 0x8:
+        switch (opcode & 0x0F) {
+        case 0x0: emit_op_rr8(e, X86_MOV, vx, vy); break;
+        case 0x1: case 0x2: case 0x3:
+            emit_op_rr8(e, (opcode & 0x0F) == 0x1 ? X86_OR : (opcode & 0x0F) == 0x2 ? X86_AND : X86_XOR, vx, vy);
+            if (quirks.vf_reset) emit_mov_r8_imm(e, vf, 0);   //chip888
+            break;
+        case 0x4:
+            //VX += VY, CF就是进位
+            emit_op_rr8(e, X86_ADD, vx, vy);
+            emit_setcc(e, CC_C, vf);
+            break;
+        case 0x5:
+            //VX -= VY, CF是借位, VF = !CF
+            emit_op_rr8(e, X86_SUB, vx, vy);
+            emit_setcc(e, CC_NC, vf);
+            break;
+        case 0x6:
+        case 0xE:
+            //VX = VY >> 1 或 VY << 1(CHIP-48和SUPER-CHIP移VX), 移出的位在CF中, chip888
+            emit_op_rr8(e, X86_MOV, RAX, quirks.shift_vy ? vy : vx);
+            emit_shift1_r8(e, (opcode & 0x0F) == 0x6 ? 5 : 4, RAX);
+            emit_op_rr8(e, X86_MOV, vx, RAX);
+            emit_setcc(e, CC_C, vf);
+            break;
+        case 0x7:
+            //VX = VY - VX, VF = !借位
+            emit_op_rr8(e, X86_MOV, RAX, vy);
+            emit_op_rr8(e, X86_SUB, RAX, vx);
+            emit_op_rr8(e, X86_MOV, vx, RAX);
+            emit_setcc(e, CC_NC, vf);
+            break;
+        default: break;
+        }
+        break;
+    case 0xA: emit_store_m16_imm(e, offsetof(chip8_t, I), opcode & 0x0FFF); break;
+    case 0xF:
+        switch (NN) {
+        case 0x07: emit_load_r8(e, vx, offsetof(chip8_t, delay_timer)); break;
+        case 0x15: emit_store_r8(e, offsetof(chip8_t, delay_timer), vx); break;
+        case 0x18: emit_store_r8(e, offsetof(chip8_t, sound_timer), vx); break;
+        case 0x3A: if (quirks.planes) emit_store_r8(e, offsetof(chip8_t, pitch), vx); break;   //XO-CHIP, 别的配置里什么也不做
+        case 0x1E:
+            //I += VX, 和解释器一样按16位回绕
+            emit_movzx_eax_r8(e, vx);
+            emit_op_m16_ax(e, 0x01, offsetof(chip8_t, I));
+            break;
+        case 0x29:
+            //I = VX * 5: lea eax, [rax + rax * 4]
+            emit_movzx_eax_r8(e, vx);
+            emit8(e, 0x8D);
+            emit8(e, 0x04);
+            emit8(e, 0x80);
+            emit_op_m16_ax(e, 0x89, offsetof(chip8_t, I));
+            break;
+        default: break;
+        }
+        break;
+    default: break; //什么也不做的指令
+    }
+}
+
+//清空整个翻译缓存
+static void jit_flush(jit_t *jit) {
+    memset(jit->entries, 0, sizeof jit->entries);
+    jit->used = 0;
+    jit->code_pages = 0;
+}
+
+//把addr开始的len字节所在的页标记为已翻译的代码
+static void mark_code_pages(jit_t *jit, const u16 addr, const u16 len) {
+    for (u32 page = addr >> 6; page <= (u32)((addr + len - 1) >> 6) && page < 64; page++)
+        jit->code_pages |= (u64)1 << page;
+}
+
+//翻译从pc开始的块, 结果存进jit->entries[pc]
+static void translate_block(jit_t *jit, const chip8_t *chip8, const u16 pc) {
+    u16 opcodes[JIT_MAX_BLOCK_INSTS];
+    u16 used = 0, written = 0;
+    u16 n = 0;
+    bool ends_block = false;
+
+    //1.找出块的范围: 遇到不支持的指令, 结束块的指令, 或者用到的V寄存器超过可分配的宿主寄存器时停止
+    for (u16 addr = pc; n < JIT_MAX_BLOCK_INSTS && addr + 1 <= 0xFFF; addr += 2) {
+        const u16 opcode = (ram_read(chip8, addr) << 8) | ram_read(chip8, addr + 1);
+        u16 regs, writes;
+        const inst_kind_t kind = classify(opcode, &regs, &writes);
+
+        if (kind == INST_STOP) break;
+        if (__builtin_popcount(used | regs) > (int)POOL_SIZE) break;
+
+        used |= regs;
+        written |= writes;
+        opcodes[n++] = opcode;
+
+        if (kind == INST_END) {
+            ends_block = true;
+            break;
+        }
+    }
+
+    jit_entry_t *entry = &jit->entries[pc];
+    entry->translated = true;
+    entry->insts = n;
+    entry->fn = NULL;
+    if (n == 0) return;
+
+    if (jit->used + JIT_BLOCK_RESERVE > JIT_CODE_SIZE) {
+        //可执行内存用完了, 整个清空, 当前这一项重新填写
+        jit_flush(jit);
+        entry->translated = true;
+        entry->insts = n;
+    }
+
+    //2.给用到的V寄存器分配宿主寄存器, 记下需要保存的寄存器
+    u8 host[16] = {0};
+    u16 saved = (1 << BASE) & CALLEE_SAVED;
+    for (u8 i = 0, k = 0; i < 16; i++) {
+        if (used & (1 << i)) {
+            host[i] = reg_pool[k++];
+            saved |= (1 << host[i]) & CALLEE_SAVED;
+        }
+    }
+
+    emitter_t e = { .p = jit->code + jit->used };
+    u8 *const start = e.p;
+
+    //3.序言: 保存寄存器, 取得chip8指针, 把用到的V寄存器载入宿主寄存器
+    for (u8 r = 0; r < 16; r++) {
+        if (!(saved & (1 << r))) continue;
+        if (r >= R8) emit8(&e, 0x41);
+        emit8(&e, 0x50 + (r & 7));  //push
+    }
+#ifdef _WIN32
+    emit8(&e, 0x48);    //Win64: 第一个参数在rcx中, mov rdi, rcx
+    emit8(&e, 0x89);
+    emit8(&e, 0xCF);
+#endif
+    for (u8 i = 0; i < 16; i++)
+        if (used & (1 << i)) emit_load_r8(&e, host[i], offsetof(chip8_t, V) + i);
+
+    //4.块内的指令; 结尾的跳转/跳过只先设置标志位, 写回寄存器之后再计算下一条PC
+    const u16 body = ends_block ? n - 1 : n;
+    for (u16 i = 0; i < body; i++) emit_body(&e, opcodes[i], host, quirks_of[jit->quirks]);
+
+    u8 cc = 0;  //结束指令为跳过时, 满足这个条件就跳过
+    if (ends_block) {
+        const u16 opcode = opcodes[n - 1];
+        const u8 X = (opcode >> 8) & 0x0F;
+        const u8 Y = (opcode >> 4) & 0x0F;
+        switch (opcode >> 12) {
+        case 0x3: emit_alu_r8_imm(&e, 7, host[X], opcode & 0xFF); cc = CC_E; break;
+        case 0x4: emit_alu_r8_imm(&e, 7, host[X], opcode & 0xFF); cc = CC_NE; break;
+        case 0x5: emit_op_rr8(&e, X86_CMP, host[X], host[Y]); cc = CC_E; break;
+        case 0x9: emit_op_rr8(&e, X86_CMP, host[X], host[Y]); cc = CC_NE; break;
+        default: break; //1NNN
+        }
+    }
+
+    //5.尾声: 写回被修改的V寄存器(mov不影响标志位), 把下一条PC放进eax, 恢复寄存器并返回
+    for (u8 i = 0; i < 16; i++)
+        if (written & (1 << i)) emit_store_r8(&e, offsetof(chip8_t, V) + i, host[i]);
+
+    const u16 last = pc + (n - 1) * 2;  //块内最后一条指令的地址
+    if (!ends_block) emit_mov_r32_imm(&e, RAX, last + 2);
+    else if (opcodes[n - 1] >> 12 == 0x1) emit_mov_r32_imm(&e, RAX, opcodes[n - 1] & 0x0FFF);
+    else {
+        //eax = 条件成立 ? last + 4 : last + 2, 用cmovcc避免分支
+        emit_mov_r32_imm(&e, RAX, last + 2);
+        emit_mov_r32_imm(&e, RCX, last + 4);
+        emit8(&e, 0x0F);
+        emit8(&e, 0x40 + cc);
+        emit_modrm(&e, 3, RAX, RCX);
+    }
+
+    for (int r = 15; r >= 0; r--) {
+        if (!(saved & (1 << r))) continue;
+        if (r >= R8) emit8(&e, 0x41);
+        emit8(&e, 0x58 + (r & 7));  //pop
+    }
+    emit8(&e, 0xC3);    //ret
+
+    entry->fn = (jit_block_fn)(void *)start;
+    jit->used += e.p - start;
+    mark_code_pages(jit, pc, n * 2);
+}
+
+bool jit_available(void) { return true; }
+
+jit_t *jit_create(void) {
+    jit_t *jit = calloc(1, sizeof(jit_t));
+    if (!jit) return NULL;
+
+#ifdef _WIN32
+    jit->code = VirtualAlloc(NULL, JIT_CODE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#else
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED) jit->code = NULL;
+#endif
+    if (!jit->code) {
+        fprintf(stderr, "JIT: 无法分配可执行内存\n");
+        free(jit);
+        return NULL;
+    }
+
+    return jit;
+}
+
+void jit_destroy(jit_t *jit) {
+    if (!jit) return;
+#ifdef _WIN32
+    VirtualFree(jit->code, 0, MEM_RELEASE);
+#else
+    munmap(jit->code, JIT_CODE_SIZE);
+#endif
+    free(jit);
+}
+
+void jit_invalidate(jit_t *jit, const u16 addr, const u16 len) {
+    //addr - 1处的指令也包含了被写的字节; 地址按12位回绕, 写过0xFFF之后接着是页0
+    for (u32 i = 0; i <= len; i++) {
+        if (jit->code_pages & ((u64)1 << (((addr - 1 + i) & 0xFFF) >> 6))) {
+            //自修改代码: 很少见, 直接清空整个缓存
+            jit_flush(jit);
+            return;
+        }
+    }
+}
+
+u32 run_jit(chip8_t *chip8, const config_t config, const u32 count) {
+    if (!chip8->jit) chip8->jit = jit_create();
+    if (!chip8->jit) {
+        //分配不到可执行内存, 退回预解码缓存引擎
+        config_t fallback = config;
+        fallback.engine = ENGINE_CACHED;
+        return run_instructions(chip8, fallback, count);
+    }
+
+    jit_t *jit = chip8->jit;
+    if (jit->quirks != config.quirks) {
+        //已翻译的代码是按原来的配置生成的
+        jit_flush(jit);
+        jit->quirks = config.quirks;
+    }
+    config_t interp = config;   //不能翻译的指令交给预解码缓存引擎, 一次执行一条
+    interp.engine = ENGINE_CACHED;
+    u32 executed = 0;
+
+    while (executed < count) {
+        //PC超出4KB时解释器取指会回绕, 但PC本身不回绕, 这种情况交给解释器
+        if (chip8->PC <= 0xFFF) {
+            jit_entry_t *entry = &jit->entries[chip8->PC];
+            if (!entry->translated) translate_block(jit, chip8, chip8->PC);
+
+            //整个块都在剩余的指令数之内才执行, 保证执行的指令数和解释器完全一致
+            if (entry->insts && entry->insts <= count - executed) {
+                chip8->PC = entry->fn(chip8);
+                executed += entry->insts;
+                continue;
+            }
+        }
+
+        //不能翻译的指令交给解释器
+        //指令中可能要求绘制sprite字体, 一个frame绘制1个sprite
+        const bool draw = (ram_read(chip8, chip8->PC) >> 4) == 0xD;  //chip888
+        executed += run_instructions(chip8, interp, 1);
+        if (draw || chip8->key_wait) break;     //FX0A暂停时也返回
+    }
+
+    return executed;
+}
+
+#else //不是x86-64, JIT不可用, 退回预解码缓存引擎
+
+bool jit_available(void) { return false; }
+jit_t *jit_create(void) { return NULL; }
+void jit_destroy(jit_t *jit) { (void)jit; }
+void jit_invalidate(jit_t *jit, const u16 addr, const u16 len) { (void)jit; (void)addr; (void)len; }
+
+u32 run_jit(chip8_t *chip8, const config_t config, const u32 count) {
+    config_t fallback = config;
+    fallback.engine = ENGINE_CACHED;
+    return run_instructions(chip8, fallback, count);
+}
+
+#endif
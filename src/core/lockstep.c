@@ -0,0 +1,232 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "lockstep.h"
+#include "quirks.h"
+
+//是否有任何一个lane不为0
+static inline bool any_lane(const lane_u16 *v) {
+    u64 words[sizeof(lane_u16) / sizeof(u64)];
+    memcpy(words, v, sizeof words);
+
+    u64 any = 0;
+    for (u32 i = 0; i < sizeof words / sizeof words[0]; i++) any |= words[i];
+    return any != 0;
+}
+
+//所有使用中的lane是否都在pc处, 并且pc处的指令在所有lane中都一样
+static bool in_sync(const lockstep_t *ls, const u16 pc) {
+    const lane_u16 differ = (ls->PC != pc) & ls->active;
+    if (any_lane(&differ)) return false;
+
+    //只有被写过的页才可能在各个lane中不同
+    const u64 pages = ((u64)1 << ((pc & 0xFFF) >> 6)) | ((u64)1 << (((pc + 1) & 0xFFF) >> 6));
+    if (!(ls->written_pages & pages)) return true;
+
+    const u8 hi = ram_read(ls->vm[0], pc), lo = ram_read(ls->vm[0], pc + 1);
+    for (u32 l = 1; l < ls->lanes; l++)
+        if (ram_read(ls->vm[l], pc) != hi || ram_read(ls->vm[l], pc + 1) != lo) return false;
+    return true;
+}
+
+//所有lane一起执行opcode, 不能向量化的指令返回false, 不改变任何状态
+//quirks总是常量, 由run_lockstep按配置生成的各个版本传入
+static inline __attribute__((always_inline)) bool vector_step(lockstep_t *ls, const u16 opcode, const quirks_t quirks) {
+    const u8 X = (opcode >> 8) & 0x0F;
+    const u8 Y = (opcode >> 4) & 0x0F;
+    const u8 N = opcode & 0x0F;
+    const u8 NN = opcode & 0xFF;
+    const u16 NNN = opcode & 0x0FFF;
+    lane_u8 *V = ls->V;
+    lane_u8 carry;
+    lane_u8 source; //8XY6/8XYE移位的值
+    lane_u8 skip;   //比较的结果, 0xFF的lane跳过下一条指令
+
+    switch (opcode >> 12) {
+    case 0x0:
+        if (NN == 0xE0 || NN == 0xEE) return false;
+        if (X == 0 && ((NN & 0xF0) == 0xC0 || (NN & 0xF0) == 0xD0 || NN >= 0xFB)) return false;  //滚屏, 切换分辨率
+        ls->PC += 2;    //什么也不做
+        return true;
+    case 0x1:
+        ls->PC = (lane_u16){0} + NNN;
+        return true;
+    case 0x3: skip = (lane_u8)(V[X] == NN); break;
+    case 0x4: skip = (lane_u8)(V[X] != NN); break;
+    case 0x5:
+        if (N != 0) return false;
+        skip = (lane_u8)(V[X] == V[Y]);
+        break;
+    case 0x9:
+        if (N != 0) return false;
+        skip = (lane_u8)(V[X] != V[Y]);
+        break;
+    case 0x6: V[X] = (lane_u8){0} + NN; ls->PC += 2; return true;
+    case 0x7: V[X] += NN; ls->PC += 2; return true;
+    case 0xA: ls->I = (lane_u16){0} + NNN; ls->PC += 2; return true;
+    case 0x8:
+        //先用原来的值算出VF, 再写VX, 最后写VF, 和emulate_instruction的顺序一致
+        switch (N) {
+        case 0x0: V[X] = V[Y]; break;
+        case 0x1: V[X] |= V[Y]; if (quirks.vf_reset) V[0xF] = (lane_u8){0}; break;   //chip888
+        case 0x2: V[X] &= V[Y]; if (quirks.vf_reset) V[0xF] = (lane_u8){0}; break;   //chip888
+        case 0x3: V[X] ^= V[Y]; if (quirks.vf_reset) V[0xF] = (lane_u8){0}; break;   //chip888
+        case 0x4:
+            carry = (lane_u8)((lane_u8)(V[X] + V[Y]) < V[X]) & 1;
+            V[X] += V[Y];
+            V[0xF] = carry;
+            break;
+        case 0x5:
+            carry = (lane_u8)(V[X] >= V[Y]) & 1;
+            V[X] -= V[Y];
+            V[0xF] = carry;
+            break;
+        case 0x6:
+            source = quirks.shift_vy ? V[Y] : V[X];    //chip888
+            carry = source & 1;
+            V[X] = source >> 1;
+            V[0xF] = carry;
+            break;
+        case 0x7:
+            carry = (lane_u8)(V[X] <= V[Y]) & 1;
+            V[X] = V[Y] - V[X];
+            V[0xF] = carry;
+            break;
+        case 0xE:
+            source = quirks.shift_vy ? V[Y] : V[X];    //chip888
+            carry = source >> 7;
+            V[X] = source << 1;
+            V[0xF] = carry;
+            break;
+        default: break; //什么也不做
+        }
+        ls->PC += 2;
+        return true;
+    default:
+        return false;
+    }
+
+    //跳过: 条件成立的lane PC + 4, 否则PC + 2, lane可能从这里开始分叉
+    ls->PC += 2 + (__builtin_convertvector(skip, lane_u16) & 2);
+    return true;
+}
+
+#define MAX_BURST 256   //分叉后逐lane一次最多执行的指令数
+
+//一个lane单独执行count条指令: 寄存器写进它的chip8_t, 用预解码缓存引擎执行, 再读回来
+static void scalar_run(lockstep_t *ls, const config_t config, const u32 lane, const u32 count) {
+    chip8_t *vm = ls->vm[lane];
+
+    for (u8 x = 0; x < 16; x++) vm->V[x] = ls->V[x][lane];
+    vm->I = ls->I[lane];
+    vm->PC = ls->PC[lane];
+    vm->delay_timer = ls->delay_timer[lane];
+    vm->sound_timer = ls->sound_timer[lane];
+
+    for (u32 done = 0; done < count; ) done += run_instructions(vm, config, count - done); //DXYN会让它提前返回
+
+    for (u8 x = 0; x < 16; x++) ls->V[x][lane] = vm->V[x];
+    ls->I[lane] = vm->I;
+    ls->PC[lane] = vm->PC;
+    ls->delay_timer[lane] = vm->delay_timer;
+    ls->sound_timer[lane] = vm->sound_timer;
+    ls->written_pages |= vm->written_pages;
+}
+
+bool init_lockstep(lockstep_t *ls, const config_t config, const char rom_name[], const u32 lanes) {
+    memset(ls, 0, sizeof(lockstep_t));
+
+    //所有lane共享同一个内存镜像, 只有被写过的页各自复制
+    ls->image = load_rom_image(rom_name);
+    if (!ls->image) return false;
+    ls->lanes = (lanes > LOCKSTEP_LANES) ? LOCKSTEP_LANES : lanes;
+
+    for (u32 l = 0; l < ls->lanes; l++) {
+        config_t lane_config = config;
+        lane_config.seed = config.seed + l;   //每个lane的CXNN取到不同的随机数
+
+        ls->vm[l] = calloc(1, sizeof(chip8_t));
+        if (!ls->vm[l]) {
+            destroy_lockstep(ls);
+            return false;
+        }
+        init_chip8_shared(ls->vm[l], lane_config, ls->image, rom_name);
+
+        const chip8_t *vm = ls->vm[l];
+        for (u8 x = 0; x < 16; x++) ls->V[x][l] = vm->V[x];
+        ls->I[l] = vm->I;
+        ls->PC[l] = vm->PC;
+        ls->delay_timer[l] = vm->delay_timer;
+        ls->sound_timer[l] = vm->sound_timer;
+        ls->active[l] = 0xFFFF;
+    }
+
+    return true;
+}
+
+void destroy_lockstep(lockstep_t *ls) {
+    for (u32 l = 0; l < LOCKSTEP_LANES; l++) {
+        if (ls->vm[l]) free_chip8(ls->vm[l]);
+        free(ls->vm[l]);
+        ls->vm[l] = NULL;
+    }
+    free_rom_image(ls->image);
+    ls->image = NULL;
+    ls->lanes = 0;
+}
+
+static inline __attribute__((always_inline))
+void lockstep_loop(lockstep_t *ls, const config_t config, const u32 steps, const quirks_t quirks) {
+    config_t interp = config;   //逐lane执行时用预解码缓存引擎
+    interp.engine = ENGINE_CACHED;
+
+    //需要逐lane执行时每次执行burst条指令, 连续逐lane执行就加倍, 减少寄存器搬运的次数
+    //所有lane执行的指令数始终相同, 汇合最多晚burst条指令被发现
+    u32 burst = 1;
+
+    for (u32 step = 0; step < steps; ) {
+        const u16 pc = ls->PC[0];
+        u32 count;
+
+        if (in_sync(ls, pc)) {
+            const u16 opcode = (ram_read(ls->vm[0], pc) << 8) | ram_read(ls->vm[0], pc + 1);
+            if (vector_step(ls, opcode, quirks)) {
+                ls->vector_steps++;
+                step++;
+                burst = 1;
+                continue;
+            }
+        }
+
+        //分叉了, 或者一直停在不能向量化的指令上(比如FX0A等待按键)
+        count = (burst < steps - step) ? burst : steps - step;
+        if (burst < MAX_BURST) burst *= 2;
+
+        for (u32 l = 0; l < ls->lanes; l++) scalar_run(ls, interp, l, count);
+        ls->scalar_steps += count;
+        step += count;
+    }
+}
+
+//按兼容性配置选一个版本, 每个版本里对quirks的判断在编译时就确定了
+void run_lockstep(lockstep_t *ls, const config_t config, const u32 steps) {
+    if (ls->lanes == 0) return;
+
+    switch (config.quirks) {
+    case QUIRKS_CHIP48: lockstep_loop(ls, config, steps, quirks_of[QUIRKS_CHIP48]); break;
+    case QUIRKS_SCHIP: lockstep_loop(ls, config, steps, quirks_of[QUIRKS_SCHIP]); break;
+    case QUIRKS_XOCHIP: lockstep_loop(ls, config, steps, quirks_of[QUIRKS_XOCHIP]); break;
+    default: lockstep_loop(ls, config, steps, quirks_of[QUIRKS_VIP]); break;
+    }
+}
+
+chip8_t *lockstep_lane(lockstep_t *ls, const u32 lane) {
+    chip8_t *vm = ls->vm[lane];
+
+    for (u8 x = 0; x < 16; x++) vm->V[x] = ls->V[x][lane];
+    vm->I = ls->I[lane];
+    vm->PC = ls->PC[lane];
+    vm->delay_timer = ls->delay_timer[lane];
+    vm->sound_timer = ls->sound_timer[lane];
+    return vm;
+}
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#endif
+
+#include "chip8.h"
+#include "metrics.h"
+
+//标签值里的反斜杠, 双引号和换行要转义
+static void print_label(FILE *out, const char value[]) {
+    for (const char *c = value; *c; c++) {
+        if (*c == '\\' || *c == '"') fputc('\\', out);
+        if (*c == '\n') fputs("\\n", out);
+        else fputc(*c, out);
+    }
+}
+
+static void print_counter(FILE *out, const char name[], const char help[], const char rom_name[], const u64 value) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s{rom=\"", name, help, name, name);
+    print_label(out, rom_name);
+    fprintf(out, "\"} %llu\n", (unsigned long long)value);
+}
+
+static void print_metrics(FILE *out, const metrics_t *m, const char rom_name[]) {
+    fputs("# HELP chip8_instructions_total Instructions executed, by opcode class.\n"
+          "# TYPE chip8_instructions_total counter\n", out);
+    for (u8 op = 0; op < METRICS_CLASSES; op++) {
+        const char *name = op_class_name(op);
+        if (!name) continue;
+        fputs("chip8_instructions_total{rom=\"", out);
+        print_label(out, rom_name);
+        fprintf(out, "\",class=\"%s\"} %llu\n", name, (unsigned long long)m->classes[op]);
+    }
+
+    fputs("# HELP chip8_fused_total Superinstructions dispatched by the pre-decoded engine, by fused sequence.\n"
+          "# TYPE chip8_fused_total counter\n", out);
+    for (u8 kind = 0; kind < METRICS_FUSIONS; kind++) {
+        const char *name = fusion_name(kind);
+        if (!name) continue;
+        fputs("chip8_fused_total{rom=\"", out);
+        print_label(out, rom_name);
+        fprintf(out, "\",sequence=\"%s\"} %llu\n", name, (unsigned long long)m->fused[kind]);
+    }
+
+    //没执行过的地址不输出, 否则每次都是4096行
+    fputs("# HELP chip8_pc_instructions_total Instructions executed, by address.\n"
+          "# TYPE chip8_pc_instructions_total counter\n", out);
+    for (u16 pc = 0; pc < 4096; pc++) {
+        if (!m->pc[pc]) continue;
+        fputs("chip8_pc_instructions_total{rom=\"", out);
+        print_label(out, rom_name);
+        fprintf(out, "\",pc=\"0x%03X\"} %llu\n", pc, (unsigned long long)m->pc[pc]);
+    }
+
+    print_counter(out, "chip8_sprites_total", "DXYN instructions executed.", rom_name, m->sprites);
+    print_counter(out, "chip8_sprite_rows_total", "Sprite rows drawn on screen.", rom_name, m->sprite_rows);
+    print_counter(out, "chip8_sprite_pixels_total", "Sprite pixels XORed onto the screen.", rom_name, m->sprite_pixels);
+    print_counter(out, "chip8_sprite_collisions_total", "DXYN instructions that set VF.", rom_name, m->collisions);
+    print_counter(out, "chip8_timer_ticks_total", "60Hz timer ticks.", rom_name, m->ticks);
+    print_counter(out, "chip8_delay_timer_ticks_total", "Timer ticks with the delay timer running.", rom_name, m->delay_ticks);
+    print_counter(out, "chip8_sound_timer_ticks_total", "Timer ticks with the sound timer running.", rom_name, m->sound_ticks);
+    print_counter(out, "chip8_display_wait_cycles_total", "Cycles spent waiting for the display.", rom_name, m->wait_cycles);
+    print_counter(out, "chip8_key_wait_cycles_total", "Cycles spent suspended in FX0A waiting for a key.", rom_name,
+                  m->key_wait_cycles);
+    print_counter(out, "chip8_frames_total", "Frames presented by the frontend.", rom_name, m->frames);
+    print_counter(out, "chip8_dirty_frames_total", "Frames in which the display changed.", rom_name, m->dirty_frames);
+    print_counter(out, "chip8_dirty_rows_total", "Display rows changed, summed over frames.", rom_name, m->dirty_rows);
+    print_counter(out, "chip8_dirty_pixels_total", "Pixels in the changed rows and columns, summed over frames.", rom_name,
+                  m->dirty_pixels);
+    print_counter(out, "chip8_screen_pixels_total", "Pixels on the whole screen, summed over frames.", rom_name, m->screen_pixels);
+}
+
+//连接Unix socket, 把统计发过去
+static bool send_metrics(const metrics_t *metrics, const char rom_name[], const char path[]) {
+#ifdef _WIN32
+    (void)metrics;
+    (void)rom_name;
+    fprintf(stderr, "统计: 这个平台不支持Unix socket: %s\n", path);
+    return false;
+#else
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof addr.sun_path) {
+        fprintf(stderr, "统计: socket路径太长: %s\n", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof addr) != 0) {
+        fprintf(stderr, "统计: 无法连接 %s\n", path);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+
+    //先在内存里生成, 再用send发送: 对方提前关闭时不会收到SIGPIPE
+    char *text = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&text, &size);
+    if (!out) {
+        close(fd);
+        return false;
+    }
+    print_metrics(out, metrics, rom_name);
+    fclose(out);
+
+    bool ok = true;
+    for (size_t sent = 0; ok && sent < size; ) {
+        const ssize_t n = send(fd, text + sent, size - sent, MSG_NOSIGNAL);
+        if (n > 0) sent += (size_t)n;
+        else ok = false;
+    }
+    if (!ok) fprintf(stderr, "统计: 发送到 %s 失败\n", path);
+    free(text);
+    close(fd);
+    return ok;
+#endif
+}
+
+bool write_metrics(const metrics_t *metrics, const char rom_name[], const char dest[]) {
+    if (strncmp(dest, "unix:", strlen("unix:")) == 0) return send_metrics(metrics, rom_name, dest + strlen("unix:"));
+
+    char tmp[1024];
+    snprintf(tmp, sizeof tmp, "%s.tmp", dest);
+    FILE *out = fopen(tmp, "w");
+    if (!out) {
+        fprintf(stderr, "统计: %s 无法写入\n", tmp);
+        return false;
+    }
+    print_metrics(out, metrics, rom_name);
+    if (fclose(out) != 0) {
+        fprintf(stderr, "统计: %s 写入失败\n", tmp);
+        remove(tmp);
+        return false;
+    }
+
+#ifdef _WIN32
+    const bool ok = MoveFileExA(tmp, dest, MOVEFILE_REPLACE_EXISTING);
+#else
+    const bool ok = rename(tmp, dest) == 0;
+#endif
+    if (!ok) fprintf(stderr, "统计: 无法替换 %s\n", dest);
+    return ok;
+}
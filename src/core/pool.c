@@ -0,0 +1,124 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+#define OBJECTS_PER_SLAB 256    //每次向系统申请这么多个对象
+
+//一种大小的对象
+typedef struct {
+    size_t size;
+    void *free_list;    //空闲对象的链表, 链接指针存在对象本身的开头
+    void **slabs;       //申请过的所有slab, 销毁池时释放
+    u32 slab_count;
+    u32 slab_capacity;
+    u32 live;
+} slab_class_t;
+
+enum { CLASS_CHIP8, CLASS_RAM_PAGE, CLASS_DECODED_PAGE, CLASS_SCREEN, CLASS_COUNT };
+
+struct chip8_pool {
+    slab_class_t classes[CLASS_COUNT];
+};
+
+//向系统申请一个新的slab, 切成对象放进空闲链表
+static bool grow(slab_class_t *c) {
+    if (c->slab_count == c->slab_capacity) {
+        const u32 capacity = c->slab_capacity ? c->slab_capacity * 2 : 16;
+        void **slabs = realloc(c->slabs, capacity * sizeof(void *));
+        if (!slabs) return false;
+        c->slabs = slabs;
+        c->slab_capacity = capacity;
+    }
+
+    u8 *slab = malloc(c->size * OBJECTS_PER_SLAB);
+    if (!slab) return false;
+    c->slabs[c->slab_count++] = slab;
+
+    for (u32 i = 0; i < OBJECTS_PER_SLAB; i++) {
+        void *object = slab + i * c->size;
+        *(void **)object = c->free_list;
+        c->free_list = object;
+    }
+    return true;
+}
+
+static void *class_alloc(slab_class_t *c) {
+    if (!c->free_list && !grow(c)) return NULL;
+
+    void *object = c->free_list;
+    c->free_list = *(void **)object;
+    c->live++;
+    return object;
+}
+
+static void class_free(slab_class_t *c, void *object) {
+    *(void **)object = c->free_list;
+    c->free_list = object;
+    c->live--;
+}
+
+static slab_class_t *class_of(chip8_pool_t *pool, const size_t size) {
+    for (u32 i = 0; i < CLASS_COUNT; i++)
+        if (pool->classes[i].size == size) return &pool->classes[i];
+    return NULL;
+}
+
+chip8_pool_t *create_pool(void) {
+    chip8_pool_t *pool = calloc(1, sizeof(chip8_pool_t));
+    if (!pool) return NULL;
+
+    pool->classes[CLASS_CHIP8].size = sizeof(chip8_t);
+    pool->classes[CLASS_RAM_PAGE].size = PAGE_SIZE;
+    pool->classes[CLASS_DECODED_PAGE].size = PAGE_SIZE * sizeof(decoded_t);
+    pool->classes[CLASS_SCREEN].size = sizeof(screen_t);
+    return pool;
+}
+
+void destroy_pool(chip8_pool_t *pool) {
+    if (!pool) return;
+
+    for (u32 i = 0; i < CLASS_COUNT; i++) {
+        for (u32 s = 0; s < pool->classes[i].slab_count; s++) free(pool->classes[i].slabs[s]);
+        free(pool->classes[i].slabs);
+    }
+    free(pool);
+}
+
+chip8_t *pool_alloc_chip8(chip8_pool_t *pool) {
+    chip8_t *chip8 = class_alloc(&pool->classes[CLASS_CHIP8]);
+    if (!chip8) return NULL;
+
+    memset(chip8, 0, sizeof(chip8_t));
+    chip8->pool = pool;
+    return chip8;
+}
+
+void pool_free_chip8(chip8_pool_t *pool, chip8_t *chip8) {
+    free_chip8(chip8);
+    class_free(&pool->classes[CLASS_CHIP8], chip8);
+}
+
+void *pool_alloc(chip8_pool_t *pool, const size_t size) {
+    if (!pool) return malloc(size);
+
+    slab_class_t *c = class_of(pool, size);
+    return c ? class_alloc(c) : malloc(size);
+}
+
+void pool_free(chip8_pool_t *pool, void *object, const size_t size) {
+    slab_class_t *c = pool ? class_of(pool, size) : NULL;
+    if (c) class_free(c, object);
+    else free(object);
+}
+
+pool_stats_t pool_stats(const chip8_pool_t *pool) {
+    pool_stats_t stats = {0};
+
+    for (u32 i = 0; i < CLASS_COUNT; i++)
+        stats.reserved_bytes += (size_t)pool->classes[i].slab_count * OBJECTS_PER_SLAB * pool->classes[i].size;
+    stats.live_chip8 = pool->classes[CLASS_CHIP8].live;
+    stats.live_ram_pages = pool->classes[CLASS_RAM_PAGE].live;
+    stats.live_decoded_pages = pool->classes[CLASS_DECODED_PAGE].live;
+    return stats;
+}
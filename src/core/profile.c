@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "profile.h"
+
+#define PROFILE_INITIAL 256     //哈希表一开始的大小, 2的幂
+
+bool init_profile(profile_t *profile, const u32 period) {
+    *profile = (profile_t){ .period = period ? period : 1, .capacity = PROFILE_INITIAL };
+    profile->countdown = profile->period;
+    profile->stacks = calloc(profile->capacity, sizeof(profile_stack_t));
+    if (!profile->stacks) {
+        fprintf(stderr, "采样: 内存不足\n");
+        return false;
+    }
+    return true;
+}
+
+void free_profile(profile_t *profile) {
+    free(profile->stacks);
+    profile->stacks = NULL;
+}
+
+//找到key所在的格子, 没有的话是它应该放的空格子
+static profile_stack_t *find_stack(profile_stack_t *stacks, const u32 capacity, const profile_key_t *key) {
+    u32 i = (u32)hash_bytes(key, sizeof *key) & (capacity - 1);
+    while (stacks[i].samples && memcmp(&stacks[i].key, key, sizeof *key) != 0) i = (i + 1) & (capacity - 1);
+    return &stacks[i];
+}
+
+//装到3/4就扩大一倍; 分配不到就继续用原来的, 还没满
+static void grow_profile(profile_t *profile) {
+    const u32 capacity = profile->capacity * 2;
+    profile_stack_t *stacks = calloc(capacity, sizeof(profile_stack_t));
+    if (!stacks) return;
+
+    for (u32 i = 0; i < profile->capacity; i++)
+        if (profile->stacks[i].samples) *find_stack(stacks, capacity, &profile->stacks[i].key) = profile->stacks[i];
+    free(profile->stacks);
+    profile->stacks = stacks;
+    profile->capacity = capacity;
+}
+
+void profile_sample(profile_t *profile, const chip8_t *chip8) {
+    profile_key_t key = {0};
+    const u8 calls = chip8->SP < PROFILE_DEPTH ? chip8->SP : PROFILE_DEPTH - 1;
+
+    key.depth = calls + 1;
+    key.entry[0] = 0x200;   //最外层是ROM的入口
+    for (u8 i = 0; i < calls; i++) {
+        const u16 site = (chip8->stk[i] - 2) & 0xFFF;
+        const u16 opcode = (ram_read(chip8, site) << 8) | ram_read(chip8, site + 1);
+        key.at[i] = site;
+        key.entry[i + 1] = (opcode >> 12 == 0x2) ? opcode & 0x0FFF : 0xFFFF;
+    }
+    key.at[calls] = chip8->PC & 0xFFF;
+
+    profile->countdown = profile->period;
+    profile->samples++;
+    if (profile->used + 1 > profile->capacity / 4 * 3) grow_profile(profile);
+    if (profile->used == profile->capacity - 1) return;     //满了, 只数总数
+
+    profile_stack_t *stack = find_stack(profile->stacks, profile->capacity, &key);
+    if (!stack->samples) {
+        stack->key = key;
+        profile->used++;
+    }
+    stack->samples++;
+}
+
+typedef struct {
+    u16 addr;
+    char name[64];
+} label_t;
+
+static int compare_labels(const void *a, const void *b) {
+    return (int)((const label_t *)a)->addr - (int)((const label_t *)b)->addr;
+}
+
+//折叠栈的一行: 调用栈的名字和采样数
+typedef struct {
+    char *text;
+    u64 samples;
+} folded_t;
+
+static int compare_text(const void *a, const void *b) {
+    return strcmp(((const folded_t *)a)->text, ((const folded_t *)b)->text);
+}
+
+static int compare_samples(const void *a, const void *b) {
+    const u64 x = ((const folded_t *)a)->samples, y = ((const folded_t *)b)->samples;
+    return (x < y) - (x > y);   //多的在前
+}
+
+//读符号表, 按地址排序; 返回标签数, 失败返回-1
+static int load_labels(const char path[], label_t **labels) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "采样: 符号表 %s 打开失败\n", path);
+        return -1;
+    }
+
+    int count = 0, capacity = 0;
+    char line[256];
+    *labels = NULL;
+    while (fgets(line, sizeof line, file)) {
+        unsigned addr;
+        char name[64];
+        if (line[0] == '#' || sscanf(line, "%x %63s", &addr, name) != 2) continue;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            label_t *grown = realloc(*labels, capacity * sizeof(label_t));
+            if (!grown) break;
+            *labels = grown;
+        }
+        (*labels)[count].addr = addr & 0xFFF;
+        snprintf((*labels)[count].name, sizeof (*labels)[count].name, "%s", name);
+        for (char *c = (*labels)[count].name; *c; c++) if (*c == ';') *c = '_';  //分号是折叠栈的分隔符
+        count++;
+    }
+    fclose(file);
+
+    if (count) qsort(*labels, count, sizeof(label_t), compare_labels);
+    return count;
+}
+
+//第level层的名字写进buf: 有符号表时是地址不超过它位置的最近一个标签, 否则是函数入口
+static int frame_name(char *buf, const size_t size, const profile_key_t *key, const u16 level,
+                      const label_t *labels, const int count) {
+    int found = -1;
+    for (int lo = 0, hi = count - 1; lo <= hi; ) {
+        const int mid = (lo + hi) / 2;
+        if (labels[mid].addr <= key->at[level]) found = mid, lo = mid + 1;
+        else hi = mid - 1;
+    }
+
+    if (found >= 0) return snprintf(buf, size, "%s", labels[found].name);
+    if (key->entry[level] == 0xFFFF) return snprintf(buf, size, "call_%03X", key->at[level - 1]);
+    return snprintf(buf, size, "sub_%03X", key->entry[level]);
+}
+
+//一种调用栈的名字, 各层用分号隔开; 返回malloc的字符串
+static char *stack_text(const profile_key_t *key, const label_t *labels, const int count) {
+    char buf[PROFILE_DEPTH * sizeof(((label_t *)0)->name)];     //每层最多一个标签名加分号
+    size_t len = 0;
+    for (u16 level = 0; level < key->depth; level++) {
+        if (level) buf[len++] = ';';
+        len += frame_name(&buf[len], sizeof buf - len, key, level, labels, count);
+    }
+    char *text = malloc(len + 1);
+    if (text) memcpy(text, buf, len + 1);
+    return text;
+}
+
+bool save_profile(const profile_t *profile, const char path[], const char labels_file[]) {
+    label_t *labels = NULL;
+    int count = 0;
+    if (labels_file && (count = load_labels(labels_file, &labels)) < 0) return false;
+
+    //同一个函数里不同位置的调用栈名字一样, 按名字合并
+    folded_t *lines = malloc((profile->used ? profile->used : 1) * sizeof(folded_t));
+    u32 n = 0;
+    bool ok = lines != NULL;
+    for (u32 i = 0; ok && i < profile->capacity; i++) {
+        if (!profile->stacks[i].samples) continue;
+        lines[n] = (folded_t){ stack_text(&profile->stacks[i].key, labels, count), profile->stacks[i].samples };
+        ok = lines[n++].text != NULL;
+    }
+    free(labels);
+    if (!ok) {
+        fprintf(stderr, "采样: 内存不足\n");
+        for (u32 i = 0; lines && i < n; i++) free(lines[i].text);
+        free(lines);
+        return false;
+    }
+
+    qsort(lines, n, sizeof(folded_t), compare_text);
+    u32 merged = 0;
+    for (u32 i = 0; i < n; i++) {
+        if (merged && strcmp(lines[merged - 1].text, lines[i].text) == 0) {
+            lines[merged - 1].samples += lines[i].samples;
+            free(lines[i].text);
+        }
+        else lines[merged++] = lines[i];
+    }
+    qsort(lines, merged, sizeof(folded_t), compare_samples);    //按采样数从多到少, 直接看文件也能看出热点
+
+    FILE *file = fopen(path, "w");
+    if (!file) fprintf(stderr, "采样: %s 无法写入\n", path);
+    for (u32 i = 0; i < merged; i++) {
+        if (file) fprintf(file, "%s %llu\n", lines[i].text, (unsigned long long)lines[i].samples);
+        free(lines[i].text);
+    }
+    free(lines);
+    if (!file) return false;
+
+    ok = fclose(file) == 0;
+    if (!ok) fprintf(stderr, "采样: %s 写入失败\n", path);
+    return ok;
+}
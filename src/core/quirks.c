@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "quirks.h"
+
+static const char *const profile_names[QUIRKS_COUNT] = {
+    [QUIRKS_VIP] = "vip", [QUIRKS_CHIP48] = "chip48", [QUIRKS_SCHIP] = "schip", [QUIRKS_XOCHIP] = "xochip",
+};
+
+const char *quirks_name(const quirks_profile_t profile) {
+    return profile < QUIRKS_COUNT ? profile_names[profile] : "unknown";
+}
+
+bool parse_quirks(const char name[], quirks_profile_t *profile) {
+    for (quirks_profile_t p = 0; p < QUIRKS_COUNT; p++) {
+        if (strcmp(name, profile_names[p]) == 0) {
+            *profile = p;
+            return true;
+        }
+    }
+    return false;
+}
+
+//ROM文件内容的hash_bytes, 和载入位置, 字体无关; 失败返回false
+static bool hash_rom_file(const char rom_name[], u64 *hash) {
+    FILE *rom = fopen(rom_name, "rb");
+    if (!rom) {
+        fprintf(stderr, "兼容性配置: 游戏 %s 打开失败\n", rom_name);
+        return false;
+    }
+    u8 buf[4096];
+    const size_t size = fread(buf, 1, sizeof buf, rom);
+    fclose(rom);
+
+    *hash = hash_bytes(buf, size);
+    return true;
+}
+
+bool lookup_quirks(const char db_file[], const char rom_name[], quirks_profile_t *profile) {
+    u64 hash;
+    if (!hash_rom_file(rom_name, &hash)) return false;
+
+    FILE *file = fopen(db_file, "r");
+    if (!file) {
+        fprintf(stderr, "兼容性配置: 数据库 %s 打开失败\n", db_file);
+        return false;
+    }
+
+    char line[256];
+    u32 line_no = 0;
+    bool ok = true, found = false;
+    while (!found && fgets(line, sizeof line, file)) {
+        unsigned long long key;
+        char name[32];
+        line_no++;
+        if (line[0] == '#' || sscanf(line, "%llx %31s", &key, name) != 2 || key != hash) continue;
+        found = true;
+        if (!parse_quirks(name, profile)) {
+            fprintf(stderr, "兼容性配置: 数据库 %s 第%u行不认识的配置: %s\n", db_file, line_no, name);
+            ok = false;
+        }
+    }
+    fclose(file);
+
+    //没有记录的ROM照常运行, 告诉使用者它的hash, 方便加进数据库
+    if (!found) fprintf(stderr, "兼容性配置: 数据库 %s 里没有 %s (%016llx), 使用 %s\n",
+                        db_file, rom_name, (unsigned long long)hash, quirks_name(*profile));
+    return ok;
+}
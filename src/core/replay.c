@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chip8.h"
+#include "savestate.h"
+#include "replay.h"
+#include "scheduler.h"
+#include "profile.h"
+#include "quirks.h"
+
+bool start_recording(recorder_t *rec, const char path[], const chip8_t *chip8, const config_t config) {
+    *rec = (recorder_t){0};
+    rec->file = fopen(path, "w");
+    if (!rec->file) {
+        fprintf(stderr, "录像: %s 无法写入\n", path);
+        return false;
+    }
+
+    fprintf(rec->file, "seed %u\n", config.seed);
+    fprintf(rec->file, "rom %016llx\n", (unsigned long long)chip8->image->hash);
+    fprintf(rec->file, "ips %u\n", config.insts_per_second);
+    fprintf(rec->file, "display-wait %d\n", config.display_wait);
+    fprintf(rec->file, "quirks %s\n", quirks_name(config.quirks));
+    if (config.state_file) fprintf(rec->file, "state %s\n", config.state_file);
+    memcpy(rec->keypad, chip8->keypad, sizeof rec->keypad);
+    return true;
+}
+
+void record_keypad(recorder_t *rec, const chip8_t *chip8) {
+    if (!rec->file) return;
+
+    for (u8 key = 0; key < 16; key++) {
+        if (chip8->keypad[key] == rec->keypad[key]) continue;
+        fprintf(rec->file, "%llu %c%X\n", (unsigned long long)rec->cycle, chip8->keypad[key] ? '+' : '-', key);
+        rec->keypad[key] = chip8->keypad[key];
+    }
+}
+
+//重置和载入存档都会改掉按键, 之后的变化从虚拟机现在的按键算起
+void record_reset(recorder_t *rec, const chip8_t *chip8) {
+    if (!rec->file) return;
+    fprintf(rec->file, "%llu reset\n", (unsigned long long)rec->cycle);
+    memcpy(rec->keypad, chip8->keypad, sizeof rec->keypad);
+}
+
+void record_load(recorder_t *rec, const chip8_t *chip8, const char state_file[]) {
+    if (!rec->file) return;
+    fprintf(rec->file, "%llu load %s\n", (unsigned long long)rec->cycle, state_file);
+    memcpy(rec->keypad, chip8->keypad, sizeof rec->keypad);
+}
+
+void stop_recording(recorder_t *rec, const chip8_t *chip8) {
+    if (!rec->file) return;
+    fprintf(rec->file, "end %llu %016llx\n", (unsigned long long)rec->cycle, (unsigned long long)hash_state(chip8));
+    fclose(rec->file);
+    rec->file = NULL;
+}
+
+//运行到第cycle个周期为止
+static void run_until(scheduler_t *sched, chip8_t *chip8, const config_t config, u64 *executed, const u64 cycle) {
+    if (cycle > sched->cycle) *executed += run_scheduled(sched, chip8, config, cycle - sched->cycle);
+}
+
+bool run_replay(const char path[], const config_t config, const char rom_name[]) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "录像: %s 打开失败\n", path);
+        return false;
+    }
+
+    config_t recorded = config;  //种子和调度器的设置用录像里的
+    static chip8_t chip8;
+    static profile_t profile;   //--profile: 回放不限速, 采样分析用它最快
+    scheduler_t sched;
+    char line[1024], state_file[1024] = "";
+    unsigned long long rom_hash = 0;
+    u64 executed = 0;
+    u32 line_no = 0;
+    bool started = false, ended = false, ok = false;
+    const clock_t start = clock();
+
+    while (fgets(line, sizeof line, file)) {
+        line_no++;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '#' || line[0] == '\0') continue;
+
+        //文件头: 第一个事件之前的几行
+        if (strncmp(line, "seed ", 5) == 0) {
+            recorded.seed = (u32)strtoul(&line[5], NULL, 10);
+            continue;
+        }
+        if (strncmp(line, "rom ", 4) == 0) {
+            rom_hash = strtoull(&line[4], NULL, 16);
+            continue;
+        }
+        if (strncmp(line, "ips ", 4) == 0) {
+            recorded.insts_per_second = (u32)strtoul(&line[4], NULL, 10);
+            continue;
+        }
+        if (strncmp(line, "display-wait ", 13) == 0) {
+            recorded.display_wait = strtoul(&line[13], NULL, 10) != 0;
+            continue;
+        }
+        if (strncmp(line, "quirks ", 7) == 0) {
+            if (!parse_quirks(&line[7], &recorded.quirks)) {
+                fprintf(stderr, "录像: %s 第%u行不认识的兼容性配置: %s\n", path, line_no, &line[7]);
+                break;
+            }
+            continue;
+        }
+        if (strncmp(line, "state ", 6) == 0) {
+            snprintf(state_file, sizeof state_file, "%s", &line[6]);
+            continue;
+        }
+
+        //第一个事件之前按文件头创建虚拟机
+        if (!started) {
+            if (!init_chip8(&chip8, recorded, rom_name)) break;
+            if (chip8.image->hash != rom_hash) {
+                fprintf(stderr, "录像: %s 不是游戏 %s 的录像\n", path, rom_name);
+                break;
+            }
+            if (state_file[0] && !load_state_file(&chip8, state_file)) break;
+            init_scheduler(&sched, recorded);
+            if (config.profile_file) {
+                if (!init_profile(&profile, config.profile_period)) break;
+                chip8.profile = &profile;
+            }
+            started = true;
+        }
+
+        unsigned long long cycle, hash;
+        int arg = 0;
+        if (sscanf(line, "end %llu %llx", &cycle, &hash) == 2) {
+            run_until(&sched, &chip8, recorded, &executed, cycle);
+            const double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+            const u64 final_hash = hash_state(&chip8);
+            ok = (final_hash == hash);
+            ended = true;
+            printf("回放: %llu 条指令(实时运行 %.1f 秒), 耗时 %.3f 秒, 每秒 %.0f 条; 最终状态 %016llx, %s\n",
+                   (unsigned long long)executed, sched.ticks / 60.0, seconds, seconds > 0 ? executed / seconds : 0.0,
+                   (unsigned long long)final_hash, ok ? "和录像一致" : "和录像不一致!");
+            break;
+        }
+        if (sscanf(line, "%llu %n", &cycle, &arg) != 1) {
+            fprintf(stderr, "录像: %s 第%u行格式不对\n", path, line_no);
+            break;
+        }
+
+        run_until(&sched, &chip8, recorded, &executed, cycle);
+        const char *event = &line[arg];
+        if ((event[0] == '+' || event[0] == '-') && event[1]) chip8.keypad[strtoul(&event[1], NULL, 16) & 0xF] = (event[0] == '+');
+        else if (strcmp(event, "reset") == 0) init_chip8(&chip8, recorded, rom_name);
+        else if (strncmp(event, "load ", 5) == 0) {
+            if (!load_state_file(&chip8, &event[5])) break;
+        }
+        else {
+            fprintf(stderr, "录像: %s 第%u行不认识的事件: %s\n", path, line_no, event);
+            break;
+        }
+    }
+
+    if (!ended && feof(file)) fprintf(stderr, "录像: %s 没有end行, 可能没有正常结束录像\n", path);
+    fclose(file);
+    if (chip8.profile) {
+        if (save_profile(&profile, config.profile_file, config.labels_file))
+            printf("采样: %llu 次, %u 种调用栈, 已保存到 %s\n", (unsigned long long)profile.samples, profile.used, config.profile_file);
+        free_profile(&profile);
+        chip8.profile = NULL;
+    }
+    free_chip8(&chip8);
+    return ok;
+}
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chip8.h"
+#include "savestate.h"
+#include "rewind.h"
+
+//压缩格式: 若干段[u16跳过的字节数][u16长度][长度个异或后的字节], 段之间的跳过是相对上一段的结尾
+//相同的字节少于MIN_GAP个时并进前一段, 不值得为它开一个4字节的段头
+#define MIN_GAP 4
+
+//每个段头后面至少跟着1个不同的字节, 再隔至少MIN_GAP个相同的字节才有下一个段头, 所以压缩后不会比原来多出4字节以上
+#define SCRATCH_SIZE (sizeof(savestate_t) + 4)
+
+static u64 now_ns(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+bool init_rewind(rewind_t *rw, const u32 capacity) {
+    *rw = (rewind_t){ .capacity = capacity };
+    rw->buffer = malloc(capacity);
+    rw->scratch = malloc(SCRATCH_SIZE);
+    if (!rw->buffer || !rw->scratch) {
+        fprintf(stderr, "倒带: 内存不足, 无法分配 %u 字节\n", capacity);
+        free_rewind(rw);
+        return false;
+    }
+    return true;
+}
+
+void free_rewind(rewind_t *rw) {
+    free(rw->buffer);
+    free(rw->scratch);
+    rw->buffer = rw->scratch = NULL;
+}
+
+//环形缓冲区的读写, 越过末尾时分两段
+static void ring_write(rewind_t *rw, const u32 offset, const void *data, const u32 len) {
+    const u32 first = (rw->capacity - offset < len) ? rw->capacity - offset : len;
+    memcpy(&rw->buffer[offset], data, first);
+    memcpy(rw->buffer, (const u8 *)data + first, len - first);
+}
+
+static void ring_read(const rewind_t *rw, const u32 offset, void *data, const u32 len) {
+    const u32 first = (rw->capacity - offset < len) ? rw->capacity - offset : len;
+    memcpy(data, &rw->buffer[offset], first);
+    memcpy((u8 *)data + first, rw->buffer, len - first);
+}
+
+//a和b的差压缩进out, 返回字节数
+static u32 encode_delta(u8 *out, const u8 *a, const u8 *b, const u32 size) {
+    u32 len = 0, pos = 0, i = 0;
+
+    while (i < size) {
+        //跳过相同的部分, 先按8字节比较
+        while (i + 8 <= size) {
+            u64 x, y;
+            memcpy(&x, &a[i], 8);
+            memcpy(&y, &b[i], 8);
+            if (x != y) break;
+            i += 8;
+        }
+        while (i < size && a[i] == b[i]) i++;
+        if (i == size) break;
+
+        //不同的部分, 直到连续MIN_GAP个相同的字节为止
+        u32 end = i, same = 0;
+        while (end < size && same < MIN_GAP) {
+            same = (a[end] == b[end]) ? same + 1 : 0;
+            end++;
+        }
+        end -= same;
+
+        const u16 skip = i - pos, n = end - i;
+        memcpy(&out[len], &skip, 2);
+        memcpy(&out[len + 2], &n, 2);
+        len += 4;
+        for (u32 k = i; k < end; k++) out[len++] = a[k] ^ b[k];
+        pos = i = end;
+    }
+
+    return len;
+}
+
+//把压缩的差异或到state上
+static void apply_delta(u8 *state, const u8 *delta, const u32 len) {
+    u32 pos = 0;
+    for (u32 p = 0; p + 4 <= len;) {
+        u16 skip, n;
+        memcpy(&skip, &delta[p], 2);
+        memcpy(&n, &delta[p + 2], 2);
+        p += 4;
+        pos += skip;
+        for (u16 k = 0; k < n; k++) state[pos++] ^= delta[p++];
+    }
+}
+
+//丢掉最旧的一条记录
+static void drop_oldest(rewind_t *rw) {
+    u32 len;
+    ring_read(rw, rw->head, &len, 4);
+    rw->head = (rw->head + len + 8) % rw->capacity;
+    rw->used -= len + 8;
+    rw->frames--;
+}
+
+void rewind_push(rewind_t *rw, const chip8_t *chip8) {
+    const u64 start = now_ns();
+
+    savestate_t current;
+    save_state(chip8, &current);
+
+    if (rw->has_newest) {
+        const u32 len = encode_delta(rw->scratch, (const u8 *)&current, (const u8 *)&rw->newest, sizeof current);
+        if (len + 8 > rw->capacity) rw->head = rw->used = rw->frames = 0;   //一条都放不下, 历史全部作废
+        else {
+            while (rw->used + len + 8 > rw->capacity) drop_oldest(rw);
+
+            const u32 end = (rw->head + rw->used) % rw->capacity;
+            ring_write(rw, end, &len, 4);
+            ring_write(rw, (end + 4) % rw->capacity, rw->scratch, len);
+            ring_write(rw, (end + 4 + len) % rw->capacity, &len, 4);
+            rw->used += len + 8;
+            rw->frames++;
+            rw->delta_bytes += len + 8;
+        }
+    }
+    rw->newest = current;
+    rw->has_newest = true;
+
+    const u64 elapsed = now_ns() - start;
+    rw->snapshots++;
+    rw->snapshot_ns += elapsed;
+    if (elapsed > rw->max_snapshot_ns) rw->max_snapshot_ns = elapsed;
+}
+
+bool rewind_step(rewind_t *rw, chip8_t *chip8) {
+    if (rw->frames == 0) return false;
+
+    //取出最新的一条记录, 异或到最新一帧上得到前一帧
+    const u32 end = (rw->head + rw->used) % rw->capacity;
+    u32 len;
+    ring_read(rw, (end + rw->capacity - 4) % rw->capacity, &len, 4);
+    ring_read(rw, (end + 2 * rw->capacity - 4 - len) % rw->capacity, rw->scratch, len);
+    rw->used -= len + 8;
+    rw->frames--;
+    apply_delta((u8 *)&rw->newest, rw->scratch, len);
+
+    //按键是真实键盘的状态, 不跟着倒回去, 否则倒带时松开的键会一直按着
+    bool keypad[16];
+    memcpy(keypad, chip8->keypad, sizeof keypad);
+    const bool ok = restore_state(chip8, &rw->newest);
+    memcpy(chip8->keypad, keypad, sizeof keypad);
+    return ok;
+}
@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "chip8.h"
+#include "pool.h"
+#include "savestate.h"
+
+void save_state(const chip8_t *chip8, savestate_t *state) {
+    memset(state, 0, sizeof(savestate_t));
+    memcpy(state->magic, SAVESTATE_MAGIC, sizeof state->magic);
+    state->version = SAVESTATE_VERSION;
+    state->size = sizeof(savestate_t);
+    state->rom_hash = chip8->image->hash;
+
+    memcpy(state->V, chip8->V, sizeof state->V);
+    memcpy(state->stk, chip8->stk, sizeof state->stk);
+    state->I = chip8->I;
+    state->PC = chip8->PC;
+    state->SP = chip8->SP;
+    state->delay_timer = chip8->delay_timer;
+    state->sound_timer = chip8->sound_timer;
+    state->wait_key = chip8->wait_key;
+    state->key_wait = chip8->key_wait;
+    state->rng = chip8->rng;
+    memcpy(state->keypad, chip8->keypad, sizeof state->keypad);
+    state->pitch = chip8->pitch;
+    state->xo_audio = chip8->xo_audio;
+    state->hires = chip8->hires;
+    state->planes = chip8->planes;
+    memcpy(state->audio_pattern, chip8->audio_pattern, sizeof state->audio_pattern);
+    state->written_pages = chip8->written_pages;
+    u128 rows[DISPLAY_PLANES][DISPLAY_HEIGHT];
+    copy_display(chip8, rows);
+    memcpy(state->display, rows, sizeof state->display);
+    for (u8 page = 0; page < PAGE_COUNT; page++)
+        memcpy(&state->ram[page * PAGE_SIZE], chip8->ram[page], PAGE_SIZE);
+}
+
+//恢复一页内存: 内容没变就什么都不做; 和ROM镜像一样就归还私有页重新共享; 否则写进自己的拷贝
+static void restore_page(chip8_t *chip8, const u8 page, const u8 *data) {
+    if (memcmp(chip8->ram[page], data, PAGE_SIZE) == 0) return;
+
+    const u8 *shared = &chip8->image->ram[page * PAGE_SIZE];
+    if (memcmp(shared, data, PAGE_SIZE) == 0) {
+        //当前内容和镜像不同, 所以这一页一定是私有的
+        pool_free(chip8->pool, chip8->ram[page], PAGE_SIZE);
+        chip8->ram[page] = (u8 *)shared;
+        chip8->private_ram &= ~(1 << page);
+    }
+    else {
+        if (!(chip8->private_ram & (1 << page))) copy_ram_page(chip8, page);
+        memcpy(chip8->ram[page], data, PAGE_SIZE);
+    }
+
+    //这一页的代码变了, 预解码指令和JIT块都要作废
+    invalidate_code(chip8, page * PAGE_SIZE, PAGE_SIZE);
+}
+
+bool restore_state(chip8_t *chip8, const savestate_t *state) {
+    if (memcmp(state->magic, SAVESTATE_MAGIC, sizeof state->magic) != 0) {
+        fprintf(stderr, "存档: 不是存档文件\n");
+        return false;
+    }
+    if (state->version != SAVESTATE_VERSION || state->size != sizeof(savestate_t)) {
+        fprintf(stderr, "存档: 版本 %u 不支持, 当前版本 %u\n", state->version, SAVESTATE_VERSION);
+        return false;
+    }
+    if (state->rom_hash != chip8->image->hash) {
+        fprintf(stderr, "存档: 不是游戏 %s 的存档\n", chip8->rom_name);
+        return false;
+    }
+
+    memcpy(chip8->V, state->V, sizeof chip8->V);
+    memcpy(chip8->stk, state->stk, sizeof chip8->stk);
+    chip8->I = state->I & 0xFFF;
+    chip8->PC = state->PC & 0xFFF;
+    chip8->SP = state->SP < 16 ? state->SP : 16;
+    chip8->delay_timer = state->delay_timer;
+    chip8->sound_timer = state->sound_timer;
+    chip8->wait_key = state->wait_key < sizeof chip8->keypad ? state->wait_key : 0xFF;
+    chip8->key_wait = state->key_wait;
+    chip8->rng = state->rng ? state->rng : 1;
+    memcpy(chip8->keypad, state->keypad, sizeof chip8->keypad);
+    chip8->pitch = state->pitch;
+    chip8->xo_audio = state->xo_audio;
+    chip8->hires = state->hires;
+    chip8->planes = state->planes & ((1 << DISPLAY_PLANES) - 1);
+    memcpy(chip8->audio_pattern, state->audio_pattern, sizeof chip8->audio_pattern);
+    u128 rows[DISPLAY_PLANES][DISPLAY_HEIGHT];
+    memcpy(rows, state->display, sizeof rows);
+    load_display(chip8, rows);
+
+    for (u8 page = 0; page < PAGE_COUNT; page++) restore_page(chip8, page, &state->ram[page * PAGE_SIZE]);
+    chip8->written_pages |= state->written_pages;
+    mark_dirty(&chip8->dirty, ~(u64)0, 0, DISPLAY_WIDTH);
+    chip8->draw = true;
+    return true;
+}
+
+bool save_state_file(const chip8_t *chip8, const char path[]) {
+    savestate_t state;
+    save_state(chip8, &state);
+
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "存档: %s 无法写入\n", path);
+        return false;
+    }
+    const bool ok = fwrite(&state, sizeof state, 1, file) == 1;
+    if (fclose(file) != 0 || !ok) {
+        fprintf(stderr, "存档: %s 写入失败\n", path);
+        return false;
+    }
+    return true;
+}
+
+u64 hash_state(const chip8_t *chip8) {
+    savestate_t state;
+    save_state(chip8, &state);
+    state.written_pages = 0;
+    return hash_bytes(&state, sizeof state);
+}
+
+//把整个文件只读映射进内存, 失败返回NULL
+static const void *map_file(const char path[], size_t *size) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return NULL;
+
+    LARGE_INTEGER file_size;
+    HANDLE mapping = NULL;
+    const void *data = NULL;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0) {
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping) data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    }
+    *size = (size_t)file_size.QuadPart;
+
+    //视图会保持映射对象有效, 句柄可以先关掉
+    if (mapping) CloseHandle(mapping);
+    CloseHandle(file);
+    return data;
+#else
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    void *data = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) data = NULL;
+    }
+    *size = (size_t)st.st_size;
+
+    close(fd);  //映射会保持文件有效
+    return data;
+#endif
+}
+
+static void unmap_file(const void *data, const size_t size) {
+#ifdef _WIN32
+    (void)size;
+    UnmapViewOfFile(data);
+#else
+    munmap((void *)data, size);
+#endif
+}
+
+bool load_state_file(chip8_t *chip8, const char path[]) {
+    size_t size = 0;
+    const savestate_t *state = map_file(path, &size);
+    if (!state) {
+        fprintf(stderr, "存档: %s 打开失败\n", path);
+        return false;
+    }
+
+    bool ok = false;
+    if (size != sizeof(savestate_t)) fprintf(stderr, "存档: %s 大小不对: %llu 字节\n", path, (unsigned long long)size);
+    else ok = restore_state(chip8, state);
+
+    unmap_file(state, size);
+    return ok;
+}
@@ -0,0 +1,193 @@
+#include <string.h>
+
+#include "chip8.h"
+#include "scheduler.h"
+#include "metrics.h"
+#include "profile.h"
+
+#define IDLE_STEPS 48   //找空转循环时最多模拟多少条指令
+#define IDLE_MIN 32     //跳过的周期少于这么多就不划算(比如每次60Hz事件之间只有10个周期), 之后少找几次
+#define IDLE_BACKOFF 64 //最多隔多少段再找
+
+void init_scheduler(scheduler_t *sched, const config_t config) {
+    *sched = (scheduler_t){0};
+    sched->cycles_per_tick = config.insts_per_second / 60 ? config.insts_per_second / 60 : 1;
+    sched->next_tick = sched->cycles_per_tick;
+}
+
+//空转循环中会变化的状态, 没有填充, 可以整个比较
+typedef struct {
+    u8 V[16];
+    u16 I;
+    u16 PC;
+} idle_state_t;
+
+//模拟一条只读写V和I的指令, 和emulate_instruction的结果一样; 碰到别的指令(写内存, 画图, 随机数, 调用等)返回false
+//polls记下是否读了delay_timer或键盘, 这两样在60Hz事件和按键之间不会变
+static bool idle_step(const chip8_t *chip8, idle_state_t *s, bool *polls) {
+    const u16 opcode = (ram_read(chip8, s->PC) << 8) | ram_read(chip8, s->PC + 1);
+    const u8 X = (opcode >> 8) & 0xF, Y = (opcode >> 4) & 0xF, NN = opcode & 0xFF;
+
+    s->PC += 2;
+    switch (opcode >> 12) {
+    case 0x1: s->PC = opcode & 0x0FFF; return true;
+    case 0x3: if (s->V[X] == NN) s->PC += 2; return true;
+    case 0x4: if (s->V[X] != NN) s->PC += 2; return true;
+    case 0x5: if ((opcode & 0xF) == 0 && s->V[X] == s->V[Y]) s->PC += 2; return (opcode & 0xF) == 0;
+    case 0x6: s->V[X] = NN; return true;
+    case 0x8: if ((opcode & 0xF) == 0) s->V[X] = s->V[Y]; return (opcode & 0xF) == 0;
+    case 0x9: if ((opcode & 0xF) == 0 && s->V[X] != s->V[Y]) s->PC += 2; return (opcode & 0xF) == 0;
+    case 0xA: s->I = opcode & 0x0FFF; return true;
+    case 0xE:
+        if (NN != 0x9E && NN != 0xA1) return false;
+        *polls = true;
+        if (chip8->keypad[s->V[X] & 0xF] == (NN == 0x9E)) s->PC += 2;
+        return true;
+    case 0xF:
+        if (NN != 0x07) return false;
+        *polls = true;
+        s->V[X] = chip8->delay_timer;
+        return true;
+    default: return false;
+    }
+}
+
+//从当前状态开始找空转循环(Brent的环检测): 找到时把虚拟机推进到循环里, 返回推进的周期数(不超过limit), 否则返回0
+//推进之后的状态和逐条执行同样多的周期完全一样; halted表示循环不读计时器和键盘, 之后再也不会变化; length是一圈的指令数
+static u64 skip_idle_loop(chip8_t *chip8, const u64 limit, bool *halted, u32 *length_out) {
+    idle_state_t tortoise, hare;
+    memcpy(tortoise.V, chip8->V, sizeof tortoise.V);
+    tortoise.I = chip8->I;
+    tortoise.PC = chip8->PC;
+    hare = tortoise;
+
+    bool polls = false;
+    u32 power = 1, length = 0, steps = 0;
+    do {
+        if (steps == IDLE_STEPS || !idle_step(chip8, &hare, &polls)) return 0;
+        steps++;
+        length++;
+        if (memcmp(&tortoise, &hare, sizeof hare) == 0) break;
+        if (length == power) {
+            tortoise = hare;
+            power *= 2;
+            length = 0;
+        }
+    } while (true);
+
+    //模拟的steps条指令之后每length条回到同样的状态; 一圈都跑不完就照常执行
+    if (steps > limit) return 0;
+    memcpy(chip8->V, hare.V, sizeof hare.V);
+    chip8->I = hare.I;
+    chip8->PC = hare.PC;
+    *halted = !polls;
+    *length_out = length;
+    return steps + (limit - steps) / length * length;
+}
+
+//在不读计时器和键盘的循环里再逐条模拟n条指令(不足一圈), 停在和逐条执行一样的位置
+static void step_idle_loop(chip8_t *chip8, const u32 n) {
+    idle_state_t s;
+    memcpy(s.V, chip8->V, sizeof s.V);
+    s.I = chip8->I;
+    s.PC = chip8->PC;
+    bool polls = false;
+    for (u32 i = 0; i < n; i++) idle_step(chip8, &s, &polls);
+    memcpy(chip8->V, s.V, sizeof s.V);
+    chip8->I = s.I;
+    chip8->PC = s.PC;
+}
+
+//从现在到target虚拟机都不执行指令: 一次跳过去, 只有计时器随着经过的60Hz事件减少
+static void jump_to(scheduler_t *sched, chip8_t *chip8, const u64 target) {
+    const u64 ticks = target >= sched->next_tick ? (target - sched->next_tick) / sched->cycles_per_tick + 1 : 0;
+    chip8->delay_timer = chip8->delay_timer > ticks ? chip8->delay_timer - (u8)ticks : 0;
+    chip8->sound_timer = chip8->sound_timer > ticks ? chip8->sound_timer - (u8)ticks : 0;
+    sched->next_tick += ticks * sched->cycles_per_tick;
+    sched->ticks += ticks;
+    sched->cycle = target;
+}
+
+u64 run_scheduled(scheduler_t *sched, chip8_t *chip8, const config_t config, const u64 cycles) {
+    const u64 target = sched->cycle + cycles;
+    u64 executed = 0;
+
+    //逐条统计, 跟踪时要看到每一条指令, 不跳过
+    const bool skip_idle = config.skip_idle && !chip8->trace && !instrumented(chip8);
+    sched->halted = false;
+
+    while (sched->cycle < target) {
+        //一次最多运行到下一次60Hz事件或者下一次采样; run_instructions执行完DXYN会提前返回, 接着运行就行
+        u64 until = target < sched->next_tick ? target : sched->next_tick;
+        if (chip8->profile && sched->cycle + chip8->profile->countdown < until) until = sched->cycle + chip8->profile->countdown;
+        const u64 from = sched->cycle;
+
+        //FX0A: 键盘只在两次run_scheduled之间变化, 现在的键盘能让它继续就从那条FX0A接着执行, 否则这次剩下的周期都在等
+        //不统计也不采样时一次跳到target; 否则和display wait一样逐个事件空等, 统计和采样都看得到这些周期
+        if (chip8->key_wait && key_wait_ready(chip8)) chip8->key_wait = false;
+        if (chip8->key_wait && !chip8->metrics && !chip8->profile) {
+            jump_to(sched, chip8, target);
+            break;
+        }
+
+        if (chip8->vblank_wait || chip8->key_wait) {    //display wait: 空等到下一次刷新; FX0A: 空等到键盘变化
+            if (chip8->metrics && chip8->vblank_wait) chip8->metrics->wait_cycles += until - sched->cycle;
+            else if (chip8->metrics) chip8->metrics->key_wait_cycles += until - sched->cycle;
+            sched->cycle = until;
+        }
+        else {
+            bool halted = false;
+            u64 skipped = 0;
+            u32 length = 1;
+            if (skip_idle && sched->idle_wait) sched->idle_wait--;
+            else if (skip_idle) {
+                skipped = skip_idle_loop(chip8, until - sched->cycle, &halted, &length);
+                if (skipped >= IDLE_MIN || halted) sched->idle_backoff = 0;
+                else {
+                    sched->idle_backoff = sched->idle_backoff ? sched->idle_backoff * 2 : 1;
+                    if (sched->idle_backoff > IDLE_BACKOFF) sched->idle_backoff = IDLE_BACKOFF;
+                    sched->idle_wait = sched->idle_backoff;
+                }
+            }
+            sched->cycle += skipped;
+            executed += skipped;
+            sched->skipped += skipped;
+
+            //死循环: 剩下的周期都是空转, 一次跳到target, 只有计时器随着经过的60Hz事件减少; 采样时还是逐个事件推进
+            //整圈跳过, 最后不足一圈的部分逐条模拟, 这样停下的位置和逐条执行到target一样
+            if (halted && !chip8->profile) {
+                step_idle_loop(chip8, (u32)((target - sched->cycle) % length));
+                executed += target - sched->cycle;
+                sched->skipped += target - sched->cycle;
+                jump_to(sched, chip8, target);
+                sched->halted = true;
+                break;
+            }
+
+            if (sched->cycle < until) {
+                const u32 n = run_instructions(chip8, config, (u32)(until - sched->cycle));
+                sched->cycle += n;
+                executed += n;
+            }
+        }
+
+        //采样: 空等的周期也算, 记在等待的位置上
+        if (chip8->profile && (chip8->profile->countdown -= (u32)(sched->cycle - from)) == 0) profile_sample(chip8->profile, chip8);
+
+        //60Hz事件
+        if (sched->cycle == sched->next_tick) {
+            if (chip8->metrics) {
+                chip8->metrics->ticks++;
+                chip8->metrics->delay_ticks += chip8->delay_timer > 0;
+                chip8->metrics->sound_ticks += chip8->sound_timer > 0;
+            }
+            if (chip8->delay_timer > 0) chip8->delay_timer--;
+            if (chip8->sound_timer > 0) chip8->sound_timer--;
+            chip8->vblank_wait = false;
+            sched->next_tick += sched->cycles_per_tick;
+            sched->ticks++;
+        }
+    }
+
+    return executed;
+}
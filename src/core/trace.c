@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "trace.h"
+
+bool init_trace(trace_t *trace, const u32 records) {
+    u32 capacity = 1;
+    while (capacity < records && capacity < (1u << 31)) capacity <<= 1;
+
+    *trace = (trace_t){ .capacity = capacity };
+    trace->records = malloc((size_t)capacity * sizeof(trace_record_t));
+    if (!trace->records) {
+        fprintf(stderr, "跟踪: 内存不足, 无法分配 %u 条记录\n", capacity);
+        return false;
+    }
+    return true;
+}
+
+void free_trace(trace_t *trace) {
+    free(trace->records);
+    trace->records = NULL;
+    trace->total = 0;
+}
+
+void clear_trace(trace_t *trace) {
+    trace->total = 0;
+}
+
+bool save_trace(const trace_t *trace, const char path[]) {
+    const u64 count = trace->total < trace->capacity ? trace->total : trace->capacity;
+    trace_header_t header = {
+        .version = TRACE_VERSION,
+        .record_size = sizeof(trace_record_t),
+        .total = trace->total,
+        .count = count,
+    };
+    memcpy(header.magic, TRACE_MAGIC, sizeof header.magic);
+
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "跟踪: %s 无法写入\n", path);
+        return false;
+    }
+
+    //环形缓冲区满了的话, 最旧的一条在下一次要写的位置, 分成两段写
+    const u32 first = (u32)((trace->total - count) & (trace->capacity - 1));
+    const u64 tail = count < trace->capacity - first ? count : trace->capacity - first;
+    bool ok = fwrite(&header, sizeof header, 1, file) == 1
+           && fwrite(&trace->records[first], sizeof(trace_record_t), tail, file) == tail
+           && fwrite(trace->records, sizeof(trace_record_t), count - tail, file) == count - tail;
+    ok = (fclose(file) == 0) && ok;
+    if (!ok) fprintf(stderr, "跟踪: %s 写入失败\n", path);
+    return ok;
+}
+
+u32 run_traced(chip8_t *chip8, const config_t config, const u32 count) {
+    trace_t *trace = chip8->trace;
+    u32 executed = 0;
+
+    while (executed < count) {
+        trace_record_t *r = &trace->records[trace->total++ & (trace->capacity - 1)];
+        const u16 opcode = (ram_read(chip8, chip8->PC) << 8) | ram_read(chip8, chip8->PC + 1);
+        const u8 X = (opcode >> 8) & 0x0F, Y = (opcode >> 4) & 0x0F;
+        u8 before[16];
+        memcpy(before, chip8->V, sizeof before);
+
+        *r = (trace_record_t){
+            .pc = chip8->PC,
+            .opcode = opcode,
+            .I = chip8->I,
+            .vx = (opcode >> 12 == 0xB) ? chip8->V[0] : chip8->V[X],
+            .vy = chip8->V[Y],
+            .reg = 0xFF,
+            .delay_timer = chip8->delay_timer,
+            .flags = chip8->keypad[chip8->V[X] & 0xF] ? TRACE_KEY : 0,
+        };
+
+        emulate_instruction(chip8, config);
+        executed++;
+
+        //被改写的寄存器中编号最小的一个, 所以VX这类结果优先于VF
+        for (u8 i = 0; i < 16; i++) {
+            if (chip8->V[i] == before[i]) continue;
+            r->reg = i;
+            r->value = chip8->V[i];
+            break;
+        }
+        if (chip8->V[0xF] & 1) r->flags |= TRACE_VF;
+
+        if (opcode >> 12 == 0xD) break;    //和run_instructions一样, 一次只绘制一个sprite
+        if (chip8->key_wait) break;     //FX0A暂停, 调度器等到键盘变化才再执行它
+    }
+    return executed;
+}
@@ -0,0 +1,68 @@
+//预先翻译的ROM的无窗口运行程序, 和ch8_aot生成的C文件一起编译
+//用法: <程序> [ROM路径] [指令数] [--compare]
+//  ROM路径默认是翻译时的路径, 指令数默认是10000000
+//  --compare: 再用预解码缓存引擎跑同样多的指令, 比较两者的状态和速度
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chip8.h"
+#include "aot.h"
+
+extern const aot_program_t aot_program;    //ch8_aot生成
+
+//执行count条指令, 返回用时(秒); 两次运行用同样的config.seed, CXNN取到同样的随机数
+static double run(chip8_t *chip8, const config_t config, const u32 count, const bool aot) {
+    const clock_t start = clock();
+    u32 done = 0;
+
+    while (done < count && chip8->state != QUIT) {
+        const u32 executed = aot ? run_aot(chip8, config, &aot_program, count - done)
+                                 : run_instructions(chip8, config, count - done);
+        if (executed == 0) break;
+        done += executed;
+    }
+
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char **argv) {
+    const char *rom_name = aot_program.rom_name;
+    u32 count = 10000000;
+    bool compare = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--compare") == 0) compare = true;
+        else if (argv[i][0] >= '0' && argv[i][0] <= '9') count = (u32)strtoul(argv[i], NULL, 10);
+        else rom_name = argv[i];
+    }
+
+    config_t config;
+    init_config(&config);
+    config.quirks = aot_program.quirks; //和翻译时的兼容性配置一样, 才会执行翻译好的块
+
+    static chip8_t chip8 = {0};
+    if (!init_chip8(&chip8, config, rom_name)) return EXIT_FAILURE;
+
+    const double aot_time = run(&chip8, config, count, true);
+    printf("aot   : %u 条指令, %.3f 秒, %.0f IPS\n", count, aot_time, aot_time > 0 ? count / aot_time : 0.0);
+
+    if (compare) {
+        static chip8_t ref = {0};
+        if (!init_chip8(&ref, config, rom_name)) return EXIT_FAILURE;
+
+        config.engine = ENGINE_CACHED;
+        const double ref_time = run(&ref, config, count, false);
+        printf("%-6s: %u 条指令, %.3f 秒, %.0f IPS\n", engine_name(config.engine), count, ref_time,
+               ref_time > 0 ? count / ref_time : 0.0);
+
+        const bool same = same_state(&chip8, &ref);
+        printf("状态%s\n", same ? "一致" : "不一致!");
+        if (!same) return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,434 @@
+//CHIP-8 ROM预先翻译器: 把ROM中从入口0x200开始可达的代码按基本块翻译成C
+//生成的文件包含include/chip8.h和include/aot.h, 和核心库以及tools/aot_main.c一起编译成单独的可执行文件
+//用法: ch8_aot [--quirks vip|chip48|schip|xochip] <rom.ch8> <output.c>
+//
+//BNNN的跳转目标在翻译时未知, 运行时查不到块就交给解释器; 被改写过的块也交给解释器
+//--quirks: 按这个兼容性配置(quirks.h)翻译, 默认是vip; 运行时配置不同就不执行翻译好的块
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "quirks.h"
+
+#define ENTRY 0x200 //和init_chip8一致
+#define MAX_BLOCK_INSTS 256
+
+static u8 ram[4096];
+static u16 rom_end;     //ROM之后的第一个地址
+static bool reachable[4096];    //这个地址开始是一条可达的指令
+static bool leader[4096];       //这个地址是一个基本块的开头
+static quirks_profile_t profile = QUIRKS_VIP;   //翻译用的兼容性配置
+
+//指令在控制流中的角色
+typedef enum {
+    FLOW_NEXT,      //顺序执行下一条
+    FLOW_JUMP,      //1NNN
+    FLOW_CALL,      //2NNN
+    FLOW_RET,       //00EE
+    FLOW_SKIP,      //3XNN, 4XNN, 5XY0, 9XY0, EX9E, EXA1
+    FLOW_INDIRECT,  //BNNN, 目标未知
+    FLOW_DRAW,      //DXYN, 执行完要结束这一帧
+    FLOW_WRITE,     //FX33, FX55, 可能改写后面的代码, 块在它之后结束
+    FLOW_SCREEN,    //00CN, 00DN, 00FB, 00FC, 00FE, 00FF, FN01, 改变屏幕或位平面, 块在它之后结束(和JIT一样)
+    FLOW_WAIT,      //FX0A, 可能让虚拟机暂停(key_wait), 交给解释器, 不翻译
+} flow_t;
+
+static u16 fetch(const u16 pc) {
+    return (ram[pc] << 8) | ram[pc + 1];
+}
+
+static flow_t flow_of(const u16 opcode) {
+    const u8 NN = opcode & 0xFF;
+    const u8 N = opcode & 0x0F;
+
+    switch (opcode >> 12) {
+    case 0x0:
+        if (NN == 0xEE) return FLOW_RET;
+        if ((opcode & 0x0F00) == 0 && ((NN & 0xF0) == 0xC0 || (NN & 0xF0) == 0xD0 || NN >= 0xFB)) return FLOW_SCREEN;
+        return FLOW_NEXT;
+    case 0x1: return FLOW_JUMP;
+    case 0x2: return FLOW_CALL;
+    case 0x3: case 0x4: return FLOW_SKIP;
+    case 0x5: case 0x9: return (N == 0) ? FLOW_SKIP : FLOW_NEXT;
+    case 0xB: return FLOW_INDIRECT;
+    case 0xD: return FLOW_DRAW;
+    case 0xE: return (NN == 0x9E || NN == 0xA1) ? FLOW_SKIP : FLOW_NEXT;
+    case 0xF:
+        if (NN == 0x0A) return FLOW_WAIT;
+        if (NN == 0x33 || NN == 0x55) return FLOW_WRITE;
+        if (NN == 0x01) return FLOW_SCREEN;
+        return FLOW_NEXT;
+    default: return FLOW_NEXT;
+    }
+}
+
+//地址处是否有一条完整的ROM指令
+static bool in_rom(const u32 pc) {
+    return pc >= ENTRY && pc + 1 < rom_end;
+}
+
+//1.从入口开始遍历所有可达的指令, 同时标出基本块的开头
+static void find_reachable(void) {
+    static u16 worklist[4096 * 2];
+    u32 top = 0;
+
+    worklist[top++] = ENTRY;
+    leader[ENTRY] = true;
+
+    while (top) {
+        const u16 pc = worklist[--top];
+        if (!in_rom(pc) || reachable[pc]) continue;
+        reachable[pc] = true;
+
+        const u16 opcode = fetch(pc);
+        u16 next[2];
+        u8 n = 0;
+
+        switch (flow_of(opcode)) {
+        case FLOW_NEXT:     next[n++] = pc + 2; break;
+        case FLOW_JUMP:     next[n++] = opcode & 0x0FFF; leader[opcode & 0x0FFF] = true; break;
+        case FLOW_CALL:
+            //子程序和返回地址都是块的开头
+            next[n++] = opcode & 0x0FFF;
+            next[n++] = pc + 2;
+            leader[opcode & 0x0FFF] = true;
+            leader[(pc + 2) & 0xFFF] = true;
+            break;
+        case FLOW_SKIP:
+            next[n++] = pc + 2;
+            next[n++] = pc + 4;
+            leader[(pc + 2) & 0xFFF] = true;
+            leader[(pc + 4) & 0xFFF] = true;
+            break;
+        case FLOW_DRAW:
+        case FLOW_WRITE:
+        case FLOW_SCREEN:
+        case FLOW_WAIT:
+            next[n++] = pc + 2;
+            leader[(pc + 2) & 0xFFF] = true;
+            break;
+        case FLOW_RET:
+        case FLOW_INDIRECT:
+            break;
+        }
+
+        for (u8 i = 0; i < n; i++)
+            if (next[i] <= 0xFFF && !reachable[next[i]]) worklist[top++] = next[i];
+    }
+}
+
+/* ===================== 代码生成 ===================== */
+
+//块内用到的寄存器
+typedef struct {
+    u16 used;       //读或写过的V寄存器(按位)
+    u16 written;    //写过的V寄存器
+    bool uses_I;
+    bool writes_I;
+} regs_t;
+
+static void note_regs(const u16 opcode, regs_t *r) {
+    const u8 X = (opcode >> 8) & 0x0F;
+    const u8 Y = (opcode >> 4) & 0x0F;
+    const u8 NN = opcode & 0xFF;
+    const u16 up_to_x = (u16)((2u << X) - 1);  //V0~VX
+
+    switch (opcode >> 12) {
+    case 0x3: case 0x4: case 0xE: r->used |= 1 << X; break;
+    case 0x5: case 0x9: r->used |= (1 << X) | (1 << Y); break;
+    case 0x6: case 0x7: case 0xC: r->used |= 1 << X; r->written |= 1 << X; break;
+    case 0x8:
+        r->used |= (1 << X) | (1 << 0xF);
+        if (quirks_of[profile].shift_vy || ((opcode & 0xF) != 0x6 && (opcode & 0xF) != 0xE)) r->used |= 1 << Y; //移VX时不读VY
+        r->written |= (1 << X) | (1 << 0xF);
+        break;
+    case 0xA: r->uses_I = r->writes_I = true; break;
+    case 0xB: r->used |= quirks_of[profile].jump_v0 ? 1 : 1 << X; break;
+    case 0xD: r->used |= (1 << X) | (1 << Y); break;  //draw_sprite读chip8->I, 写回后再调用
+    case 0xF:
+        if (NN != 0x01) r->used |= 1 << X;  //FN01的N是位平面, 不是寄存器
+        switch (NN) {
+        case 0x07: r->written |= 1 << X; break;
+        case 0x1E: case 0x29: r->uses_I = r->writes_I = true; break;
+        case 0x33: r->uses_I = true; break;
+        case 0x02: r->uses_I = true; break;    //F002从I读样本
+        case 0x55: r->used |= up_to_x; r->uses_I = r->writes_I = true; break;
+        case 0x65: r->used |= up_to_x; r->written |= up_to_x; r->uses_I = r->writes_I = true; break;
+        default: break;
+        }
+        break;
+    default: break;
+    }
+}
+
+//把块内修改过的寄存器写回虚拟机
+static void emit_writeback(FILE *out, const regs_t *r) {
+    for (u8 i = 0; i < 16; i++)
+        if (r->written & (1 << i)) fprintf(out, "    V[0x%X] = v%X;\n", i, i);
+    if (r->writes_I) fprintf(out, "    chip8->I = I;\n");
+}
+
+//块内的一条普通指令, 语义和emulate_instruction完全一致
+static void emit_body(FILE *out, const u16 pc, const u16 opcode) {
+    const quirks_t quirks = quirks_of[profile];
+    const char *const vf_reset = quirks.vf_reset ? " vF = 0;" : "";
+    const u8 shift = quirks.shift_vy ? ((opcode >> 4) & 0x0F) : ((opcode >> 8) & 0x0F);   //8XY6/8XYE移位的寄存器
+    const u16 step = quirk_i_step(quirks, (opcode >> 8) & 0x0F);  //FX55/FX65之后I增加多少
+    const u8 X = (opcode >> 8) & 0x0F;
+    const u8 Y = (opcode >> 4) & 0x0F;
+    const u8 N = opcode & 0x0F;
+    const u8 NN = opcode & 0xFF;
+    const u16 NNN = opcode & 0x0FFF;
+
+    fprintf(out, "    /* 0x%04X: %04X */ ", pc, opcode);
+
+    switch (opcode >> 12) {
+    case 0x0:
+        if (NN == 0xE0) fprintf(out, "clear_display(chip8);\n");
+        else if (quirks.hires && X == 0 && (NN & 0xF0) == 0xC0) fprintf(out, "scroll_display(chip8, 0, %u);\n", N);
+        else if (quirks.planes && X == 0 && (NN & 0xF0) == 0xD0) fprintf(out, "scroll_display(chip8, 0, -%u);\n", N);
+        else if (quirks.hires && X == 0 && (NN == 0xFB || NN == 0xFC)) fprintf(out, "scroll_display(chip8, %d, 0);\n", NN == 0xFB ? 4 : -4);
+        else if (quirks.hires && X == 0 && (NN == 0xFE || NN == 0xFF)) fprintf(out, "set_hires(chip8, %s);\n", NN == 0xFF ? "true" : "false");
+        else fprintf(out, "/* 什么也不做 */\n");
+        break;
+    case 0x6: fprintf(out, "v%X = 0x%02X;\n", X, NN); break;
+    case 0x7: fprintf(out, "v%X += 0x%02X;\n", X, NN); break;
+    case 0x8:
+        switch (N) {
+        case 0x0: fprintf(out, "v%X = v%X;\n", X, Y); break;
+        case 0x1: fprintf(out, "v%X |= v%X;%s\n", X, Y, vf_reset); break;
+        case 0x2: fprintf(out, "v%X &= v%X;%s\n", X, Y, vf_reset); break;
+        case 0x3: fprintf(out, "v%X ^= v%X;%s\n", X, Y, vf_reset); break;
+        case 0x4: fprintf(out, "carry = (u16)(v%X + v%X) > 0xFF; v%X += v%X; vF = carry;\n", X, Y, X, Y); break;
+        case 0x5: fprintf(out, "carry = v%X >= v%X; v%X -= v%X; vF = carry;\n", X, Y, X, Y); break;
+        case 0x6: fprintf(out, "carry = v%X & 1; v%X = v%X >> 1; vF = carry;\n", shift, X, shift); break;
+        case 0x7: fprintf(out, "carry = v%X <= v%X; v%X = v%X - v%X; vF = carry;\n", X, Y, X, Y, X); break;
+        case 0xE: fprintf(out, "carry = (v%X & 0x80) >> 7; v%X = v%X << 1; vF = carry;\n", shift, X, shift); break;
+        default: fprintf(out, "/* 什么也不做 */\n"); break;
+        }
+        break;
+    case 0xA: fprintf(out, "I = 0x%03X;\n", NNN); break;
+    case 0xC: fprintf(out, "v%X = chip8_rand(chip8) & 0x%02X;\n", X, NN); break;
+    case 0xF:
+        switch (NN) {
+        case 0x07: fprintf(out, "v%X = chip8->delay_timer;\n", X); break;
+        case 0x15: fprintf(out, "chip8->delay_timer = v%X;\n", X); break;
+        case 0x18: fprintf(out, "chip8->sound_timer = v%X;\n", X); break;
+        case 0x3A:
+            if (quirks.planes) fprintf(out, "chip8->pitch = v%X;\n", X);
+            else fprintf(out, "/* 什么也不做 */\n");
+            break;
+        case 0x01:
+            if (quirks.planes) fprintf(out, "select_planes(chip8, 0x%X);\n", X);
+            else fprintf(out, "/* 什么也不做 */\n");
+            break;
+        case 0x02:
+            if (quirks.planes && X == 0) fprintf(out, "chip8->I = I; load_audio_pattern(chip8);\n");
+            else fprintf(out, "/* 什么也不做 */\n");
+            break;
+        case 0x1E: fprintf(out, "I += v%X;\n", X); break;
+        case 0x29: fprintf(out, "I = v%X * 5;\n", X); break;
+        case 0x33:
+            fprintf(out, "ram_write(chip8, I + 2, v%X %% 10); ram_write(chip8, I + 1, v%X / 10 %% 10); "
+                         "ram_write(chip8, I, v%X / 100); invalidate_code(chip8, I, 3);\n", X, X, X);
+            break;
+        case 0x55:
+            fprintf(out, "invalidate_code(chip8, I, %u);", X + 1);
+            for (u8 i = 0; i <= X; i++) fprintf(out, " ram_write(chip8, I + %u, v%X);", i, i);
+            if (step) fprintf(out, " I += %u;", step);
+            fprintf(out, "\n");
+            break;
+        case 0x65:
+            for (u8 i = 0; i <= X; i++) fprintf(out, " v%X = ram_read(chip8, I + %u);", i, i);
+            if (step) fprintf(out, " I += %u;", step);
+            fprintf(out, "\n");
+            break;
+        default: fprintf(out, "/* 什么也不做 */\n"); break;
+        }
+        break;
+    default: fprintf(out, "/* 什么也不做 */\n"); break;
+    }
+}
+
+//块的最后一条指令: 先写回寄存器, 再返回下一条PC
+static void emit_end(FILE *out, const u16 pc, const u16 opcode, const regs_t *r) {
+    const u8 X = (opcode >> 8) & 0x0F;
+    const u8 Y = (opcode >> 4) & 0x0F;
+    const u8 N = opcode & 0x0F;
+    const u8 NN = opcode & 0xFF;
+    const u16 NNN = opcode & 0x0FFF;
+    const u16 next = pc + 2, skip = pc + 4;
+
+    switch (flow_of(opcode)) {
+    case FLOW_JUMP:
+        emit_writeback(out, r);
+        fprintf(out, "    /* 0x%04X: %04X */ return 0x%03X;\n", pc, opcode, NNN);
+        break;
+    case FLOW_CALL:
+        emit_writeback(out, r);
+        fprintf(out, "    /* 0x%04X: %04X */ if (chip8->SP < 16) chip8->stk[chip8->SP++] = 0x%04X;\n", pc, opcode, next);
+        fprintf(out, "    return 0x%03X;\n", NNN);
+        break;
+    case FLOW_RET:
+        emit_writeback(out, r);
+        fprintf(out, "    /* 0x%04X: %04X */ return (chip8->SP > 0) ? chip8->stk[--chip8->SP] : 0x%04X;\n", pc, opcode, next);
+        break;
+    case FLOW_INDIRECT:
+        emit_writeback(out, r);
+        fprintf(out, "    /* 0x%04X: %04X */ return v%X + 0x%03X;\n", pc, opcode, quirks_of[profile].jump_v0 ? 0 : X, NNN);
+        break;
+    case FLOW_SKIP: {
+        char cond[64];
+        switch (opcode >> 12) {
+        case 0x3: snprintf(cond, sizeof cond, "v%X == 0x%02X", X, NN); break;
+        case 0x4: snprintf(cond, sizeof cond, "v%X != 0x%02X", X, NN); break;
+        case 0x5: snprintf(cond, sizeof cond, "v%X == v%X", X, Y); break;
+        case 0x9: snprintf(cond, sizeof cond, "v%X != v%X", X, Y); break;
+        default:
+            snprintf(cond, sizeof cond, "%schip8->keypad[v%X & 0xF]", (NN == 0xA1) ? "!" : "", X);
+            break;
+        }
+        emit_writeback(out, r);
+        fprintf(out, "    /* 0x%04X: %04X */ return (%s) ? 0x%04X : 0x%04X;\n", pc, opcode, cond, skip, next);
+        break;
+    }
+    case FLOW_DRAW:
+        //draw_sprite读取chip8->I, 写VF, 所以先写回
+        emit_writeback(out, r);
+        fprintf(out, "    /* 0x%04X: %04X */ draw_sprite(chip8, *config, v%X, v%X, %u);\n", pc, opcode, X, Y, N);
+        fprintf(out, "    return 0x%04X;\n", next);
+        break;
+    case FLOW_WRITE:
+    case FLOW_SCREEN:
+        emit_body(out, pc, opcode);
+        emit_writeback(out, r);
+        fprintf(out, "    return 0x%04X;\n", next);
+        break;
+    default:
+        //顺序执行到了下一个块的开头
+        emit_body(out, pc, opcode);
+        emit_writeback(out, r);
+        fprintf(out, "    return 0x%04X;\n", next);
+        break;
+    }
+}
+
+//2.生成一个基本块, 返回块内的指令数, 0表示这里不能翻译
+static u16 emit_block(FILE *out, const u16 start, u16 *len) {
+    u16 opcodes[MAX_BLOCK_INSTS];
+    u16 n = 0;
+    bool ends_with_flow = false;    //最后一条指令是控制流/DXYN/写内存/改变屏幕
+
+    for (u16 pc = start; n < MAX_BLOCK_INSTS && in_rom(pc) && reachable[pc]; pc += 2) {
+        if (pc != start && leader[pc]) break;   //下一个块的开头
+        const u16 opcode = fetch(pc);
+        const flow_t flow = flow_of(opcode);
+        if (flow == FLOW_WAIT) break;   //FX0A交给解释器
+
+        opcodes[n++] = opcode;
+        if (flow != FLOW_NEXT) {
+            ends_with_flow = true;
+            break;
+        }
+    }
+    if (n == 0) return 0;
+    *len = n * 2;
+
+    regs_t r = {0};
+    for (u16 i = 0; i < n; i++) note_regs(opcodes[i], &r);
+
+    fprintf(out, "static u32 block_%04X(chip8_t *chip8, const config_t *config) {\n", start);
+    fprintf(out, "    u8 *const V = chip8->V;\n");
+    for (u8 i = 0; i < 16; i++)
+        if (r.used & (1 << i)) fprintf(out, "    u8 v%X = V[0x%X];\n", i, i);
+    if (r.uses_I) fprintf(out, "    u16 I = chip8->I;\n");
+    fprintf(out, "    bool carry;\n");
+    fprintf(out, "    (void)V; (void)config; (void)carry;\n\n");
+
+    for (u16 i = 0; i + 1 < n; i++) emit_body(out, start + i * 2, opcodes[i]);
+    const u16 last = start + (n - 1) * 2;
+    if (ends_with_flow) emit_end(out, last, opcodes[n - 1], &r);
+    else {
+        emit_body(out, last, opcodes[n - 1]);
+        emit_writeback(out, &r);
+        fprintf(out, "    return 0x%04X;\n", last + 2);
+    }
+    fprintf(out, "}\n");
+
+    //块的原始字节和描述
+    fprintf(out, "static const u8 code_%04X[] = {", start);
+    for (u16 i = 0; i < *len; i++) fprintf(out, "%s0x%02X", i ? ", " : " ", ram[start + i]);
+    fprintf(out, " };\n");
+
+    u64 pages = 0;
+    for (u32 page = start >> 6; page <= (u32)(start + *len - 1) >> 6; page++) pages |= (u64)1 << page;
+    fprintf(out, "static const aot_block_t info_%04X = { block_%04X, %u, %u, 0x%016llXull, code_%04X, %s };\n\n",
+            start, start, n, *len, (unsigned long long)pages, start,
+            (flow_of(opcodes[n - 1]) == FLOW_DRAW && ends_with_flow) ? "true" : "false");
+
+    return n;
+}
+
+int main(int argc, char **argv) {
+    int arg = 1;
+    if (argc > 2 && strcmp(argv[1], "--quirks") == 0) {
+        if (!parse_quirks(argv[2], &profile)) {
+            fprintf(stderr, "不认识的兼容性配置: %s\n", argv[2]);
+            return EXIT_FAILURE;
+        }
+        arg = 3;
+    }
+    if (argc - arg < 2) {
+        fprintf(stderr, "使用: %s [--quirks vip|chip48|schip|xochip] <rom.ch8> <output.c> 的格式来运行\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *rom_name = argv[arg], *output = argv[arg + 1];
+
+    FILE *rom = fopen(rom_name, "rb");
+    if (!rom) {
+        fprintf(stderr, "游戏: %s 打开失败\n", rom_name);
+        return EXIT_FAILURE;
+    }
+    const size_t rom_size = fread(&ram[ENTRY], 1, sizeof ram - ENTRY, rom);
+    fclose(rom);
+    rom_end = ENTRY + rom_size;
+
+    find_reachable();
+
+    FILE *out = fopen(output, "w");
+    if (!out) {
+        fprintf(stderr, "无法写入: %s\n", output);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(out, "//由ch8_aot从 %s 生成, 不要手动修改\n\n", rom_name);
+    fprintf(out, "#include <string.h>\n\n#include \"chip8.h\"\n#include \"aot.h\"\n\n");
+
+    static bool has_block[4096];
+    u32 blocks = 0, insts = 0;
+    for (u16 pc = ENTRY; pc < rom_end; pc++) {
+        if (!leader[pc] || !reachable[pc]) continue;
+        u16 len;
+        const u16 n = emit_block(out, pc, &len);
+        if (n) {
+            has_block[pc] = true;
+            blocks++;
+            insts += n;
+        }
+    }
+
+    //路径中的反斜杠要转义
+    fprintf(out, "const aot_program_t aot_program = {\n    .rom_name = \"");
+    for (const char *c = rom_name; *c; c++) fprintf(out, (*c == '\\' || *c == '"') ? "\\%c" : "%c", *c);
+    fprintf(out, "\",\n    .quirks = %d,  /* %s */\n    .blocks = {\n", (int)profile, quirks_name(profile));
+    for (u16 pc = 0; pc < 4096; pc++)
+        if (has_block[pc]) fprintf(out, "        [0x%04X] = &info_%04X,\n", pc, pc);
+    fprintf(out, "    },\n};\n");
+    fclose(out);
+
+    printf("%s: %u 个基本块, %u 条指令, 兼容性配置 %s\n", rom_name, blocks, insts, quirks_name(profile));
+    return EXIT_SUCCESS;
+}
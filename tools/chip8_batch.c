@@ -0,0 +1,481 @@
+//无窗口批量运行程序: 不初始化SDL, 把清单里的每个任务放在独立的chip8_t上运行, 多个线程通过任务窃取分担任务
+//用法: chip8_batch <清单文件> [-o 输出文件] [--threads N] [--engine switch|cached|jit] [--ips N] [--resident] [--display-wait] [--no-idle-skip] [--no-fuse]
+//                   [--quirks vip|chip48|schip|xochip] [--quirks-db 数据库]
+//
+//清单每行一个任务, #开头的行是注释:
+//  <周期数> <种子> <输入脚本> [@存档文件] <ROM路径>
+//  输入脚本: -表示没有输入, 否则是逗号分隔的事件, <周期>+<键>表示按下, <周期>-<键>表示松开, 键是十六进制
+//  周期由调度器(scheduler.h)计算, 不开display wait时就是执行的指令数加上停在FX0A上等按键的周期
+//  存档文件: 从这个存档(savestate.h)开始运行, 跳过片头之类每次都一样的部分; 随机数状态也来自存档, 种子不起作用
+//  例如: 2000000 42 1000+5,1600-5 roms/Keypad Test [Hap, 2006].ch8
+//
+//每完成一个任务输出一行: <任务序号> <执行的指令数> <寄存器哈希> <内存哈希> <屏幕哈希> <ROM路径>
+//任务之间没有共享状态(随机数和FX0A的状态都在chip8_t里), 同样的清单每次运行的结果完全一样, 和线程数无关
+//
+//同一个ROM只载入一次, 所有任务共享它的内存镜像(写时复制); 虚拟机和私有页从每个线程自己的分配池中分配
+//--resident: 任务完成后虚拟机不释放, 所有任务的虚拟机同时留在内存中, 用来测量大批虚拟机同时存在时每个占多少内存
+//--no-idle-skip: 空转循环(scheduler.h)也逐条执行, 结果一样(roms/idle_skip.txt, 目标check_idle_skip), 用来测量引擎本身的速度
+//--no-fuse: 预解码缓存引擎不使用融合指令, 结果一样, 用来比较速度
+//--quirks: 所有任务的兼容性配置(quirks.h), 默认是vip; --quirks-db: 按ROM在数据库里查配置, 查不到的用--quirks的
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "chip8.h"
+#include "jit.h"
+#include "pool.h"
+#include "savestate.h"
+#include "scheduler.h"
+#include "quirks.h"
+
+#define MAX_THREADS 256
+
+//输入脚本中的一个按键事件
+typedef struct {
+    u64 cycle;  //调度器到了这个周期时生效
+    u8 key;
+    bool down;
+} input_event_t;
+
+//一个任务
+typedef struct {
+    char *rom_name;
+    char *state_file;   //NULL表示从头运行
+    const rom_image_t *image;   //和同一个ROM的其他任务共享
+    u64 cycles; //要运行的周期数
+    u32 seed;
+    input_event_t *events;  //按cycle排好序
+    u32 event_count;
+    quirks_profile_t quirks;    //兼容性配置, 和同一个ROM的其他任务一样
+} job_t;
+
+//每个线程的任务区间[begin, end), 低32位是begin, 高32位是end, 整个区间用一次CAS修改
+//自己从end取任务, 别的线程从begin窃取一半
+typedef struct {
+    _Atomic u64 range;
+    char pad[64 - sizeof(u64)];   //每个区间独占一条缓存行
+} deque_t;
+
+typedef struct {
+    job_t *jobs;
+    u32 job_count;
+    deque_t deques[MAX_THREADS];
+    u32 thread_count;
+    config_t config;
+    FILE *out;
+    pthread_mutex_t out_lock;
+    bool resident;  //任务完成后虚拟机不释放
+    _Atomic u64 total_insts;
+    _Atomic u64 skipped_cycles; //其中在空转循环里跳过的周期
+    _Atomic u64 private_bytes;  //所有任务结束时私有页的总字节数
+    _Atomic u64 reserved_bytes; //所有线程的分配池向系统申请的总字节数
+    _Atomic u32 live_chip8;     //结束时还留在内存中的虚拟机
+    _Atomic u32 failed;
+} batch_t;
+
+typedef struct {
+    batch_t *batch;
+    u32 id;
+} worker_t;
+
+static inline u64 make_range(const u32 begin, const u32 end) {
+    return ((u64)end << 32) | begin;
+}
+
+//从自己的区间末尾取一个任务, 区间空了返回false
+static bool pop_job(deque_t *deque, u32 *job) {
+    u64 range = atomic_load(&deque->range);
+    for (;;) {
+        const u32 begin = (u32)range, end = (u32)(range >> 32);
+        if (begin >= end) return false;
+        if (atomic_compare_exchange_weak(&deque->range, &range, make_range(begin, end - 1))) {
+            *job = end - 1;
+            return true;
+        }
+    }
+}
+
+//从别的线程的区间开头窃取一半任务放进自己的区间(自己的区间此时是空的, 别人也偷不到)
+static bool steal_jobs(batch_t *batch, const u32 thief) {
+    for (u32 n = 1; n < batch->thread_count; n++) {
+        deque_t *victim = &batch->deques[(thief + n) % batch->thread_count];
+        u64 range = atomic_load(&victim->range);
+        for (;;) {
+            const u32 begin = (u32)range, end = (u32)(range >> 32);
+            if (begin >= end) break;
+            const u32 take = (end - begin + 1) / 2;
+            if (atomic_compare_exchange_weak(&victim->range, &range, make_range(begin + take, end))) {
+                atomic_store(&batch->deques[thief].range, make_range(begin, begin + take));
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+//寄存器(V, I, PC, 栈, 计时器)的哈希, 逐个字段拼起来, 不受结构体填充的影响
+static u64 hash_registers(const chip8_t *chip8) {
+    u8 buf[sizeof chip8->V + 2 + 2 + 1 + sizeof chip8->stk + 2];
+    u8 *p = buf;
+
+    memcpy(p, chip8->V, sizeof chip8->V);
+    p += sizeof chip8->V;
+    *p++ = chip8->I >> 8;
+    *p++ = chip8->I & 0xFF;
+    *p++ = chip8->PC >> 8;
+    *p++ = chip8->PC & 0xFF;
+    *p++ = chip8->SP;
+    for (u8 i = 0; i < 16; i++) {
+        *p++ = chip8->stk[i] >> 8;
+        *p++ = chip8->stk[i] & 0xFF;
+    }
+    *p++ = chip8->delay_timer;
+    *p++ = chip8->sound_timer;
+
+    return hash_bytes(buf, sizeof buf);
+}
+
+//运行一个任务: 和前端一样用调度器推进, 计时器在同样的周期减一; 不用按帧切分, 直接运行到下一个按键事件
+static bool run_job(chip8_t *chip8, batch_t *batch, const job_t *job, u64 *executed) {
+    config_t config = batch->config;
+    config.seed = job->seed;
+    config.quirks = job->quirks;
+    if (!job->image) return false;
+    init_chip8_shared(chip8, config, job->image, job->rom_name);
+    if (job->state_file && !load_state_file(chip8, job->state_file)) return false;
+
+    scheduler_t sched;
+    init_scheduler(&sched, config);
+    u32 next_event = 0;
+    *executed = 0;
+
+    while (sched.cycle < job->cycles) {
+        //到时间的按键事件在下一条指令之前生效
+        for (; next_event < job->event_count && job->events[next_event].cycle <= sched.cycle; next_event++)
+            chip8->keypad[job->events[next_event].key] = job->events[next_event].down;
+
+        u64 until = job->cycles;
+        if (next_event < job->event_count && job->events[next_event].cycle < until) until = job->events[next_event].cycle;
+        *executed += run_scheduled(&sched, chip8, config, until - sched.cycle);
+    }
+
+    atomic_fetch_add(&batch->skipped_cycles, sched.skipped);
+    return true;
+}
+
+static void *worker_main(void *arg) {
+    const worker_t *worker = arg;
+    batch_t *batch = worker->batch;
+    chip8_pool_t *pool = create_pool();    //每个线程一个池, 不用加锁
+    if (!pool) return NULL;
+
+    chip8_t *chip8 = NULL;  //不常驻时每个线程只用一个虚拟机, 任务之间用init_chip8_shared重置
+    chip8_t **resident = NULL;  //常驻时完成的虚拟机都留在这里, 最后统一释放
+    u32 resident_count = 0, resident_capacity = 0;
+
+    for (;;) {
+        //自己的任务做完了就去窃取, 所有区间都空了就结束
+        u32 index;
+        if (!pop_job(&batch->deques[worker->id], &index)) {
+            if (!steal_jobs(batch, worker->id)) break;
+            continue;
+        }
+
+        if (!chip8) chip8 = pool_alloc_chip8(pool);
+        if (!chip8) {
+            atomic_fetch_add(&batch->failed, 1);
+            continue;
+        }
+
+        const job_t *job = &batch->jobs[index];
+        u64 executed = 0;
+        const bool ok = run_job(chip8, batch, job, &executed);
+
+        pthread_mutex_lock(&batch->out_lock);
+        if (ok) {
+            fprintf(batch->out, "%u\t%llu\t%016llx\t%016llx\t%016llx\t%s\n", index, (unsigned long long)executed,
+                    (unsigned long long)hash_registers(chip8), (unsigned long long)hash_ram(chip8),
+                    (unsigned long long)hash_display(chip8), job->rom_name);
+        }
+        else fprintf(batch->out, "%u\tFAILED\t%s\n", index, job->rom_name);
+        fflush(batch->out);
+        pthread_mutex_unlock(&batch->out_lock);
+
+        atomic_fetch_add(&batch->total_insts, executed);
+        atomic_fetch_add(&batch->private_bytes, (u64)__builtin_popcount(chip8->private_ram) * PAGE_SIZE
+                         + (u64)__builtin_popcount(chip8->private_decoded) * PAGE_SIZE * sizeof(decoded_t)
+                         + (chip8->screen ? sizeof(screen_t) : 0));
+        if (!ok) atomic_fetch_add(&batch->failed, 1);
+
+        //常驻: 只释放JIT缓存(它不属于虚拟机状态), 虚拟机本身留下, 下一个任务用新的
+        if (batch->resident && ok) {
+            if (resident_count == resident_capacity) {
+                resident_capacity = resident_capacity ? resident_capacity * 2 : 64;
+                chip8_t **grown = realloc(resident, resident_capacity * sizeof(chip8_t *));
+                if (!grown) break;
+                resident = grown;
+            }
+            jit_destroy(chip8->jit);
+            chip8->jit = NULL;
+            resident[resident_count++] = chip8;
+            chip8 = NULL;
+        }
+    }
+
+    //所有任务完成后统计池的占用, 再释放
+    const pool_stats_t stats = pool_stats(pool);
+    atomic_fetch_add(&batch->reserved_bytes, stats.reserved_bytes);
+    atomic_fetch_add(&batch->live_chip8, stats.live_chip8);
+
+    for (u32 i = 0; i < resident_count; i++) pool_free_chip8(pool, resident[i]);
+    free(resident);
+    if (chip8) pool_free_chip8(pool, chip8);
+    destroy_pool(pool);
+    return NULL;
+}
+
+//解析输入脚本, 例如"1000+5,1600-5"
+static bool parse_events(job_t *job, const char *script) {
+    if (strcmp(script, "-") == 0) return true;
+
+    u32 capacity = 1;
+    for (const char *c = script; *c; c++) capacity += (*c == ',');
+    job->events = calloc(capacity, sizeof(input_event_t));
+    if (!job->events) return false;
+
+    const char *p = script;
+    while (*p) {
+        char *end;
+        input_event_t *e = &job->events[job->event_count];
+        e->cycle = strtoull(p, &end, 10);
+        if (*end != '+' && *end != '-') return false;
+        e->down = (*end == '+');
+        e->key = (u8)strtoul(end + 1, &end, 16) & 0xF;
+        if (*end != ',' && *end != '\0') return false;
+
+        //事件要按时间排好序
+        if (job->event_count && e->cycle < job->events[job->event_count - 1].cycle) return false;
+        job->event_count++;
+        p = (*end == ',') ? end + 1 : end;
+    }
+    return true;
+}
+
+//读取清单, 返回任务数, 失败返回0
+static u32 load_manifest(const char *path, job_t **jobs) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "清单: %s 打开失败\n", path);
+        return 0;
+    }
+
+    u32 count = 0, capacity = 64;
+    *jobs = malloc(capacity * sizeof(job_t));
+    char line[4096];
+    u32 line_no = 0;
+
+    while (*jobs && fgets(line, sizeof line, file)) {
+        line_no++;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '#' || line[strspn(line, " \t")] == '\0') continue;
+
+        unsigned long long cycles;
+        unsigned long seed;
+        char script[2048];
+        int rom_start = 0;
+        if (sscanf(line, "%llu %lu %2047s %n", &cycles, &seed, script, &rom_start) != 3 || line[rom_start] == '\0') {
+            fprintf(stderr, "清单: %s 第%u行格式不对\n", path, line_no);
+            count = 0;
+            break;
+        }
+
+        if (count == capacity) {
+            capacity *= 2;
+            job_t *grown = realloc(*jobs, capacity * sizeof(job_t));
+            if (!grown) break;
+            *jobs = grown;
+        }
+
+        job_t *job = &(*jobs)[count];
+        *job = (job_t){ .cycles = cycles, .seed = (u32)seed };
+
+        //可选的@存档文件, 到下一个空白为止
+        if (line[rom_start] == '@') {
+            const size_t len = strcspn(&line[rom_start + 1], " \t");
+            const int next = rom_start + 1 + (int)len;
+            rom_start = next + (int)strspn(&line[next], " \t");
+            if (len == 0 || line[rom_start] == '\0') {
+                fprintf(stderr, "清单: %s 第%u行格式不对\n", path, line_no);
+                count = 0;
+                break;
+            }
+            job->state_file = malloc(len + 1);
+            if (!job->state_file) break;
+            memcpy(job->state_file, &line[next - len], len);
+            job->state_file[len] = '\0';
+        }
+
+        job->rom_name = malloc(strlen(&line[rom_start]) + 1);
+        if (!job->rom_name) break;
+        strcpy(job->rom_name, &line[rom_start]);
+        if (!parse_events(job, script)) {
+            fprintf(stderr, "清单: %s 第%u行输入脚本不对: %s\n", path, line_no, script);
+            count = 0;
+            break;
+        }
+        count++;
+    }
+
+    fclose(file);
+    return count;
+}
+
+static u32 cpu_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    const long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (u32)n : 1;
+#endif
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "使用: %s <清单文件> [-o 输出文件] [--threads N] [--engine switch|cached|jit] [--ips N] [--resident] [--display-wait] [--no-idle-skip] [--no-fuse] [--quirks 配置] [--quirks-db 数据库] 的格式来运行\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    static batch_t batch;
+    init_config(&batch.config);
+    const char *quirks_db = NULL;
+    batch.out = stdout;
+    batch.thread_count = cpu_count();
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            batch.out = fopen(argv[++i], "w");
+            if (!batch.out) {
+                fprintf(stderr, "无法写入: %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) batch.thread_count = (u32)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--ips") == 0 && i + 1 < argc) batch.config.insts_per_second = (u32)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--resident") == 0) batch.resident = true;
+        else if (strcmp(argv[i], "--display-wait") == 0) batch.config.display_wait = true;
+        else if (strcmp(argv[i], "--no-idle-skip") == 0) batch.config.skip_idle = false;
+        else if (strcmp(argv[i], "--no-fuse") == 0) batch.config.fuse = false;
+        else if (strcmp(argv[i], "--quirks-db") == 0 && i + 1 < argc) quirks_db = argv[++i];
+        else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+            if (!parse_quirks(argv[++i], &batch.config.quirks)) {
+                fprintf(stderr, "不认识的兼容性配置: %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "switch") == 0) batch.config.engine = ENGINE_SWITCH;
+            else if (strcmp(argv[i], "jit") == 0) batch.config.engine = ENGINE_JIT;
+            else batch.config.engine = ENGINE_CACHED;
+        }
+    }
+    if (batch.thread_count == 0) batch.thread_count = 1;
+    if (batch.thread_count > MAX_THREADS) batch.thread_count = MAX_THREADS;
+
+    batch.job_count = load_manifest(argv[1], &batch.jobs);
+    if (batch.job_count == 0) return EXIT_FAILURE;
+    if (batch.thread_count > batch.job_count) batch.thread_count = batch.job_count;
+
+    //每个不同的ROM只载入一次, 载入失败的任务在运行时报告失败
+    //unique[k]是第k个不同ROM的第一个任务
+    u32 *unique = malloc(batch.job_count * sizeof(u32));
+    u32 unique_count = 0, image_count = 0;
+    if (!unique) return EXIT_FAILURE;
+    for (u32 i = 0; i < batch.job_count; i++) {
+        u32 k = 0;
+        while (k < unique_count && strcmp(batch.jobs[unique[k]].rom_name, batch.jobs[i].rom_name) != 0) k++;
+        if (k < unique_count) {
+            batch.jobs[i].image = batch.jobs[unique[k]].image;
+            batch.jobs[i].quirks = batch.jobs[unique[k]].quirks;
+            continue;
+        }
+
+        unique[unique_count++] = i;
+        batch.jobs[i].image = load_rom_image(batch.jobs[i].rom_name);
+        batch.jobs[i].quirks = batch.config.quirks;
+        if (batch.jobs[i].image) image_count++;
+        //ROM载入成功时查数据库失败只可能是数据库本身的问题
+        if (batch.jobs[i].image && quirks_db && !lookup_quirks(quirks_db, batch.jobs[i].rom_name, &batch.jobs[i].quirks))
+            return EXIT_FAILURE;
+    }
+
+    //任务平均分成连续的区间, 先做完的线程再去窃取
+    for (u32 t = 0; t < batch.thread_count; t++) {
+        const u32 begin = (u32)((u64)batch.job_count * t / batch.thread_count);
+        const u32 end = (u32)((u64)batch.job_count * (t + 1) / batch.thread_count);
+        atomic_init(&batch.deques[t].range, make_range(begin, end));
+    }
+    pthread_mutex_init(&batch.out_lock, NULL);
+
+    const double start = now_seconds();
+    static pthread_t threads[MAX_THREADS];
+    static worker_t workers[MAX_THREADS];
+    for (u32 t = 0; t < batch.thread_count; t++) {
+        workers[t] = (worker_t){ .batch = &batch, .id = t };
+        pthread_create(&threads[t], NULL, worker_main, &workers[t]);
+    }
+    for (u32 t = 0; t < batch.thread_count; t++) pthread_join(threads[t], NULL);
+    const double seconds = now_seconds() - start;
+
+    const u64 total = atomic_load(&batch.total_insts);
+    fprintf(stderr, "%u 个任务, %u 个线程, 引擎 %s: %llu 条指令, 耗时 %.3f s, 每秒 %.0f 条\n",
+            batch.job_count, batch.thread_count, engine_name(batch.config.engine),
+            (unsigned long long)total, seconds, seconds > 0 ? total / seconds : 0.0);
+    const u64 skipped = atomic_load(&batch.skipped_cycles);
+    if (skipped)
+        fprintf(stderr, "空转循环: 其中跳过 %llu 个周期, 实际执行 %llu 条, 每秒 %.0f 条\n",
+                (unsigned long long)skipped, (unsigned long long)(total - skipped), seconds > 0 ? (total - skipped) / seconds : 0.0);
+
+    //每个虚拟机的内存: 结构体本身加上被写过而复制出来的私有页; ROM镜像由所有虚拟机共享
+    fprintf(stderr, "每个虚拟机: 状态 %u 字节 + 平均私有页 %.0f 字节; 共享镜像 %u 个, 共 %llu 字节\n",
+            (u32)sizeof(chip8_t), (double)atomic_load(&batch.private_bytes) / batch.job_count,
+            image_count, (unsigned long long)image_count * sizeof(rom_image_t));
+    if (batch.resident && atomic_load(&batch.live_chip8)) {
+        const u32 live = atomic_load(&batch.live_chip8);
+        const u64 reserved = atomic_load(&batch.reserved_bytes);
+        fprintf(stderr, "常驻: %u 个虚拟机同时在内存中, 分配池共 %llu 字节, 每个 %.0f 字节\n",
+                live, (unsigned long long)reserved, (double)reserved / live);
+    }
+
+    if (batch.out != stdout) fclose(batch.out);
+    pthread_mutex_destroy(&batch.out_lock);
+    for (u32 k = 0; k < unique_count; k++) free_rom_image((rom_image_t *)batch.jobs[unique[k]].image);
+    free(unique);
+    for (u32 i = 0; i < batch.job_count; i++) {
+        free(batch.jobs[i].rom_name);
+        free(batch.jobs[i].state_file);
+        free(batch.jobs[i].events);
+    }
+    free(batch.jobs);
+
+    return atomic_load(&batch.failed) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,166 @@
+//融合指令(超级指令)分析程序: 不初始化SDL, 对每个ROM
+//  1. 用参考实现逐条执行, 数出紧挨着执行的相邻指令对(后一条就在前一条的下一个地址), 列出最常见的几对, 用来决定融合哪些指令
+//  2. 打开统计(metrics.h), 用预解码缓存引擎执行, 报告每种融合指令执行了多少次
+//  3. 预解码缓存引擎分别在不融合和融合时执行同样多的周期, 比较每秒指令数, 并确认两次的最终状态一样
+//用法: chip8_fusion [--cycles N] [--top N] [--ips N] <ROM>...    例如: chip8_fusion roms/*.ch8
+//--ips: 时钟频率; 默认的600每个60Hz周期只有10条指令, 测速时调度的开销比较明显
+//空转循环不跳过(config.skip_idle), 测的是解释器本身; 没有输入, ROM等按键时就一直在等
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chip8.h"
+#include "metrics.h"
+#include "scheduler.h"
+
+#define TIMING_RUNS 3   //测速重复几次, 取最快的一次
+
+static double now_seconds(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct {
+    u8 first, second;
+    u64 count;
+} pair_t;
+
+static int compare_pairs(const void *a, const void *b) {
+    const u64 x = ((const pair_t *)a)->count, y = ((const pair_t *)b)->count;
+    return (x < y) - (x > y);   //多的在前
+}
+
+//参考实现逐条执行cycles个周期, 打印最常见的top对相邻指令
+static void print_pairs(const config_t config, const rom_image_t *image, const char rom_name[], const u64 cycles, const u32 top) {
+    static u64 counts[METRICS_CLASSES][METRICS_CLASSES];
+    memset(counts, 0, sizeof counts);
+
+    config_t reference = config;
+    reference.engine = ENGINE_SWITCH;
+    chip8_t chip8 = {0};
+    init_chip8_shared(&chip8, reference, image, rom_name);
+    scheduler_t sched;
+    init_scheduler(&sched, reference);
+
+    u64 total = 0;
+    int prev = -1;
+    u16 prev_pc = 0;
+    while (sched.cycle < cycles) {
+        const u16 pc = chip8.PC;
+        const u8 op = op_class((ram_read(&chip8, pc) << 8) | ram_read(&chip8, pc + 1));
+        if (!run_scheduled(&sched, &chip8, reference, 1)) continue;     //display wait空等的周期
+        if (prev >= 0 && pc == (u16)(prev_pc + 2)) {
+            counts[prev][op]++;
+            total++;
+        }
+        prev = op;
+        prev_pc = pc;
+    }
+    free_chip8(&chip8);
+
+    pair_t pairs[METRICS_CLASSES * METRICS_CLASSES];
+    u32 n = 0;
+    for (u8 a = 0; a < METRICS_CLASSES; a++)
+        for (u8 b = 0; b < METRICS_CLASSES; b++)
+            if (counts[a][b]) pairs[n++] = (pair_t){ a, b, counts[a][b] };
+    qsort(pairs, n, sizeof(pair_t), compare_pairs);
+
+    printf("  相邻指令:");
+    for (u32 i = 0; i < n && i < top; i++)
+        printf(" %s+%s %.1f%%", op_class_name(pairs[i].first), op_class_name(pairs[i].second), 100.0 * pairs[i].count / total);
+    printf(n ? "\n" : " 无\n");
+}
+
+//预解码缓存引擎执行cycles个周期, 返回耗时; final非NULL时留下最终状态
+static double time_cached(const config_t config, const rom_image_t *image, const char rom_name[], const u64 cycles,
+                          chip8_t *final) {
+    double best = 0;
+    for (u32 run = 0; run < TIMING_RUNS; run++) {
+        chip8_t chip8 = {0};
+        init_chip8_shared(&chip8, config, image, rom_name);
+        scheduler_t sched;
+        init_scheduler(&sched, config);
+
+        const double start = now_seconds();
+        run_scheduled(&sched, &chip8, config, cycles);
+        const double seconds = now_seconds() - start;
+        if (!run || seconds < best) best = seconds;
+
+        if (final && run == TIMING_RUNS - 1) *final = chip8;
+        else free_chip8(&chip8);
+    }
+    return best;
+}
+
+static bool analyze_rom(const config_t config, const char rom_name[], const u64 cycles, const u32 top) {
+    rom_image_t *image = load_rom_image(rom_name);
+    if (!image) return false;
+    printf("%s\n", rom_name);
+    print_pairs(config, image, rom_name, cycles, top);
+
+    //融合指令执行的次数
+    static metrics_t metrics;
+    memset(&metrics, 0, sizeof metrics);
+    chip8_t chip8 = {0};
+    init_chip8_shared(&chip8, config, image, rom_name);
+    chip8.metrics = &metrics;
+    scheduler_t sched;
+    init_scheduler(&sched, config);
+    const u64 executed = run_scheduled(&sched, &chip8, config, cycles);
+    free_chip8(&chip8);
+
+    printf("  融合指令:");
+    bool any = false;
+    for (u8 kind = 0; kind < METRICS_FUSIONS; kind++) {
+        if (!fusion_name(kind) || !metrics.fused[kind]) continue;
+        printf(" %s %llu 次(%.2f%%)", fusion_name(kind), (unsigned long long)metrics.fused[kind],
+               executed ? 100.0 * metrics.fused[kind] / executed : 0.0);
+        any = true;
+    }
+    printf(any ? "\n" : " 没有执行\n");
+
+    //速度: 同样的周期数, 不融合和融合
+    config_t plain = config;
+    plain.fuse = false;
+    chip8_t a, b;
+    const double plain_seconds = time_cached(plain, image, rom_name, cycles, &a);
+    const double fused_seconds = time_cached(config, image, rom_name, cycles, &b);
+    const bool same = same_state(&a, &b);
+    free_chip8(&a);
+    free_chip8(&b);
+
+    printf("  不融合 %.1fM/s, 融合 %.1fM/s, 加速 %.2fx%s\n", executed / plain_seconds / 1e6, executed / fused_seconds / 1e6,
+           plain_seconds / fused_seconds, same ? "" : ", 最终状态不一致!");
+    free_rom_image(image);
+    return same;
+}
+
+int main(int argc, char **argv) {
+    config_t config;
+    init_config(&config);
+    config.engine = ENGINE_CACHED;
+    config.skip_idle = false;
+    u64 cycles = 10000000;
+    u32 top = 6;
+    bool ok = true, any = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc) cycles = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) top = (u32)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--ips") == 0 && i + 1 < argc) config.insts_per_second = (u32)strtoul(argv[++i], NULL, 10);
+        else {
+            ok = analyze_rom(config, argv[i], cycles, top) && ok;
+            any = true;
+        }
+    }
+
+    if (!any) {
+        fprintf(stderr, "使用: %s [--cycles N] [--top N] [--ips N] <ROM>... 的格式来运行\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,403 @@
+//指令跟踪的解码器: 把前端(--trace)或其他程序用save_trace保存的二进制跟踪文件还原成每条指令的文字描述
+//用法: chip8_trace <跟踪文件> [--last N] [--changes]
+//  --last N: 只输出最后N条
+//  --changes: 每条描述后面再输出这条指令改写的寄存器和执行后的VF
+//描述和原来DEBUG模式下每条指令的printf输出一样
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "trace.h"
+
+//一条指令的描述; next是下一条记录(00EE返回的地址就是它的PC), 最后一条时为NULL
+static void print_record(const trace_record_t *r, const trace_record_t *next) {
+    const u16 NNN = r->opcode & 0x0FFF;
+    const u8 NN = r->opcode & 0x0FF;
+    const u8 N = r->opcode & 0x0F;
+    const u8 X = (r->opcode >> 8) & 0x0F;
+    const u8 Y = (r->opcode >> 4) & 0x0F;
+
+    printf("Address: 0x%04X, Opcode: 0x%04X Desc: ",
+           r->pc, r->opcode);
+
+    switch ((r->opcode >> 12) & 0x0F)
+    {
+    case 0x00:
+        if (NN == 0xE0)
+        {
+            // 0x00E0: Clear the screen
+            printf("Clear screen\n");
+        }
+        else if (NN == 0xEE)
+        {
+            // 0x00EE: Return from subroutine
+            // Set program counter to last address on subroutine stack ("pop" it off the stack)
+            //   so that next opcode will be gotten from that address.
+            printf("Return from subroutine to address 0x%04X\n",
+                   next ? next->pc : 0);
+        }
+        else if (X == 0 && (NN & 0xF0) == 0xC0)
+        {
+            // 0x00CN: SUPER-CHIP, scroll the selected planes down N pixels
+            printf("Scroll display down %u pixels\n", N);
+        }
+        else if (X == 0 && (NN & 0xF0) == 0xD0)
+        {
+            // 0x00DN: XO-CHIP, scroll the selected planes up N pixels
+            printf("Scroll display up %u pixels\n", N);
+        }
+        else if (X == 0 && (NN == 0xFB || NN == 0xFC))
+        {
+            // 0x00FB/0x00FC: SUPER-CHIP, scroll right/left 4 pixels
+            printf("Scroll display %s 4 pixels\n", NN == 0xFB ? "right" : "left");
+        }
+        else if (X == 0 && (NN == 0xFE || NN == 0xFF))
+        {
+            // 0x00FE/0x00FF: SUPER-CHIP, switch to 64x32/128x64 and clear the screen
+            printf("Switch to %s resolution\n", NN == 0xFF ? "high (128x64)" : "low (64x32)");
+        }
+        else
+        {
+            printf("Unimplemented Opcode.\n");
+        }
+        break;
+
+    case 0x01:
+        // 0x1NNN: Jump to address NNN
+        printf("Jump to address NNN (0x%04X)\n",
+               NNN);
+        break;
+
+    case 0x02:
+        // 0x2NNN: Call subroutine at NNN
+        // Store current address to return to on subroutine stack ("push" it on the stack)
+        //   and set program counter to subroutine address so that the next opcode
+        //   is gotten from there.
+        printf("Call subroutine at NNN (0x%04X)\n",
+               NNN);
+        break;
+
+    case 0x03:
+        // 0x3XNN: Check if VX == NN, if so, skip the next instruction
+        printf("Check if V%X (0x%02X) == NN (0x%02X), skip next instruction if true\n",
+               X, r->vx, NN);
+        break;
+
+    case 0x04:
+        // 0x4XNN: Check if VX != NN, if so, skip the next instruction
+        printf("Check if V%X (0x%02X) != NN (0x%02X), skip next instruction if true\n",
+               X, r->vx, NN);
+        break;
+
+    case 0x05:
+        // 0x5XY0: Check if VX == VY, if so, skip the next instruction
+        printf("Check if V%X (0x%02X) == V%X (0x%02X), skip next instruction if true\n",
+               X, r->vx,
+               Y, r->vy);
+        break;
+
+    case 0x06:
+        // 0x6XNN: Set register VX to NN
+        printf("Set register V%X = NN (0x%02X)\n",
+               X, NN);
+        break;
+
+    case 0x07:
+        // 0x7XNN: Set register VX += NN
+        printf("Set register V%X (0x%02X) += NN (0x%02X). Result: 0x%02X\n",
+               X, r->vx, NN,
+               r->vx + NN);
+        break;
+
+    case 0x08:
+        switch (N)
+        {
+        case 0:
+            // 0x8XY0: Set register VX = VY
+            printf("Set register V%X = V%X (0x%02X)\n",
+                   X, Y, r->vy);
+            break;
+
+        case 1:
+            // 0x8XY1: Set register VX |= VY
+            printf("Set register V%X (0x%02X) |= V%X (0x%02X); Result: 0x%02X\n",
+                   X, r->vx,
+                   Y, r->vy,
+                   r->vx | r->vy);
+            break;
+
+        case 2:
+            // 0x8XY2: Set register VX &= VY
+            printf("Set register V%X (0x%02X) &= V%X (0x%02X); Result: 0x%02X\n",
+                   X, r->vx,
+                   Y, r->vy,
+                   r->vx & r->vy);
+            break;
+
+        case 3:
+            // 0x8XY3: Set register VX ^= VY
+            printf("Set register V%X (0x%02X) ^= V%X (0x%02X); Result: 0x%02X\n",
+                   X, r->vx,
+                   Y, r->vy,
+                   r->vx ^ r->vy);
+            break;
+
+        case 4:
+            // 0x8XY4: Set register VX += VY, set VF to 1 if carry
+            printf("Set register V%X (0x%02X) += V%X (0x%02X), VF = 1 if carry; Result: 0x%02X, VF = %X\n",
+                   X, r->vx,
+                   Y, r->vy,
+                   r->vx + r->vy,
+                   ((u16)(r->vx + r->vy) > 255));
+            break;
+
+        case 5:
+            // 0x8XY5: Set register VX -= VY, set VF to 1 if there is not a borrow (result is positive/0)
+            printf("Set register V%X (0x%02X) -= V%X (0x%02X), VF = 1 if no borrow; Result: 0x%02X, VF = %X\n",
+                   X, r->vx,
+                   Y, r->vy,
+                   r->vx - r->vy,
+                   (r->vy <= r->vx));
+            break;
+
+        case 6:
+            // 0x8XY6: Set register VX >>= 1, store shifted off bit in VF
+            printf("Set register V%X (0x%02X) >>= 1, VF = shifted off bit (%X); Result: 0x%02X\n",
+                   X, r->vx,
+                   r->vx & 1,
+                   r->vx >> 1);
+            break;
+
+        case 7:
+            // 0x8XY7: Set register VX = VY - VX, set VF to 1 if there is not a borrow (result is positive/0)
+            printf("Set register V%X = V%X (0x%02X) - V%X (0x%02X), VF = 1 if no borrow; Result: 0x%02X, VF = %X\n",
+                   X, Y, r->vy,
+                   X, r->vx,
+                   r->vy - r->vx,
+                   (r->vx <= r->vy));
+            break;
+
+        case 0xE:
+            // 0x8XYE: Set register VX <<= 1, store shifted off bit in VF
+            printf("Set register V%X (0x%02X) <<= 1, VF = shifted off bit (%X); Result: 0x%02X\n",
+                   X, r->vx,
+                   (r->vx & 0x80) >> 7,
+                   r->vx << 1);
+            break;
+
+        default:
+            // Wrong/unimplemented opcode
+            printf("Unimplemented Opcode.\n");
+            break;
+        }
+        break;
+
+    case 0x09:
+        // 0x9XY0: Check if VX != VY; Skip next instruction if so
+        printf("Check if V%X (0x%02X) != V%X (0x%02X), skip next instruction if true\n",
+               X, r->vx,
+               Y, r->vy);
+        break;
+
+    case 0x0A:
+        // 0xANNN: Set index register I to NNN
+        printf("Set I to NNN (0x%04X)\n",
+               NNN);
+        break;
+
+    case 0x0B:
+        // 0xBNNN: Jump to V0 + NNN
+        printf("Set PC to V0 (0x%02X) + NNN (0x%04X); Result PC = 0x%04X\n",
+               r->vx, NNN, r->vx + NNN);
+        break;
+
+    case 0x0C:
+        // 0xCXNN: Sets register VX = rand() % 256 & NN (bitwise AND)
+        printf("Set V%X = rand() %% 256 & NN (0x%02X)\n",
+               X, NN);
+        break;
+
+    case 0x0D:
+        // 0xDXYN: Draw N-height sprite at coords X,Y; Read from memory location I;
+        //   Screen pixels are XOR'd with sprite bits,
+        //   VF (Carry flag) is set if any screen pixels are set off; This is useful
+        //   for collision detection or other reasons.
+        printf("Draw N (%u) height sprite at coords V%X (0x%02X), V%X (0x%02X) "
+               "from memory location I (0x%04X). Set VF = 1 if any pixels are turned off.\n",
+               N, X, r->vx, Y,
+               r->vy, r->I);
+        break;
+
+    case 0x0E:
+        if (NN == 0x9E)
+        {
+            // 0xEX9E: Skip next instruction if key in VX is pressed
+            printf("Skip next instruction if key in V%X (0x%02X) is pressed; Keypad value: %d\n",
+                   X, r->vx, (r->flags & TRACE_KEY) != 0);
+        }
+        else if (NN == 0xA1)
+        {
+            // 0xEX9E: Skip next instruction if key in VX is not pressed
+            printf("Skip next instruction if key in V%X (0x%02X) is not pressed; Keypad value: %d\n",
+                   X, r->vx, (r->flags & TRACE_KEY) != 0);
+        }
+        else
+        {
+            printf("Unimplemented Opcode.\n");
+        }
+        break;
+
+    case 0x0F:
+        switch (NN)
+        {
+        case 0x0A:
+            // 0xFX0A: VX = get_key(); Await until a keypress, and store in VX
+            printf("Await until a key is pressed; Store key in V%X\n",
+                   X);
+            break;
+
+        case 0x1E:
+            // 0xFX1E: I += VX; Add VX to register I. For non-Amiga CHIP8, does not affect VF
+            printf("I (0x%04X) += V%X (0x%02X); Result (I): 0x%04X\n",
+                   r->I, X, r->vx,
+                   r->I + r->vx);
+            break;
+
+        case 0x07:
+            // 0xFX07: VX = delay timer
+            printf("Set V%X = delay timer value (0x%02X)\n",
+                   X, r->delay_timer);
+            break;
+
+        case 0x15:
+            // 0xFX15: delay timer = VX
+            printf("Set delay timer value = V%X (0x%02X)\n",
+                   X, r->vx);
+            break;
+
+        case 0x18:
+            // 0xFX18: sound timer = VX
+            printf("Set sound timer value = V%X (0x%02X)\n",
+                   X, r->vx);
+            break;
+
+        case 0x29:
+            // 0xFX29: Set register I to sprite location in memory for character in VX (0x0-0xF)
+            printf("Set I to sprite location in memory for character in V%X (0x%02X). Result(VX*5) = (0x%02X)\n",
+                   X, r->vx, r->vx * 5);
+            break;
+
+        case 0x33:
+            // 0xFX33: Store BCD representation of VX at memory offset from I;
+            //   I = hundred's place, I+1 = ten's place, I+2 = one's place
+            printf("Store BCD representation of V%X (0x%02X) at memory from I (0x%04X)\n",
+                   X, r->vx, r->I);
+            break;
+
+        case 0x55:
+            // 0xFX55: Register dump V0-VX inclusive to memory offset from I;
+            //   SCHIP does not inrement I, CHIP8 does increment I
+            printf("Register dump V0-V%X (0x%02X) inclusive at memory from I (0x%04X)\n",
+                   X, r->vx, r->I);
+            break;
+
+        case 0x65:
+            // 0xFX65: Register load V0-VX inclusive from memory offset from I;
+            //   SCHIP does not inrement I, CHIP8 does increment I
+            printf("Register load V0-V%X (0x%02X) inclusive at memory from I (0x%04X)\n",
+                   X, r->vx, r->I);
+            break;
+
+        case 0x02:
+            // 0xF002: XO-CHIP, load the 16-byte audio pattern from I
+            printf("Load audio pattern from memory at I (0x%04X)\n", r->I);
+            break;
+
+        case 0x3A:
+            // 0xFX3A: XO-CHIP, set the audio pitch register to VX
+            printf("Set audio pitch = V%X (0x%02X)\n", X, r->vx);
+            break;
+
+        case 0x01:
+            // 0xFN01: XO-CHIP, select the bitplanes N for drawing, clearing and scrolling
+            printf("Select bitplanes 0x%X\n", X);
+            break;
+
+        default:
+            printf("Unimplemented Opcode.\n");
+            break;
+        }
+        break;
+
+    default:
+        printf("Unimplemented Opcode.\n");
+        break; // Unimplemented or invalid opcode
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "使用: %s <跟踪文件> [--last N] [--changes]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    u64 last = 0;
+    bool changes = false;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--last") == 0 && i + 1 < argc) last = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--changes") == 0) changes = true;
+        else {
+            fprintf(stderr, "不认识的参数: %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    FILE *file = fopen(argv[1], "rb");
+    if (!file) {
+        fprintf(stderr, "跟踪: %s 打开失败\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    trace_header_t header;
+    if (fread(&header, sizeof header, 1, file) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof header.magic) != 0) {
+        fprintf(stderr, "跟踪: %s 不是跟踪文件\n", argv[1]);
+        fclose(file);
+        return EXIT_FAILURE;
+    }
+    if (header.version != TRACE_VERSION || header.record_size != sizeof(trace_record_t)) {
+        fprintf(stderr, "跟踪: 版本 %u 不支持, 当前版本 %u\n", header.version, TRACE_VERSION);
+        fclose(file);
+        return EXIT_FAILURE;
+    }
+
+    trace_record_t *records = malloc(header.count ? header.count * sizeof(trace_record_t) : 1);
+    if (!records || fread(records, sizeof(trace_record_t), header.count, file) != header.count) {
+        fprintf(stderr, "跟踪: %s 读取失败\n", argv[1]);
+        free(records);
+        fclose(file);
+        return EXIT_FAILURE;
+    }
+    fclose(file);
+
+    //文件里最旧的一条是开始跟踪以来的第first条
+    const u64 first = header.total - header.count;
+    const u64 start = (last && last < header.count) ? header.count - last : 0;
+    printf("# 共 %llu 条指令, 文件中是第 %llu ~ %llu 条\n", (unsigned long long)header.total,
+           (unsigned long long)first, (unsigned long long)(header.total ? header.total - 1 : 0));
+
+    for (u64 i = start; i < header.count; i++) {
+        const trace_record_t *r = &records[i];
+        print_record(r, i + 1 < header.count ? &records[i + 1] : NULL);
+        if (changes) {
+            printf("    =>");
+            if (r->reg != 0xFF) printf(" V%X = 0x%02X,", r->reg, r->value);
+            printf(" VF = %u\n", (r->flags & TRACE_VF) ? 1 : 0);
+        }
+    }
+
+    free(records);
+    return EXIT_SUCCESS;
+}